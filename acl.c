@@ -36,34 +36,16 @@ acl_match_client(struct acl *a, struct http_client *client, in_addr_t *ip) {
 	return 0;
 }
 
-int
-acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client) {
-
-	char *always_off[] = {"MULTI", "EXEC", "WATCH", "DISCARD", "SELECT"};
+/* authorized is the default, before any ACL is applied */
+static int
+acl_allow_name(const char *cmd_name, size_t cmd_len, int authorized,
+		struct conf *cfg, struct http_client *client) {
 
 	unsigned int i;
-	int authorized = 1;
 	struct acl *a;
 
 	in_addr_t client_addr;
 
-	const char *cmd_name;
-	size_t cmd_len;
-
-	if(cmd->count == 0) {
-		return 0;
-	}
-
-	cmd_name = cmd->argv[0];
-	cmd_len = cmd->argv_len[0];
-
-	/* some commands are always disabled, regardless of the config file. */
-	for(i = 0; i < sizeof(always_off) / sizeof(always_off[0]); ++i) {
-		if(strncasecmp(always_off[i], cmd_name, cmd_len) == 0) {
-			return 0;
-		}
-	}
-
 	/* find client's address */
 	client_addr = ntohl(client->addr);
 
@@ -96,3 +78,30 @@ acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client)
 	return authorized;
 }
 
+
+int
+acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client) {
+
+	char *always_off[] = {"MULTI", "EXEC", "WATCH", "DISCARD", "SELECT"};
+	unsigned int i;
+
+	if(cmd->count == 0) {
+		return 0;
+	}
+
+	/* some commands are always disabled, regardless of the config file. */
+	for(i = 0; i < sizeof(always_off) / sizeof(always_off[0]); ++i) {
+		if(strncasecmp(always_off[i], cmd->argv[0], cmd->argv_len[0]) == 0) {
+			return 0;
+		}
+	}
+
+	return acl_allow_name(cmd->argv[0], cmd->argv_len[0], 1, cfg, client);
+}
+
+/* /_stats: disabled unless an ACL enables the STATS pseudo-command */
+int
+acl_allow_stats(struct conf *cfg, struct http_client *client) {
+
+	return acl_allow_name("STATS", 5, 0, cfg, client);
+}
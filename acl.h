@@ -36,4 +36,7 @@ acl_match_client(struct acl *a, struct http_client *client, in_addr_t *ip);
 int
 acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client);
 
+int
+acl_allow_stats(struct conf *cfg, struct http_client *client);
+
 #endif
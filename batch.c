@@ -0,0 +1,359 @@
+#include "batch.h"
+#include "cmd.h"
+#include "conf.h"
+#include "acl.h"
+#include "client.h"
+#include "pool.h"
+#include "cache.h"
+#include "worker.h"
+#include "server.h"
+
+#include "formats/common.h"
+#include "formats/json.h"
+#include "formats/raw.h"
+#ifdef MSGPACK
+#include "formats/msgpack.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+/**
+ * Batch endpoint: POST /_batch with a list of commands in the body,
+ * e.g. [["GET","a"],["INCR","b"]]. All the commands are pipelined on a
+ * single Redis connection and the replies are returned as one list.
+ *
+ * Transaction endpoint: POST /_multi takes the same list of commands and
+ * wraps it in MULTI/EXEC. The whole transaction is written to the
+ * connection at once so no other command can be interleaved, and the
+ * connection is always out of the MULTI state after EXEC.
+ */
+
+typedef char *(*wrap_fun)(const struct cmd *, const redisReply *, size_t *);
+typedef char *(*wrap_list_fun)(const struct cmd *, char **, size_t *, int, size_t *);
+
+struct batch_format {
+	formatting_fun f;	/* as selected by cmd_select_format */
+	wrap_fun wrap;		/* encodes a single reply */
+	wrap_list_fun wrap_list;	/* joins all the encoded replies */
+	const char *ct;
+};
+
+static const struct batch_format batch_formats[] = {
+	{.f = json_reply, .wrap = json_wrap_reply, .wrap_list = json_wrap_list, .ct = "application/json"},
+	{.f = raw_reply, .wrap = raw_wrap_reply, .wrap_list = raw_wrap_list, .ct = "binary/octet-stream"},
+#ifdef MSGPACK
+	{.f = msgpack_reply, .wrap = msgpack_wrap_reply, .wrap_list = msgpack_wrap_list, .ct = "application/x-msgpack"},
+#endif
+};
+
+struct batch;
+
+struct batch_item {
+	struct batch *b;
+	struct cmd *cmd;
+
+	char *out;	/* encoded reply */
+	size_t out_sz;
+};
+
+struct batch {
+	struct cmd *cmd;	/* HTTP side of the request */
+	const struct batch_format *fmt;
+	batch_type_t type;
+
+	struct batch_item *items;
+	int count;
+	int pending;	/* replies we're still waiting for */
+	int failed;	/* lost the Redis connection */
+	struct timeval sent_at;	/* counts as one command in flight on its connection */
+};
+
+static int
+batch_match_path(const char *path, size_t path_sz, const char *name, size_t name_sz) {
+
+	/* endpoint name, with an optional extension or query string */
+	return (path_sz >= name_sz && memcmp(path, name, name_sz) == 0 &&
+		(path_sz == name_sz || path[name_sz] == '.' || path[name_sz] == '?'));
+}
+
+batch_type_t
+batch_endpoint(const char *path, size_t path_sz) {
+
+	if(batch_match_path(path, path_sz, "/_batch", 7)) {
+		return BATCH_PIPELINE;
+	} else if(batch_match_path(path, path_sz, "/_multi", 7)) {
+		return BATCH_TRANSACTION;
+	}
+	return BATCH_NONE;
+}
+
+static void
+batch_free(struct batch *b) {
+
+	int i;
+	for(i = 0; i < b->count; ++i) {
+		cmd_free(b->items[i].cmd);
+		free(b->items[i].out);
+	}
+	free(b->items);
+	free(b);
+}
+
+/* encode an error reply that was not generated by Redis. */
+static void
+batch_item_error(struct batch_item *it, const char *msg) {
+
+	redisReply r;
+	memset(&r, 0, sizeof(r));
+	r.type = REDIS_REPLY_ERROR;
+	r.str = (char*)msg;
+	r.len = strlen(msg);
+
+	it->out = it->b->fmt->wrap(it->cmd, &r, &it->out_sz);
+}
+
+static void
+batch_send(struct batch *b) {
+
+	int i;
+	char *out, **items;
+	size_t sz, *items_sz;
+
+	if(b->failed) {
+		format_send_error(b->cmd, 503, "Service Unavailable");
+		batch_free(b);
+		return;
+	}
+
+	items = calloc(b->count, sizeof(char*));
+	items_sz = calloc(b->count, sizeof(size_t));
+	for(i = 0; i < b->count; ++i) {
+		items[i] = b->items[i].out;
+		items_sz[i] = b->items[i].out_sz;
+	}
+
+	out = b->fmt->wrap_list(b->cmd, items, items_sz, b->count, &sz);
+	format_send_reply(b->cmd, out, sz, b->fmt->ct);
+
+	free(out);
+	free(items);
+	free(items_sz);
+	batch_free(b);
+}
+
+/* the whole batch has been answered, its connection has room again */
+static void
+batch_on_done(redisAsyncContext *ac, struct batch *b, int ok) {
+
+	struct pool *p = ac->data;
+
+	pool_on_reply(ac, ok, &b->sent_at);
+	if(p && ok) {
+		pool_dispatch(p);
+	}
+}
+
+static void
+batch_on_reply(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct batch_item *it = privdata;
+	struct batch *b = it->b;
+
+	if(r == NULL) { /* broken Redis link */
+		b->failed = 1;
+	} else {
+		it->out = b->fmt->wrap(it->cmd, r, &it->out_sz);
+	}
+	if(it->cmd->w->cache && !cmd_is_readonly(it->cmd)) {
+		cache_on_write(it->cmd->w->cache, it->cmd);
+	}
+
+	if(--b->pending == 0) {
+		batch_on_done(ac, b, !b->failed);
+		batch_send(b);
+	}
+}
+
+static void
+batch_on_exec(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct batch *b = privdata;
+	redisReply *reply = r;
+	int i;
+
+	b->pending = 0;
+	batch_on_done(ac, b, reply != NULL);
+	for(i = 0; i < b->count; ++i) {
+		if(b->items[i].cmd->w->cache && !cmd_is_readonly(b->items[i].cmd)) {
+			cache_on_write(b->items[i].cmd->w->cache, b->items[i].cmd);
+		}
+	}
+	if(reply == NULL) { /* broken Redis link */
+		b->failed = 1;
+	} else if(reply->type == REDIS_REPLY_ARRAY && (int)reply->elements == b->count) {
+		for(i = 0; i < b->count; ++i) {
+			struct batch_item *it = &b->items[i];
+			it->out = b->fmt->wrap(it->cmd, reply->element[i], &it->out_sz);
+		}
+	} else { /* transaction aborted, return the EXEC error on its own. */
+		struct cmd *exec = cmd_new(1);
+		char *out;
+		size_t sz;
+
+		exec->argv[0] = strdup("EXEC");
+		exec->argv_len[0] = 4;
+		out = b->fmt->wrap(exec, reply, &sz);
+		format_send_reply(b->cmd, out, sz, b->fmt->ct);
+
+		free(out);
+		cmd_free(exec);
+		batch_free(b);
+		return;
+	}
+
+	batch_send(b);
+}
+
+cmd_response_t
+batch_run(struct worker *w, struct http_client *client, batch_type_t type,
+		const char *uri, size_t uri_len,
+		const char *body, size_t body_len) {
+
+	struct batch *b;
+	struct cmd **cmds = NULL;
+	formatting_fun f_format;
+	redisAsyncContext *ac;
+	struct pool *p = w->pool;
+	const char *body_type;
+	char *qmark = memchr(uri, '?', uri_len);
+	unsigned int i;
+	int count;
+
+	/* the commands would need to be routed one by one */
+	if(!body || !body_len || w->cluster || w->shards) {
+		return CMD_PARAM_ERROR;
+	}
+	if(qmark) {
+		uri_len = qmark - uri;
+	}
+
+	b = calloc(1, sizeof(struct batch));
+	b->type = type;
+	b->cmd = cmd_new(0);
+	b->cmd->database = w->s->cfg->database;
+
+	/* output format, from the extension */
+	cmd_select_format(client, b->cmd, uri, uri_len, &f_format);
+	for(i = 0; i < sizeof(batch_formats)/sizeof(batch_formats[0]); ++i) {
+		if(batch_formats[i].f == f_format) {
+			b->fmt = &batch_formats[i];
+		}
+	}
+
+	/* decode the list of commands */
+	body_type = client_get_header(client, "Content-Type");
+	if(body_type && strncasecmp(body_type, "application/x-msgpack", 21) == 0) {
+#ifdef MSGPACK
+		count = msgpack_batch_extract(body, body_len, &cmds);
+#else
+		count = -1;
+#endif
+	} else {
+		count = json_batch_extract(body, body_len, &cmds);
+	}
+
+	if(!b->fmt || count <= 0) {
+		cmd_free(b->cmd);
+		free(b);
+		return CMD_PARAM_ERROR;
+	}
+
+	/* a blocking command would hold up the main pool: see cmd_execute */
+	for(i = 0; w->blocking && i < (unsigned int)count; ++i) {
+		if(cmds[i] && cmd_is_blocking(cmds[i])) {
+			p = w->blocking;
+		}
+	}
+
+	/* get a connection from the pool */
+	if(!(ac = (redisAsyncContext*)pool_get_context(p))) {
+		for(i = 0; i < (unsigned int)count; ++i) {
+			cmd_free(cmds[i]);
+		}
+		free(cmds);
+		cmd_free(b->cmd);
+		free(b);
+		return CMD_REDIS_UNAVAIL;
+	}
+
+	/* add HTTP info, and the same deadline as a single command */
+	cmd_setup(b->cmd, client);
+	cmd_set_deadline(b->cmd);
+
+	b->count = count;
+	b->items = calloc(count, sizeof(struct batch_item));
+	for(i = 0; i < (unsigned int)count; ++i) {
+		b->items[i].b = b;
+		b->items[i].cmd = cmds[i];
+	}
+	free(cmds);
+
+	/* check every command and encode errors inline */
+	for(i = 0; i < (unsigned int)count; ++i) {
+		struct batch_item *it = &b->items[i];
+
+		if(!it->cmd) {
+			it->cmd = cmd_new(0);
+			batch_item_error(it, "Bad Request");
+		} else if(cmd_is_subscribe(it->cmd)
+				|| !acl_allow_command(it->cmd, w->s->cfg, client)) {
+			batch_item_error(it, "Forbidden");
+		} else {
+			b->pending++;
+		}
+	}
+
+	if(type == BATCH_TRANSACTION) {
+		/* a transaction runs all of its commands or none of them. */
+		if(b->pending != count) {
+			cmd_free(b->cmd);
+			batch_free(b);
+			return CMD_ACL_FAIL;
+		}
+
+		redisAsyncCommand(ac, NULL, NULL, "MULTI");
+		for(i = 0; i < (unsigned int)count; ++i) {
+			struct batch_item *it = &b->items[i];
+			it->cmd->w = w;
+			redisAsyncCommandArgv(ac, NULL, NULL, it->cmd->count,
+					(const char **)it->cmd->argv, it->cmd->argv_len);
+		}
+		redisAsyncCommand(ac, batch_on_exec, b, "EXEC");
+		gettimeofday(&b->sent_at, NULL);
+		pool_on_send(ac);
+		return CMD_SENT;
+	}
+
+	if(b->pending == 0) { /* nothing to send to Redis */
+		batch_send(b);
+		return CMD_SENT;
+	}
+
+	/* pipeline all the commands on the same connection */
+	for(i = 0; i < (unsigned int)count; ++i) {
+		struct batch_item *it = &b->items[i];
+		if(it->out) continue;
+
+		it->cmd->w = w;
+		redisAsyncCommandArgv(ac, batch_on_reply, it, it->cmd->count,
+				(const char **)it->cmd->argv, it->cmd->argv_len);
+	}
+	gettimeofday(&b->sent_at, NULL);
+	pool_on_send(ac);
+
+	return CMD_SENT;
+}
@@ -0,0 +1,22 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "cmd.h"
+
+struct http_client;
+struct worker;
+
+typedef enum {BATCH_NONE,
+	BATCH_PIPELINE,	/* POST /_batch */
+	BATCH_TRANSACTION	/* POST /_multi */
+} batch_type_t;
+
+cmd_response_t
+batch_run(struct worker *w, struct http_client *client, batch_type_t type,
+		const char *uri, size_t uri_len,
+		const char *body, size_t body_len);
+
+batch_type_t
+batch_endpoint(const char *path, size_t path_sz);
+
+#endif
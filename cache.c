@@ -0,0 +1,533 @@
+#include "cache.h"
+#include "cmd.h"
+#include "pool.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "slog.h"
+#include "formats/common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Local cache of formatted read replies, kept correct by Redis 6 client-side
+ * caching: a dedicated connection per worker receives the invalidation
+ * messages on __redis__:invalidate, either for all the keys matching some
+ * prefixes (BCAST) or for the keys read with CLIENT CACHING yes (OPTIN).
+ *
+ * Nothing is served or stored while this connection is down.
+ */
+
+struct cache_entry {
+	/* formatted request */
+	char *key;
+	size_t key_sz;
+	unsigned int hash;
+
+	/* Redis key */
+	char *rkey;
+	size_t rkey_sz;
+	unsigned int rhash;
+
+	/* formatted reply */
+	char *body;
+	size_t body_sz;
+	char *ct;
+	char *etag;
+	size_t cost;
+
+	struct cache_entry *next;	/* same bucket */
+	struct cache_entry *knext;	/* same Redis key bucket */
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+struct cache_tracking {
+	struct cache *c;
+	unsigned long generation;
+};
+
+static void
+cache_connect(struct cache *c);
+
+struct cache *
+cache_new(struct worker *w) {
+
+	struct cache *c = calloc(1, sizeof(struct cache));
+	size_t size = w->s->cfg->cache_size / 1024;
+
+	/* about one bucket per KB, as a power of two */
+	c->size = 1024;
+	while(c->size < size && c->size < (1 << 20)) {
+		c->size <<= 1;
+	}
+	c->buckets = calloc(c->size, sizeof(struct cache_entry *));
+	c->kbuckets = calloc(c->size, sizeof(struct cache_entry *));
+	c->tracked = calloc(w->pool->count, sizeof(redisAsyncContext *));
+	c->w = w;
+
+	return c;
+}
+
+static unsigned long
+cache_epoch(struct cache *c, unsigned int rhash) {
+	/* both are increasing, so their sum changes when either of them does. */
+	return c->epoch + c->key_epochs[rhash % CACHE_KEY_EPOCHS];
+}
+
+static void
+cache_remove(struct cache *c, struct cache_entry *e) {
+
+	struct cache_entry **prev;
+
+	for(prev = &c->buckets[e->hash & (c->size - 1)]; *prev; prev = &(*prev)->next) {
+		if(*prev == e) {
+			*prev = e->next;
+			break;
+		}
+	}
+	for(prev = &c->kbuckets[e->rhash & (c->size - 1)]; *prev; prev = &(*prev)->knext) {
+		if(*prev == e) {
+			*prev = e->knext;
+			break;
+		}
+	}
+
+	if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else c->lru_head = e->lru_next;
+	if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else c->lru_tail = e->lru_prev;
+
+	c->bytes -= e->cost;
+	c->entries--;
+
+	free(e->key);
+	free(e->rkey);
+	free(e->body);
+	free(e->ct);
+	free(e->etag);
+	free(e);
+}
+
+static void
+cache_flush(struct cache *c) {
+
+	c->epoch++;
+	while(c->lru_head) {
+		cache_remove(c, c->lru_head);
+	}
+}
+
+static void
+cache_invalidate(struct cache *c, const char *k, size_t sz) {
+
+	unsigned int rhash = cmd_hash(k, sz);
+	struct cache_entry *e, *next;
+
+	c->key_epochs[rhash % CACHE_KEY_EPOCHS]++;
+
+	/* the same key might have been read from different databases or formats */
+	for(e = c->kbuckets[rhash & (c->size - 1)]; e; e = next) {
+		next = e->knext;
+		if(e->rhash == rhash && e->rkey_sz == sz && memcmp(e->rkey, k, sz) == 0) {
+			cache_remove(c, e);
+			c->invalidations++;
+		}
+	}
+}
+
+/**
+ * A write sent by webdis was replied to. The invalidation message from Redis
+ * comes on another connection and might still be on its way: the keys are
+ * evicted now, so that the client reads its own write. Not knowing which
+ * arguments are keys, all of them are evicted.
+ */
+void
+cache_on_write(struct cache *c, struct cmd *cmd) {
+
+	int i;
+
+	for(i = 1; i < cmd->count; ++i) {
+		cache_invalidate(c, cmd->argv[i], cmd->argv_len[i]);
+	}
+}
+
+static int
+cache_key_allowed(struct cache *c, const char *k, size_t sz) {
+
+	struct conf *cfg = c->w->s->cfg;
+	int i;
+
+	/* in BCAST mode, we're only told about keys matching the prefixes */
+	if(cfg->cache_optin || cfg->cache_prefix_count == 0) {
+		return 1;
+	}
+	for(i = 0; i < cfg->cache_prefix_count; ++i) {
+		size_t len = strlen(cfg->cache_prefixes[i]);
+		if(len <= sz && memcmp(cfg->cache_prefixes[i], k, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Returns 1 if the command was answered from the cache. Otherwise, the
+ * command is marked so that its reply can be stored once it arrives.
+ */
+int
+cache_lookup(struct cache *c, struct cmd *cmd, formatting_fun f_format) {
+
+	struct cache_entry *e;
+	size_t key_sz;
+	char *key;
+	unsigned int hash;
+
+	if(!c->ready || cmd->is_websocket || cmd->primary || !cmd_reads_single_key(cmd)
+			|| !cache_key_allowed(c, cmd->argv[1], cmd->argv_len[1])) {
+		return 0;
+	}
+
+	key = cmd_reply_key(cmd, f_format, &key_sz);
+	hash = cmd_hash(key, key_sz);
+
+	for(e = c->buckets[hash & (c->size - 1)]; e; e = e->next) {
+		if(e->hash == hash && e->key_sz == key_sz && memcmp(e->key, key, key_sz) == 0) {
+
+			/* move to the front of the LRU list */
+			if(e != c->lru_head) {
+				e->lru_prev->lru_next = e->lru_next;
+				if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+				else c->lru_tail = e->lru_prev;
+				e->lru_prev = NULL;
+				e->lru_next = c->lru_head;
+				c->lru_head->lru_prev = e;
+				c->lru_head = e;
+			}
+
+			c->hits++;
+			free(key);
+			format_send_cached(cmd, e->body, e->body_sz, e->ct, e->etag);
+			return 1;
+		}
+	}
+
+	c->misses++;
+	cmd->cache_key = key;
+	cmd->cache_key_sz = key_sz;
+	cmd->cache_epoch = cache_epoch(c, cmd_hash(cmd->argv[1], cmd->argv_len[1]));
+	return 0;
+}
+
+/**
+ * Called just before a cacheable command is sent to Redis.
+ */
+void
+cache_prepare(struct cache *c, struct cmd *cmd) {
+
+	int i;
+
+	/* a replica might reply with a value we've already seen invalidated */
+	if(cmd->replica) {
+		free(cmd->cache_key);
+		cmd->cache_key = NULL;
+		return;
+	}
+
+	if(!c->w->s->cfg->cache_optin) {
+		return;
+	}
+
+	/* ask Redis to track the key we're about to read */
+	for(i = 0; i < c->tracked_count; ++i) {
+		if(c->tracked[i] == cmd->ac) {
+			redisAsyncCommand(cmd->ac, NULL, NULL, "CLIENT CACHING yes");
+			return;
+		}
+	}
+
+	/* no invalidation would be sent for this key, don't store it. */
+	free(cmd->cache_key);
+	cmd->cache_key = NULL;
+}
+
+void
+cache_store(struct cache *c, struct cmd *cmd, const char *p, size_t sz,
+		const char *ct, const char *etag) {
+
+	struct cache_entry *e, *next;
+	unsigned int rhash = cmd_hash(cmd->argv[1], cmd->argv_len[1]);
+	unsigned int hash = cmd_hash(cmd->cache_key, cmd->cache_key_sz);
+	size_t ct_sz = strlen(ct), etag_sz = etag ? strlen(etag) : 0;
+	size_t cost = sizeof(struct cache_entry) + cmd->cache_key_sz
+		+ cmd->argv_len[1] + sz + ct_sz + etag_sz + 2;
+
+	/* invalidated while the reply was on its way, or too big */
+	if(!c->ready || cmd->cache_epoch != cache_epoch(c, rhash)
+			|| cost > c->w->s->cfg->cache_size / 4) {
+		return;
+	}
+
+	/* concurrent misses for the same request */
+	for(e = c->buckets[hash & (c->size - 1)]; e; e = next) {
+		next = e->next;
+		if(e->hash == hash && e->key_sz == cmd->cache_key_sz
+				&& memcmp(e->key, cmd->cache_key, e->key_sz) == 0) {
+			cache_remove(c, e);
+		}
+	}
+
+	e = calloc(1, sizeof(struct cache_entry));
+	e->key = cmd->cache_key;
+	e->key_sz = cmd->cache_key_sz;
+	e->hash = hash;
+	cmd->cache_key = NULL; /* now owned by the entry */
+
+	e->rkey = malloc(cmd->argv_len[1]);
+	memcpy(e->rkey, cmd->argv[1], cmd->argv_len[1]);
+	e->rkey_sz = cmd->argv_len[1];
+	e->rhash = rhash;
+
+	e->body = malloc(sz);
+	memcpy(e->body, p, sz);
+	e->body_sz = sz;
+	e->ct = strdup(ct);
+	e->etag = etag ? strdup(etag) : NULL;
+	e->cost = cost;
+
+	e->next = c->buckets[hash & (c->size - 1)];
+	c->buckets[hash & (c->size - 1)] = e;
+	e->knext = c->kbuckets[rhash & (c->size - 1)];
+	c->kbuckets[rhash & (c->size - 1)] = e;
+
+	e->lru_next = c->lru_head;
+	if(c->lru_head) c->lru_head->lru_prev = e;
+	else c->lru_tail = e;
+	c->lru_head = e;
+
+	c->bytes += cost;
+	c->entries++;
+	c->inserts++;
+
+	/* evict least recently used entries */
+	while(c->bytes > c->w->s->cfg->cache_size && c->lru_tail) {
+		cache_remove(c, c->lru_tail);
+		c->evictions++;
+	}
+}
+
+static void
+cache_can_connect(int fd, short event, void *ptr) {
+
+	(void)fd;
+	(void)event;
+
+	cache_connect(ptr);
+}
+
+/* invalidations might have been missed, start over. */
+static void
+cache_lost(struct cache *c) {
+
+	struct timeval tv = {1, 0};
+
+	c->ac = NULL;
+	c->ready = 0;
+	c->tracked_count = 0;
+	cache_flush(c);
+
+	if(!c->disabled) {
+		evtimer_set(&c->ev_reconnect, cache_can_connect, c);
+		event_base_set(c->w->base, &c->ev_reconnect);
+		evtimer_add(&c->ev_reconnect, &tv);
+	}
+}
+
+/* Redis doesn't support client-side caching. */
+static void
+cache_fail(struct cache *c, redisAsyncContext *ac, const char *msg) {
+
+	slog(c->w->s, WEBDIS_ERROR, msg, 0);
+
+	c->disabled = 1;
+	cache_lost(c);
+	redisAsyncDisconnect(ac);
+}
+
+static void
+cache_on_pool_tracking(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cache_tracking *ct = privdata;
+	redisReply *reply = r;
+	struct cache *c = ct->c;
+
+	if(reply && reply->type == REDIS_REPLY_STATUS && ct->generation == c->generation
+			&& c->ready && c->tracked_count < c->w->pool->count) {
+		c->tracked[c->tracked_count++] = ac;
+	}
+	free(ct);
+}
+
+static void
+cache_enable_tracking(struct cache *c, const redisAsyncContext *ac) {
+
+	struct cache_tracking *ct = malloc(sizeof(struct cache_tracking));
+	ct->c = c;
+	ct->generation = c->generation;
+
+	redisAsyncCommand((redisAsyncContext *)ac, cache_on_pool_tracking, ct,
+			"CLIENT TRACKING on REDIRECT %lld OPTIN", c->client_id);
+}
+
+void
+cache_on_pool_connect(struct cache *c, const redisAsyncContext *ac) {
+
+	if(c->ready && c->w->s->cfg->cache_optin) {
+		cache_enable_tracking(c, ac);
+	}
+}
+
+void
+cache_on_pool_disconnect(struct cache *c, const redisAsyncContext *ac) {
+
+	int i;
+	for(i = 0; i < c->tracked_count; ++i) {
+		if(c->tracked[i] == ac) {
+			c->tracked[i] = c->tracked[--c->tracked_count];
+			break;
+		}
+	}
+}
+
+static void
+cache_on_message(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cache *c = privdata;
+	redisReply *reply = r, *payload;
+	size_t i;
+
+	if(ac != c->ac) {
+		return;
+	}
+	if(!reply) {
+		cache_lost(c);
+		return;
+	}
+	if(reply->type != REDIS_REPLY_ARRAY || reply->elements != 3
+			|| reply->element[0]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+
+	if(strcasecmp(reply->element[0]->str, "subscribe") == 0) {
+		struct pool *p = c->w->pool;
+
+		/* all set, invalidations will now be received. */
+		c->ready = 1;
+		if(c->w->s->cfg->cache_optin) {
+			for(i = 0; i < (size_t)p->count; ++i) {
+				if(p->ac[i]) {
+					cache_enable_tracking(c, p->ac[i]);
+				}
+			}
+		}
+	} else if(strcasecmp(reply->element[0]->str, "message") == 0) {
+		payload = reply->element[2];
+		if(payload->type == REDIS_REPLY_ARRAY) {
+			for(i = 0; i < payload->elements; ++i) {
+				if(payload->element[i]->type == REDIS_REPLY_STRING) {
+					cache_invalidate(c, payload->element[i]->str, payload->element[i]->len);
+				}
+			}
+		} else { /* FLUSHALL, FLUSHDB, or the tracking table is full */
+			cache_flush(c);
+		}
+	}
+}
+
+static void
+cache_on_tracking(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cache *c = privdata;
+	redisReply *reply = r;
+
+	if(ac != c->ac) {
+		return;
+	}
+	if(!reply) {
+		cache_lost(c);
+	} else if(reply->type == REDIS_REPLY_ERROR) {
+		cache_fail(c, ac, "Cache disabled: CLIENT TRACKING failed");
+	}
+}
+
+static void
+cache_on_client_id(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cache *c = privdata;
+	redisReply *reply = r;
+	struct conf *cfg = c->w->s->cfg;
+	char id[24];
+	const char **argv;
+	size_t *argv_len;
+	int i, argc = 0;
+
+	if(ac != c->ac) {
+		return;
+	}
+	if(!reply) {
+		cache_lost(c);
+		return;
+	}
+	if(reply->type != REDIS_REPLY_INTEGER) {
+		cache_fail(c, ac, "Cache disabled: CLIENT ID failed, Redis 6 is required");
+		return;
+	}
+	c->client_id = reply->integer;
+
+	/* in OPTIN mode, tracking is enabled on the pool connections instead */
+	if(!cfg->cache_optin) {
+		argv = calloc(6 + 2 * cfg->cache_prefix_count, sizeof(char *));
+		argv_len = calloc(6 + 2 * cfg->cache_prefix_count, sizeof(size_t));
+
+		argv[argc++] = "CLIENT";
+		argv[argc++] = "TRACKING";
+		argv[argc++] = "on";
+		argv[argc++] = "REDIRECT";
+		sprintf(id, "%lld", c->client_id);
+		argv[argc++] = id;
+		argv[argc++] = "BCAST";
+		for(i = 0; i < cfg->cache_prefix_count; ++i) {
+			argv[argc++] = "PREFIX";
+			argv[argc++] = cfg->cache_prefixes[i];
+		}
+		for(i = 0; i < argc; ++i) {
+			argv_len[i] = strlen(argv[i]);
+		}
+
+		redisAsyncCommandArgv(ac, cache_on_tracking, c, argc, argv, argv_len);
+		free(argv);
+		free(argv_len);
+	}
+
+	redisAsyncCommand(ac, cache_on_message, c, "SUBSCRIBE __redis__:invalidate");
+}
+
+static void
+cache_connect(struct cache *c) {
+
+	c->generation++;
+	c->ac = pool_connect(c->w->pool, c->w->s->cfg->database, 0);
+	if(!c->ac) {
+		cache_lost(c);
+		return;
+	}
+	redisAsyncCommand(c->ac, cache_on_client_id, c, "CLIENT ID");
+}
+
+void
+cache_start(struct cache *c) {
+
+	cache_connect(c);
+}
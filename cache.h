@@ -0,0 +1,76 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <event.h>
+#include <hiredis/async.h>
+#include "cmd.h"
+
+struct worker;
+struct cache_entry;
+
+#define CACHE_KEY_EPOCHS 1024
+
+struct cache {
+	struct worker *w;
+
+	/* entries, by formatted request and by Redis key */
+	struct cache_entry **buckets;
+	struct cache_entry **kbuckets;
+	unsigned int size;
+
+	/* least recently used at the tail */
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+	size_t bytes;
+	unsigned long entries;
+
+	/* bumped on invalidation, so that replies already in flight aren't stored */
+	unsigned long epoch;
+	unsigned long key_epochs[CACHE_KEY_EPOCHS];
+
+	/* connection receiving the invalidation messages */
+	redisAsyncContext *ac;
+	long long client_id;
+	unsigned long generation;
+	int ready;
+	int disabled;
+	struct event ev_reconnect;
+
+	/* pool connections with tracking enabled, in OPTIN mode */
+	const redisAsyncContext **tracked;
+	int tracked_count;
+
+	/* counters */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long evictions;
+	unsigned long invalidations;
+};
+
+struct cache *
+cache_new(struct worker *w);
+
+void
+cache_start(struct cache *c);
+
+int
+cache_lookup(struct cache *c, struct cmd *cmd, formatting_fun f_format);
+
+void
+cache_prepare(struct cache *c, struct cmd *cmd);
+
+void
+cache_store(struct cache *c, struct cmd *cmd, const char *p, size_t sz,
+		const char *ct, const char *etag);
+
+void
+cache_on_write(struct cache *c, struct cmd *cmd);
+
+void
+cache_on_pool_connect(struct cache *c, const redisAsyncContext *ac);
+
+void
+cache_on_pool_disconnect(struct cache *c, const redisAsyncContext *ac);
+
+#endif
@@ -0,0 +1,527 @@
+#include "changes.h"
+#include "cmd.h"
+#include "client.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "acl.h"
+#include "hub.h"
+#include "http.h"
+#include "websocket.h"
+#include "formats/common.h"
+#include "formats/json.h"
+#include "formats/sse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <jansson.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * GET /_changes/pattern sends a notification each time a key matching the
+ * pattern is modified, from Redis keyspace notifications: the pattern is
+ * subscribed to once per worker through the pub/sub hub, however many
+ * clients are watching it.
+ *
+ * ?events=set,del,@hash only sends these events, or classes of events.
+ * ?value=1 adds the new value of strings, read once per change for all
+ * the watchers of the pattern.
+ */
+
+#define CHANGES_PREFIX "/_changes/"
+
+struct changes_feed {
+	struct changes *c;
+	struct cmd *sub; /* PSUBSCRIBE __keyspace@N__:pattern, on the hub */
+	char *pattern;
+	size_t pattern_sz;
+	int values; /* read the new value of strings */
+
+	struct changes_watcher *watchers;
+
+	/* notifications in order, waiting for their value */
+	struct changes_note *head;
+	struct changes_note *tail;
+
+	struct changes_feed *next;
+};
+
+struct changes_watcher {
+	struct changes_feed *feed;
+	struct cmd *cmd;
+	char *events; /* comma-separated events and @classes, NULL for all */
+	int sse;
+
+	struct changes_watcher *prev;
+	struct changes_watcher *next;
+};
+
+struct changes_note {
+	struct changes_feed *feed; /* NULL once there is no one left to send it to */
+	char *key;
+	char *event;
+	const char *class;
+
+	int fetching;
+	char *value;
+
+	struct changes_note *next;
+};
+
+/* the class of each event, as in notify-keyspace-events */
+static const struct {
+	const char *event;
+	const char *class;
+} changes_classes[] = {
+	{"set", "string"}, {"setrange", "string"}, {"incrby", "string"},
+	{"incrbyfloat", "string"}, {"append", "string"},
+	{"lpush", "list"}, {"rpush", "list"}, {"lpop", "list"}, {"rpop", "list"},
+	{"linsert", "list"}, {"lset", "list"}, {"lrem", "list"}, {"ltrim", "list"},
+	{"sortstore", "list"},
+	{"sadd", "set"}, {"srem", "set"}, {"spop", "set"}, {"sinterstore", "set"},
+	{"sunionstore", "set"}, {"sdiffstore", "set"},
+	{"hset", "hash"}, {"hdel", "hash"}, {"hincrby", "hash"}, {"hincrbyfloat", "hash"},
+	{"hexpire", "hash"}, {"hpersist", "hash"}, {"hexpired", "hash"},
+	{"zadd", "zset"}, {"zincr", "zset"}, {"zrem", "zset"}, {"zremrangebyscore", "zset"},
+	{"zremrangebyrank", "zset"}, {"zremrangebylex", "zset"}, {"zunionstore", "zset"},
+	{"zinterstore", "zset"}, {"zdiffstore", "zset"}, {"zrangestore", "zset"},
+	{"zpopmin", "zset"}, {"zpopmax", "zset"},
+	{"expired", "expired"}, {"evicted", "evicted"}
+};
+
+struct changes *
+changes_new(struct worker *w) {
+
+	struct changes *c = calloc(1, sizeof(struct changes));
+	c->w = w;
+	return c;
+}
+
+int
+changes_endpoint(const char *path, size_t path_sz) {
+
+	size_t sz = sizeof(CHANGES_PREFIX) - 1;
+	return path_sz > sz && memcmp(path, CHANGES_PREFIX, sz) == 0;
+}
+
+static const char *
+changes_class(const char *event) {
+
+	size_t i;
+
+	for(i = 0; i < sizeof(changes_classes) / sizeof(changes_classes[0]); ++i) {
+		if(strcmp(changes_classes[i].event, event) == 0) {
+			return changes_classes[i].class;
+		}
+	}
+	if(event[0] == 'x') { /* xadd, xtrim, xgroup-create… */
+		return "stream";
+	}
+	return "generic"; /* del, rename_from, expire… */
+}
+
+/* "set,del,@hash" */
+static int
+changes_match(const char *events, const char *event, const char *class) {
+
+	const char *p = events, *end;
+	size_t sz;
+
+	if(!events) {
+		return 1;
+	}
+	while(*p) {
+		end = strchr(p, ',');
+		sz = end ? (size_t)(end - p) : strlen(p);
+		if(*p == '@' && sz - 1 == strlen(class) && strncmp(p + 1, class, sz - 1) == 0) {
+			return 1;
+		} else if(sz == strlen(event) && strncmp(p, event, sz) == 0) {
+			return 1;
+		}
+		if(!end) break;
+		p = end + 1;
+	}
+	return 0;
+}
+
+static json_t *
+changes_json_string(const char *p) {
+
+	json_t *s = json_string(p);
+	return s ? s : json_null(); /* not UTF-8 */
+}
+
+static void
+changes_note_free(struct changes_note *n) {
+
+	free(n->key);
+	free(n->event);
+	free(n->value);
+	free(n);
+}
+
+/* sends a frame shared by all the watchers of the same kind */
+static void
+changes_send(struct changes_watcher *wt, struct http_frame **f,
+		struct http_frame *(*make)(const char *, size_t), const char *p, size_t sz) {
+
+	if(!*f) {
+		*f = make(p, sz);
+	}
+	http_client_send(wt->cmd->client, *f);
+}
+
+static struct http_frame *
+changes_frame_sse(const char *p, size_t sz) {
+
+	char *out = malloc(sz + 8);
+
+	memcpy(out, "data: ", 6);
+	memcpy(out + 6, p, sz);
+	memcpy(out + 6 + sz, "\n\n", 2);
+	return http_frame_new(out, sz + 8);
+}
+
+/* {"key":"…","event":"…","value":"…"}, encoded once */
+static void
+changes_notify(struct changes_feed *feed, struct changes_note *n) {
+
+	struct changes_watcher *wt;
+	struct http_frame *chunk = NULL, *sse = NULL, *ws = NULL;
+	json_t *j = json_object();
+	char *str, *line;
+	size_t sz;
+
+	json_object_set_new(j, "key", changes_json_string(n->key));
+	json_object_set_new(j, "event", json_string(n->event));
+	if(feed->values && strcmp(n->class, "string") == 0) {
+		json_object_set_new(j, "value", n->value ? changes_json_string(n->value) : json_null());
+	}
+	str = json_dumps(j, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	json_decref(j);
+
+	/* one JSON object per line over HTTP */
+	sz = strlen(str);
+	line = malloc(sz + 1);
+	memcpy(line, str, sz);
+	line[sz] = '\n';
+
+	for(wt = feed->watchers; wt; wt = wt->next) {
+		struct cmd *cmd = wt->cmd;
+
+		if(!changes_match(wt->events, n->event, n->class) || !cmd->client) {
+			continue;
+		}
+		feed->c->notifications++;
+
+		if(cmd->is_websocket) {
+			changes_send(wt, &ws, ws_frame, str, sz);
+		} else if(wt->sse) {
+			changes_send(wt, &sse, changes_frame_sse, str, sz);
+		} else if(cmd->started_responding) {
+			changes_send(wt, &chunk, http_frame_chunk, line, sz + 1);
+		} else { /* starts the chunked response */
+			format_send_reply(cmd, line, sz + 1, "application/json");
+		}
+	}
+
+	if(chunk) http_frame_release(chunk);
+	if(sse) http_frame_release(sse);
+	if(ws) http_frame_release(ws);
+	free(line);
+	free(str);
+}
+
+/* sends the notifications that have their value, in order */
+static void
+changes_flush(struct changes_feed *feed) {
+
+	struct changes_note *n;
+
+	while((n = feed->head) && !n->fetching) {
+		feed->head = n->next;
+		if(!feed->head) {
+			feed->tail = NULL;
+		}
+		changes_notify(feed, n);
+		changes_note_free(n);
+	}
+}
+
+static void
+changes_on_value(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *get = privdata;
+	struct changes_note *n = get->note;
+	redisReply *reply = r;
+
+	(void)ac;
+
+	cmd_free(get);
+	n->fetching = 0;
+	if(reply && reply->type == REDIS_REPLY_STRING) {
+		n->value = malloc(reply->len + 1);
+		memcpy(n->value, reply->str, reply->len);
+		n->value[reply->len] = 0;
+	}
+
+	if(!n->feed) { /* nobody watching anymore */
+		changes_note_free(n);
+		return;
+	}
+	changes_flush(n->feed);
+}
+
+/* GET, sent and queued like the commands of the clients */
+static void
+changes_fetch(struct changes *c, struct changes_note *n, const char *key, size_t sz) {
+
+	struct cmd *get = cmd_new(2);
+
+	get->w = c->w;
+	get->fd = -1;
+	get->database = c->w->s->cfg->database;
+	get->primary = 1; /* not from a replica, not shared with the clients' GETs */
+	get->argv[0] = strdup("GET");
+	get->argv_len[0] = 3;
+	get->argv[1] = malloc(sz);
+	memcpy(get->argv[1], key, sz);
+	get->argv_len[1] = sz;
+	get->note = n;
+
+	if(cmd_execute(get, changes_on_value) == CMD_SENT) {
+		n->fetching = 1;
+		c->fetches++;
+	} else {
+		cmd_free(get);
+	}
+}
+
+static struct changes_feed *
+changes_feed_of(struct changes *c, struct cmd *sub) {
+
+	struct changes_feed *feed;
+
+	for(feed = c->feeds; feed && feed->sub != sub; feed = feed->next);
+	return feed;
+}
+
+/* ["pmessage", "__keyspace@0__:pattern", "__keyspace@0__:key", "event"] */
+static void
+changes_on_event(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *sub = privdata;
+	struct changes *c = sub->w->changes;
+	redisReply *reply = r;
+	struct changes_feed *feed;
+	struct changes_note *n;
+	const char *key;
+
+	(void)ac;
+
+	if(!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 4
+			|| reply->element[0]->type != REDIS_REPLY_STRING
+			|| strcmp(reply->element[0]->str, "pmessage") != 0
+			|| reply->element[2]->type != REDIS_REPLY_STRING
+			|| reply->element[3]->type != REDIS_REPLY_STRING) {
+		return; /* (p)subscribe confirmations */
+	}
+	if(!(feed = changes_feed_of(c, sub))
+			|| !(key = strstr(reply->element[2]->str, "__:"))) {
+		return;
+	}
+	key += 3;
+	c->events++;
+
+	n = calloc(1, sizeof(struct changes_note));
+	n->feed = feed;
+	n->key = strdup(key);
+	n->event = strdup(reply->element[3]->str);
+	n->class = changes_class(n->event);
+	if(feed->tail) {
+		feed->tail->next = n;
+	} else {
+		feed->head = n;
+	}
+	feed->tail = n;
+
+	/* one read per change, whatever the number of watchers */
+	if(feed->values && strcmp(n->class, "string") == 0) {
+		changes_fetch(c, n, key, reply->element[2]->len - (key - reply->element[2]->str));
+	}
+
+	changes_flush(feed);
+}
+
+static struct changes_feed *
+changes_feed_get(struct changes *c, const char *pattern, size_t sz, int values) {
+
+	struct conf *cfg = c->w->s->cfg;
+	struct changes_feed *feed;
+	char prefix[32];
+	int prefix_sz;
+
+	for(feed = c->feeds; feed; feed = feed->next) {
+		if(feed->values == values && feed->pattern_sz == sz
+				&& memcmp(feed->pattern, pattern, sz) == 0) {
+			return feed;
+		}
+	}
+
+	feed = calloc(1, sizeof(struct changes_feed));
+	feed->c = c;
+	feed->pattern = malloc(sz);
+	memcpy(feed->pattern, pattern, sz);
+	feed->pattern_sz = sz;
+	feed->values = values;
+	feed->next = c->feeds;
+	c->feeds = feed;
+	c->feed_count++;
+
+	/* the hub sends PSUBSCRIBE once per pattern */
+	prefix_sz = sprintf(prefix, "__keyspace@%d__:", cfg->database);
+	feed->sub = cmd_new(2);
+	feed->sub->w = c->w;
+	feed->sub->database = cfg->database;
+	feed->sub->argv[0] = strdup("PSUBSCRIBE");
+	feed->sub->argv_len[0] = 10;
+	feed->sub->argv[1] = malloc(prefix_sz + sz);
+	memcpy(feed->sub->argv[1], prefix, prefix_sz);
+	memcpy(feed->sub->argv[1] + prefix_sz, pattern, sz);
+	feed->sub->argv_len[1] = prefix_sz + sz;
+	hub_subscribe(c->w->hub, feed->sub, changes_on_event);
+
+	return feed;
+}
+
+static void
+changes_feed_free(struct changes_feed *feed) {
+
+	struct changes *c = feed->c;
+	struct changes_feed **prev;
+	struct changes_note *n, *next;
+
+	for(prev = &c->feeds; *prev; prev = &(*prev)->next) {
+		if(*prev == feed) {
+			*prev = feed->next;
+			break;
+		}
+	}
+	c->feed_count--;
+
+	/* the values being read are dropped when they arrive */
+	for(n = feed->head; n; n = next) {
+		next = n->next;
+		if(n->fetching) {
+			n->feed = NULL;
+		} else {
+			changes_note_free(n);
+		}
+	}
+
+	cmd_free(feed->sub); /* leaves the hub */
+	free(feed->pattern);
+	free(feed);
+}
+
+/* called when the watcher's command is freed */
+void
+changes_leave(struct changes_watcher *wt) {
+
+	struct changes_feed *feed = wt->feed;
+
+	if(wt->prev) wt->prev->next = wt->next;
+	else feed->watchers = wt->next;
+	if(wt->next) wt->next->prev = wt->prev;
+	feed->c->watcher_count--;
+
+	if(!feed->watchers) {
+		changes_feed_free(feed);
+	}
+	free(wt->events);
+	free(wt);
+}
+
+static int
+changes_allow(struct conf *cfg, struct http_client *client, const char *name) {
+
+	struct cmd *cmd = cmd_new(1);
+	int ret;
+
+	cmd->argv[0] = strdup(name);
+	cmd->argv_len[0] = strlen(name);
+	ret = acl_allow_command(cmd, cfg, client);
+	cmd_free(cmd);
+
+	return ret;
+}
+
+cmd_response_t
+changes_run(struct worker *w, struct http_client *client) {
+
+	struct conf *cfg = w->s->cfg;
+	struct changes *c = w->changes;
+	const char *uri = client->path + sizeof(CHANGES_PREFIX) - 1;
+	size_t uri_len = client->path_sz - (sizeof(CHANGES_PREFIX) - 1);
+	char *qmark = memchr(uri, '?', uri_len), *pattern;
+	size_t pattern_sz;
+	formatting_fun f_format;
+	struct changes_watcher *wt;
+	struct cmd *cmd;
+
+	if(!c) { /* keyspace notifications come through the hub */
+		return CMD_REDIS_UNAVAIL;
+	}
+	if(w->cluster || w->shards) { /* each server only notifies about its own keys */
+		return CMD_PARAM_ERROR;
+	}
+	if(qmark) {
+		uri_len = qmark - uri;
+	}
+
+	cmd = cmd_new(2);
+	cmd->fd = client->fd;
+	cmd->database = cfg->database;
+	cmd->is_websocket = client->is_websocket;
+	uri_len = cmd_select_format(client, cmd, uri, uri_len, &f_format);
+	pattern = decode_uri(uri, uri_len, &pattern_sz, 1);
+
+	/* the watcher stands for a PSUBSCRIBE, as far as ACLs are concerned */
+	cmd->argv[0] = strdup("PSUBSCRIBE");
+	cmd->argv_len[0] = 10;
+	cmd->argv[1] = pattern;
+	cmd->argv_len[1] = pattern_sz;
+
+	if(pattern_sz == 0 || (f_format != json_reply && f_format != sse_reply)) {
+		cmd_free(cmd);
+		return CMD_PARAM_ERROR;
+	}
+	if(!acl_allow_command(cmd, cfg, client)
+			|| (client->value && !changes_allow(cfg, client, "GET"))) {
+		cmd_free(cmd);
+		return CMD_ACL_FAIL;
+	}
+	cmd_setup(cmd, client);
+
+	wt = calloc(1, sizeof(struct changes_watcher));
+	wt->cmd = cmd;
+	wt->sse = (f_format == sse_reply && !cmd->is_websocket);
+	if(client->events && *client->events) {
+		wt->events = strdup(client->events);
+	}
+	wt->feed = changes_feed_get(c, pattern, pattern_sz, client->value);
+	wt->next = wt->feed->watchers;
+	if(wt->next) wt->next->prev = wt;
+	wt->feed->watchers = wt;
+	c->watcher_count++;
+
+	cmd->watcher = wt;
+	client->pub_sub = cmd; /* kept open */
+
+	/* open the event stream right away */
+	if(wt->sse) {
+		format_send_event(cmd, ": changes\n\n", 11);
+	}
+	return CMD_SENT;
+}
@@ -0,0 +1,36 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include "cmd.h"
+
+struct worker;
+struct http_client;
+struct changes_feed;
+struct changes_watcher;
+
+/* change feeds of a worker, one keyspace subscription per key pattern */
+struct changes {
+	struct worker *w;
+	struct changes_feed *feeds;
+
+	/* counters */
+	unsigned long feed_count;
+	unsigned long watcher_count;
+	unsigned long events; /* keyspace notifications received */
+	unsigned long notifications; /* sent to watchers */
+	unsigned long fetches; /* values read after a change */
+};
+
+struct changes *
+changes_new(struct worker *w);
+
+int
+changes_endpoint(const char *path, size_t path_sz);
+
+cmd_response_t
+changes_run(struct worker *w, struct http_client *client);
+
+void
+changes_leave(struct changes_watcher *wt);
+
+#endif
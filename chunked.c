@@ -0,0 +1,324 @@
+#include "chunked.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "pool.h"
+#include "http.h"
+#include "client.h"
+#include "coalesce.h"
+#include "slog.h"
+#include "formats/common.h"
+#include "formats/json.h"
+#include "formats/raw.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <event.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * A reply that is an array of at least "chunked_threshold" elements isn't
+ * built by hiredis: each element is formatted as soon as it is read, and
+ * sent in HTTP chunks of about CHUNKED_SIZE bytes. The client gets the
+ * first elements while Redis is still sending the next ones, and the reply
+ * is never held in memory as a whole. Only for JSON and raw output, to
+ * HTTP/1.1 keep-alive clients. These replies have no ETag and aren't cached.
+ *
+ * Nothing else may be written to the client until the last chunk: reading
+ * its next requests waits until it is written. The command is counted
+ * against its Redis connection until its last element is read. If it already has other commands in
+ * flight, the reply is formatted as it is read but sent as usual, at the end.
+ */
+
+#define CHUNKED_SIZE (64 * 1024)
+#define CHUNKED_HEAD 18 /* "%016zx\r\n", written once the chunk is full */
+
+struct chunked_format {
+	formatting_fun f;
+	void (*head)(const struct cmd *, size_t, struct format_buf *);
+	void (*item)(const redisReply *, size_t, struct format_buf *);
+	void (*tail)(const struct cmd *, struct format_buf *);
+	const char *ct;
+};
+
+static const struct chunked_format chunked_formats[] = {
+	{.f = json_reply, .head = json_chunked_head, .item = json_chunked_item,
+		.tail = json_chunked_tail, .ct = "application/json"},
+	{.f = raw_reply, .head = raw_chunked_head, .item = raw_chunked_item,
+		.tail = raw_chunked_tail, .ct = "binary/octet-stream"}
+};
+
+/* one reply being sent */
+struct chunked_reply {
+	struct chunked *ch;
+	const struct chunked_format *fmt;
+
+	size_t count; /* elements */
+	size_t idx; /* elements read */
+	size_t sent; /* bytes */
+	struct format_buf buf; /* the next chunk */
+	int dropped; /* the remaining elements are only read */
+	int buffered; /* sent in one piece at the end */
+};
+
+struct chunked *
+chunked_new(struct worker *w) {
+
+	struct chunked *ch = calloc(1, sizeof(struct chunked));
+
+	ch->w = w;
+	ch->threshold = w->s->cfg->chunked_threshold;
+	ch->max_size = w->s->cfg->max_reply_size;
+	return ch;
+}
+
+static const struct chunked_format *
+chunked_format(formatting_fun f_format) {
+
+	unsigned int i;
+
+	for(i = 0; i < sizeof(chunked_formats) / sizeof(chunked_formats[0]); ++i) {
+		if(chunked_formats[i].f == f_format) {
+			return &chunked_formats[i];
+		}
+	}
+	return NULL;
+}
+
+/* minimum number of elements for the reply to be sent chunked, 0 if it can't be */
+size_t
+chunked_threshold(struct chunked *ch, struct cmd *cmd, formatting_fun f_format) {
+
+	if(!ch || !cmd->client || !cmd->keep_alive || cmd->http_version != 1
+			|| cmd->is_websocket || cmd->pub_sub_client || !chunked_format(f_format)) {
+		return 0;
+	}
+
+	/* HGETALL is a JSON object, if all the fields turn out to be strings */
+	if(f_format == json_reply && cmd->count && cmd->argv_len[0] == 7
+			&& strncasecmp(cmd->argv[0], "HGETALL", 7) == 0) {
+		return 0;
+	}
+	return ch->threshold;
+}
+
+static void
+chunked_buf_init(struct chunked_reply *cr) {
+
+	format_buf_init(&cr->buf, CHUNKED_HEAD + CHUNKED_SIZE + 1024);
+	cr->buf.sz = CHUNKED_HEAD;
+}
+
+/* the buffer becomes the frame, with its chunk header */
+static void
+chunked_flush(struct cmd *cmd, struct chunked_reply *cr) {
+
+	struct http_frame *f;
+	char head[CHUNKED_HEAD + 1];
+	size_t len = cr->buf.sz - CHUNKED_HEAD;
+
+	if(!len) {
+		return;
+	}
+	sprintf(head, "%016zx\r\n", len);
+	memcpy(cr->buf.p, head, CHUNKED_HEAD);
+	format_buf_append(&cr->buf, "\r\n", 2);
+
+	f = http_frame_new(cr->buf.p, cr->buf.sz);
+	http_client_send(cmd->client, f);
+	http_frame_release(f);
+
+	cr->sent += len;
+	cr->ch->bytes += len;
+	chunked_buf_init(cr);
+}
+
+/* the rest of the reply is read and dropped, the client can send more requests */
+static void
+chunked_drop(struct cmd *cmd, struct chunked_reply *cr) {
+
+	cr->dropped = 1;
+	free(cr->buf.p);
+	cr->buf.p = NULL;
+	if(cmd->client && !cr->buffered) {
+		http_client_resume(cmd->client);
+	}
+}
+
+/* the client can only be told by closing the connection, once headers were sent */
+static void
+chunked_truncate(struct cmd *cmd, struct chunked_reply *cr, const char *why) {
+
+	struct http_response *resp;
+
+	slog(cmd->w->s, WEBDIS_WARNING, why, 0);
+	cr->ch->truncated++;
+	if(cmd->client && cr->buffered) { /* nothing sent yet */
+		resp = http_response_init(cmd->w, 503, "Service Unavailable");
+		resp->http_version = cmd->http_version;
+		http_response_set_keep_alive(resp, cmd->keep_alive);
+		http_response_write(resp, cmd->fd);
+		cmd_abandon(cmd);
+	} else if(cmd->client) {
+		shutdown(cmd->fd, SHUT_RDWR);
+	}
+	chunked_drop(cmd, cr);
+}
+
+/* waiting for the same reply, sent again as a command of its own */
+static void
+chunked_resend(struct cmd *cmd, formatting_fun f_format) {
+
+	if(cmd->abandoned) {
+		cmd_free(cmd);
+		return;
+	}
+	/* its connection may have been replaced since, pick one again */
+	cmd->ac = NULL;
+	if(cmd_execute(cmd, f_format) != CMD_SENT) {
+		format_send_error(cmd, 503, "Service Unavailable");
+	}
+}
+
+/* the last element was read, its connection can take another command */
+static void
+chunked_done(const redisAsyncContext *ac, struct cmd *cmd, int ok) {
+
+	struct pool *p = ac->data;
+
+	pool_on_reply(ac, ok, &cmd->sent_at);
+	if(p && ok) {
+		pool_dispatch(p);
+	}
+}
+
+/* a REDIS_REPLY_STREAM: the elements follow */
+void
+chunked_start(struct cmd *cmd, const redisReply *r) {
+
+	struct chunked_reply *cr = calloc(1, sizeof(struct chunked_reply));
+	struct http_response *resp;
+	struct cmd *waiter, *next;
+
+	cr->ch = cmd->w->chunked;
+	cr->fmt = chunked_format(cmd->f_format);
+	cr->count = r->elements;
+	cmd->chunked = cr;
+	cr->ch->replies++;
+
+	/* identical commands can't share this reply */
+	coalesce_done(cmd);
+	for(waiter = cmd->waiters; waiter; waiter = next) {
+		next = waiter->next_waiter;
+		waiter->next_waiter = NULL;
+		chunked_resend(waiter, cmd->f_format);
+	}
+	cmd->waiters = NULL;
+
+	/* the reply has started, it can't time out anymore */
+	if(cmd->deadline_set) {
+		evtimer_del(&cmd->ev_deadline);
+		cmd->deadline_set = 0;
+	}
+
+	if(cmd->abandoned || !cmd->client) {
+		cr->dropped = 1;
+		return;
+	}
+
+	chunked_buf_init(cr);
+	cr->fmt->head(cmd, cr->count, &cr->buf);
+
+	/* other replies are on their way to this client */
+	if(cmd->client->cmds != cmd || cmd->client_next) {
+		cr->buffered = 1;
+		return;
+	}
+
+	resp = http_response_init(cmd->w, 200, "OK");
+	resp->http_version = cmd->http_version;
+	if(cmd->filename) {
+		http_response_set_header(resp, "Content-Disposition", cmd->filename);
+	}
+	http_response_set_header(resp, "Content-Type", cmd->mime ? cmd->mime : cr->fmt->ct);
+	http_response_set_header(resp, "Transfer-Encoding", "chunked");
+	http_response_set_keep_alive(resp, 1);
+	http_response_send(resp, cmd->client);
+	cmd->started_responding = 1;
+
+	/* its next requests are read after the last chunk */
+	event_del(&cmd->client->ev);
+}
+
+/* an element of the array, or NULL if the connection to Redis was lost */
+void
+chunked_item(const redisAsyncContext *ac, struct cmd *cmd, const redisReply *r) {
+
+	struct chunked_reply *cr = cmd->chunked;
+	struct chunked *ch = cr->ch;
+	struct http_frame *f;
+	char *end;
+	int last;
+
+	if(!r) {
+		if(!cr->dropped) {
+			chunked_truncate(cmd, cr, "Connection to Redis lost during a chunked reply");
+		}
+		chunked_done(ac, cmd, 0);
+		cmd_free(cmd);
+		return;
+	}
+
+	last = (++cr->idx == cr->count);
+	ch->elements++;
+
+	if(!cr->dropped && (cmd->abandoned || !cmd->client)) { /* client gone */
+		chunked_drop(cmd, cr);
+	}
+
+	if(last) {
+		chunked_done(ac, cmd, 1);
+	}
+
+	if(!cr->dropped) {
+		cr->fmt->item(r, cr->idx - 1, &cr->buf);
+		if(last) {
+			cr->fmt->tail(cmd, &cr->buf);
+		}
+
+		if(ch->max_size && cr->sent + cr->buf.sz - CHUNKED_HEAD > ch->max_size) {
+			chunked_truncate(cmd, cr, "Reply over max_reply_size, truncated");
+		} else if(cr->buffered) {
+			if(last) { /* frees cmd */
+				ch->bytes += cr->buf.sz - CHUNKED_HEAD;
+				format_send_reply(cmd, cr->buf.p + CHUNKED_HEAD,
+						cr->buf.sz - CHUNKED_HEAD, cr->fmt->ct);
+			}
+			return;
+		} else if(last || cr->buf.sz >= CHUNKED_HEAD + CHUNKED_SIZE) {
+			chunked_flush(cmd, cr);
+		}
+	}
+
+	if(last) {
+		if(!cr->dropped) { /* last chunk */
+			end = malloc(5);
+			memcpy(end, "0\r\n\r\n", 5);
+			f = http_frame_new(end, 5);
+			http_client_send(cmd->client, f);
+			http_frame_release(f);
+			http_client_resume(cmd->client);
+		}
+		cmd_free(cmd);
+	}
+}
+
+void
+chunked_free(struct chunked_reply *cr) {
+
+	free(cr->buf.p);
+	free(cr);
+}
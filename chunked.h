@@ -0,0 +1,37 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include "cmd.h"
+
+struct worker;
+struct chunked_reply;
+
+/* large arrays sent to the client chunk by chunk, as they are read */
+struct chunked {
+	struct worker *w;
+	size_t threshold; /* elements */
+	size_t max_size; /* bytes sent per reply, 0 for no limit */
+
+	/* counters */
+	unsigned long replies; /* sent chunked */
+	unsigned long elements;
+	unsigned long bytes;
+	unsigned long truncated; /* over max_size, or Redis went away */
+};
+
+struct chunked *
+chunked_new(struct worker *w);
+
+size_t
+chunked_threshold(struct chunked *ch, struct cmd *cmd, formatting_fun f_format);
+
+void
+chunked_start(struct cmd *cmd, const redisReply *r);
+
+void
+chunked_item(const redisAsyncContext *ac, struct cmd *cmd, const redisReply *r);
+
+void
+chunked_free(struct chunked_reply *cr);
+
+#endif
@@ -11,9 +11,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
+/* frames written with a single writev */
+#define CLIENT_IOV_MAX 64
+
 #define CHECK_ALLOC(c, ptr) if(!(ptr)) { c->failed_alloc = 1; return -1;}
 
 static int
@@ -131,6 +136,13 @@ http_client_on_query_string(struct http_parser *parser, const char *at, size_t s
 				memcpy(c->separator, val, val_len);
 			} else if(key_len == 8 && strncmp(key, "filename", 8) == 0) {
 				c->filename = wrap_filename(val, val_len);
+			} else if(key_len == 7 && strncmp(key, "primary", 7) == 0) {
+				c->primary = !(val_len == 1 && *val == '0');
+			} else if(key_len == 6 && strncmp(key, "events", 6) == 0) {
+				c->events = calloc(1 + val_len, 1);
+				memcpy(c->events, val, val_len);
+			} else if(key_len == 5 && strncmp(key, "value", 5) == 0) {
+				c->value = !(val_len == 1 && *val == '0');
 			}
 
 			if(!amp) {
@@ -254,20 +266,174 @@ http_client_reset(struct http_client *c) {
 	free(c->type); c->type = NULL;
 	free(c->jsonp); c->jsonp = NULL;
 	free(c->filename); c->filename = NULL;
+	c->primary = 0;
+	free(c->events); c->events = NULL;
+	c->value = 0;
 	c->request_sz = 0;
 
 	/* no last known header callback */
 	c->last_cb = LAST_CB_NONE;
 
-	/* mark as broken if client doesn't support Keep-Alive. */
-	if(c->keep_alive == 0) {
+	/* mark as broken if client doesn't support Keep-Alive,
+	 * unless it's still receiving a stream. */
+	if(c->keep_alive == 0 && !c->pub_sub) {
 		c->broken = 1;
 	}
 }
 
+static void
+http_client_schedule_write(struct http_client *c);
+
+static void
+http_client_pop_frame(struct http_client *c) {
+
+	http_frame_release(c->out[c->out_head]);
+	c->out_head = (c->out_head + 1) % c->out_size;
+	c->out_count--;
+	c->out_sent = 0;
+}
+
+static void
+http_client_can_write(int fd, short event, void *p) {
+
+	struct http_client *c = p;
+	struct iovec iov[CLIENT_IOV_MAX];
+	struct http_frame *f;
+	ssize_t ret;
+	int n;
+
+	(void)event;
+
+	c->out_scheduled = 0;
+	for(n = 0; n < c->out_count && n < CLIENT_IOV_MAX; ++n) {
+		f = c->out[(c->out_head + n) % c->out_size];
+		iov[n].iov_base = f->out + (n == 0 ? c->out_sent : 0);
+		iov[n].iov_len = f->out_sz - (n == 0 ? c->out_sent : 0);
+	}
+
+	ret = writev(fd, iov, n);
+	if(ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+		http_client_schedule_write(c);
+		return;
+	} else if(ret < 0) {
+		/* the disconnection is handled on the read side */
+		while(c->out_count) {
+			http_client_pop_frame(c);
+		}
+		if(c->out_resume) {
+			c->out_resume = 0;
+			worker_monitor_input(c);
+		}
+		return;
+	}
+
+	/* release the frames written entirely */
+	while(c->out_count) {
+		f = c->out[c->out_head];
+		if((size_t)ret < f->out_sz - c->out_sent) {
+			c->out_sent += ret;
+			break;
+		}
+		ret -= f->out_sz - c->out_sent;
+		http_client_pop_frame(c);
+	}
+
+	if(c->out_count) {
+		http_client_schedule_write(c);
+	} else if(c->out_close) {
+		shutdown(fd, SHUT_RDWR); /* the read side frees the client */
+	} else if(c->out_resume) {
+		c->out_resume = 0;
+		worker_monitor_input(c);
+	}
+}
+
+static void
+http_client_schedule_write(struct http_client *c) {
+
+	if(c->out_scheduled) {
+		return;
+	}
+	event_set(&c->ev_out, c->fd, EV_WRITE, http_client_can_write, c);
+	event_base_set(c->w->base, &c->ev_out);
+	event_add(&c->ev_out, NULL);
+	c->out_scheduled = 1;
+}
+
+/**
+ * End the connection once the queued frames are written, for responses
+ * that have no other way to end, e.g. an event stream.
+ */
+void
+http_client_close(struct http_client *c) {
+
+	c->out_close = 1;
+	if(!c->out_count) {
+		shutdown(c->fd, SHUT_RDWR);
+	}
+}
+
+/**
+ * Read the next requests once the queued frames are written, so that
+ * their responses can't be sent before them.
+ */
+void
+http_client_resume(struct http_client *c) {
+
+	if(c->out_count) {
+		c->out_resume = 1;
+	} else {
+		worker_monitor_input(c);
+	}
+}
+
+/**
+ * Queue a frame to be written after the previous ones. Frames are shared,
+ * only a reference is kept.
+ */
+void
+http_client_send(struct http_client *c, struct http_frame *f) {
+
+	if(c->out_count == c->out_size) { /* grow, keeping the order */
+		int i, size = c->out_size ? 2 * c->out_size : 16;
+		struct http_frame **out = malloc(size * sizeof(struct http_frame *));
+
+		for(i = 0; i < c->out_count; ++i) {
+			out[i] = c->out[(c->out_head + i) % c->out_size];
+		}
+		free(c->out);
+		c->out = out;
+		c->out_size = size;
+		c->out_head = 0;
+	}
+
+	f->refs++;
+	c->out[(c->out_head + c->out_count) % c->out_size] = f;
+	c->out_count++;
+
+	http_client_schedule_write(c);
+}
+
 void
 http_client_free(struct http_client *c) {
 
+	/* commands in flight still reply on c->fd */
+	while(c->cmds) {
+		if(c->cmds->hub_members || c->cmds->reader || c->cmds->watcher) {
+			cmd_free(c->cmds);
+		} else {
+			cmd_detach(c->cmds);
+		}
+	}
+	/* unsent frames */
+	if(c->out_scheduled) {
+		event_del(&c->ev_out);
+	}
+	while(c->out_count) {
+		http_client_pop_frame(c);
+	}
+	free(c->out);
+
 	http_client_reset(c);
 	free(c->buffer);
 	free(c);
@@ -296,6 +462,16 @@ http_client_read(struct http_client *c) {
 			cmd_free(cmd);
 		}
 
+		/* replies to pending commands would have nowhere to go */
+		c->pub_sub = NULL;
+		while(c->cmds) {
+			if(c->cmds->hub_members || c->cmds->reader || c->cmds->watcher) { /* never replied to */
+				cmd_free(c->cmds);
+			} else {
+				cmd_abandon(c->cmds);
+			}
+		}
+
 		close(c->fd);
 
 		http_client_free(c);
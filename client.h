@@ -7,6 +7,7 @@
 #include "websocket.h"
 
 struct http_header;
+struct http_frame;
 struct server;
 struct cmd;
 
@@ -59,10 +60,25 @@ struct http_client {
 	char *jsonp; /* jsonp wrapper */
 	char *separator; /* list separator for raw lists */
 	char *filename; /* content-disposition */
+	char primary; /* don't read from a replica */
+	char *events; /* keyspace events followed by /_changes */
+	char value; /* /_changes: with the new values */
 
 	struct cmd *pub_sub;
+	struct cmd *cmds; /* waiting for a reply */
 
 	struct ws_msg *frame; /* websocket frame */
+
+	/* frames waiting to be written, in order */
+	struct http_frame **out;
+	int out_head;
+	int out_count;
+	int out_size;
+	size_t out_sent; /* part of the first frame already written */
+	struct event ev_out;
+	int out_scheduled;
+	int out_close; /* shut down once they are all written */
+	int out_resume; /* read the next requests once they are all written */
 };
 
 struct http_client *
@@ -89,5 +105,14 @@ http_client_add_to_body(struct http_client *c, const char *at, size_t sz);
 const char *
 client_get_header(struct http_client *c, const char *key);
 
+void
+http_client_send(struct http_client *c, struct http_frame *f);
+
+void
+http_client_close(struct http_client *c);
+
+void
+http_client_resume(struct http_client *c);
+
 
 #endif
@@ -0,0 +1,392 @@
+#include "cluster.h"
+#include "cmd.h"
+#include "pool.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "slog.h"
+#include "formats/common.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Redis Cluster support: every worker keeps a map from hash slot to node,
+ * loaded with CLUSTER SLOTS from the configured Redis server and refreshed
+ * in the background. Each node has its own pool. Commands are sent to the
+ * node owning the slot of their first key; MOVED and ASK redirections are
+ * followed before the reply is formatted.
+ */
+
+#define CLUSTER_REFRESH_INTERVAL 10 /* seconds */
+#define CLUSTER_MAX_TRIES 16 /* redirections, or waits for a connection */
+
+/* CRC16-CCITT (XMODEM), as used by Redis for key slots. */
+static const unsigned short crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+static unsigned short
+crc16(const char *p, size_t sz) {
+
+	unsigned short crc = 0;
+	size_t i;
+	for(i = 0; i < sz; ++i) {
+		crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ (unsigned char)p[i]) & 0xff];
+	}
+	return crc;
+}
+
+unsigned int
+cluster_key_slot(const char *key, size_t sz) {
+
+	key = cmd_key_tag(key, &sz);
+	return crc16(key, sz) & (CLUSTER_SLOTS - 1);
+}
+
+struct cluster *
+cluster_new(struct worker *w) {
+
+	struct cluster *cl = calloc(1, sizeof(struct cluster));
+	cl->w = w;
+	return cl;
+}
+
+static struct cluster_node *
+cluster_node_get(struct cluster *cl, const char *host, size_t host_sz, short port) {
+
+	struct conf *cfg = cl->w->s->cfg;
+	struct cluster_node *n;
+	int i;
+
+	for(n = cl->nodes; n; n = n->next) {
+		if(n->port == port && strlen(n->host) == host_sz
+				&& memcmp(n->host, host, host_sz) == 0) {
+			return n;
+		}
+	}
+
+	n = calloc(1, sizeof(struct cluster_node));
+	n->host = calloc(host_sz + 1, 1);
+	memcpy(n->host, host, host_sz);
+	n->port = port;
+
+	if(port == cfg->redis_port && strcmp(n->host, cfg->redis_host) == 0) {
+		n->pool = cl->w->pool; /* already connected */
+	} else {
+		n->pool = pool_new(cl->w, n->host, n->port, cfg->pool_size_per_thread);
+		for(i = 0; i < n->pool->count; ++i) {
+			pool_connect(n->pool, 0, 1);
+		}
+	}
+
+	n->next = cl->nodes;
+	cl->nodes = n;
+	cl->node_count++;
+	return n;
+}
+
+static void
+cluster_node_free(struct cluster *cl, struct cluster_node *n) {
+
+	if(n->pool != cl->w->pool) {
+		pool_free(n->pool);
+	}
+	free(n->host);
+	free(n);
+}
+
+/**
+ * Nodes that no longer own any slot are freed once nothing is in flight on
+ * their pool, or at a later refresh if they are still busy.
+ */
+static void
+cluster_gc(struct cluster *cl) {
+
+	struct cluster_node **prev, *n;
+	int slot;
+
+	for(n = cl->nodes; n; n = n->next) {
+		n->owner = 0;
+	}
+	for(slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+		if(cl->slots[slot]) {
+			cl->slots[slot]->owner = 1;
+		}
+	}
+
+	for(prev = &cl->nodes; (n = *prev); ) {
+		if(!n->owner && !n->asked && n->pool != cl->w->pool && pool_is_idle(n->pool)) {
+			*prev = n->next;
+			cl->node_count--;
+			cluster_node_free(cl, n);
+		} else {
+			prev = &n->next;
+		}
+	}
+}
+
+/* any connection, for commands without a key. */
+const redisAsyncContext *
+cluster_get_context(struct cluster *cl) {
+
+	const redisAsyncContext *ac = pool_get_context(cl->w->pool);
+	struct cluster_node *n;
+
+	for(n = cl->nodes; n && !ac; n = n->next) {
+		ac = pool_get_context(n->pool);
+	}
+	return ac;
+}
+
+static void
+cluster_on_slots(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cluster *cl = privdata;
+	redisReply *reply = r;
+	struct pool *p = ac->data;
+	size_t i;
+	int slot;
+
+	cl->refreshing = 0;
+	if(!reply || reply->type != REDIS_REPLY_ARRAY) {
+		if(reply && reply->type == REDIS_REPLY_ERROR) {
+			slog(cl->w->s, WEBDIS_ERROR, reply->str, reply->len);
+		}
+		return;
+	}
+
+	memset(cl->slots, 0, sizeof(cl->slots));
+
+	/* [start, end, [host, port, id], replicas...] */
+	for(i = 0; i < reply->elements; ++i) {
+		redisReply *range = reply->element[i], *master;
+		struct cluster_node *n;
+		const char *host;
+		size_t host_sz;
+		long long start, end;
+
+		if(range->type != REDIS_REPLY_ARRAY || range->elements < 3
+				|| range->element[0]->type != REDIS_REPLY_INTEGER
+				|| range->element[1]->type != REDIS_REPLY_INTEGER
+				|| range->element[2]->type != REDIS_REPLY_ARRAY
+				|| range->element[2]->elements < 2) {
+			continue;
+		}
+		start = range->element[0]->integer;
+		end = range->element[1]->integer;
+		master = range->element[2];
+		if(master->element[0]->type != REDIS_REPLY_STRING
+				|| master->element[1]->type != REDIS_REPLY_INTEGER
+				|| start < 0 || end >= CLUSTER_SLOTS) {
+			continue;
+		}
+
+		/* an empty host means the node we asked */
+		host = master->element[0]->str;
+		host_sz = master->element[0]->len;
+		if(host_sz == 0 && p) {
+			host = p->host;
+			host_sz = strlen(p->host);
+		}
+
+		n = cluster_node_get(cl, host, host_sz, (short)master->element[1]->integer);
+		for(slot = (int)start; slot <= (int)end; ++slot) {
+			cl->slots[slot] = n;
+		}
+	}
+
+	cluster_gc(cl);
+}
+
+static void
+cluster_refresh(struct cluster *cl) {
+
+	redisAsyncContext *ac;
+
+	if(cl->refreshing || !(ac = (redisAsyncContext *)cluster_get_context(cl))) {
+		return;
+	}
+	cl->refreshing = 1;
+	cl->refreshes++;
+	redisAsyncCommand(ac, cluster_on_slots, cl, "CLUSTER SLOTS");
+}
+
+static void
+cluster_on_timer(int fd, short event, void *ptr) {
+
+	struct cluster *cl = ptr;
+	struct timeval tv = {CLUSTER_REFRESH_INTERVAL, 0};
+
+	(void)fd;
+	(void)event;
+
+	/* retry quickly until the topology is known */
+	if(!cl->nodes) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100*1000;
+	}
+	cluster_refresh(cl);
+	evtimer_add(&cl->ev_refresh, &tv);
+}
+
+void
+cluster_start(struct cluster *cl) {
+
+	struct timeval tv = {0, 0};
+
+	evtimer_set(&cl->ev_refresh, cluster_on_timer, cl);
+	event_base_set(cl->w->base, &cl->ev_refresh);
+	evtimer_add(&cl->ev_refresh, &tv);
+}
+
+void
+cluster_free(struct cluster *cl) {
+
+	struct cluster_node *n, *next;
+
+	evtimer_del(&cl->ev_refresh);
+	for(n = cl->nodes; n; n = next) {
+		next = n->next;
+		cluster_node_free(cl, n);
+	}
+	free(cl);
+}
+
+static void
+cluster_retry(int fd, short event, void *ptr) {
+
+	struct cmd *cmd = ptr;
+
+	(void)fd;
+	(void)event;
+
+	cmd_send(cmd, cmd->f_format);
+}
+
+/**
+ * Picks the connection for the command, before it is sent. Returns 0 if
+ * the command can't be sent now: it will be retried once the node is
+ * connected, or has been answered with an error.
+ */
+int
+cluster_route(struct cluster *cl, struct cmd *cmd, formatting_fun f_format) {
+
+	struct cluster_node *n = cmd->cluster_ask;
+	const redisAsyncContext *ac;
+	int i;
+
+	cmd->f_format = f_format;
+
+	if(!n && (i = cmd_key_index(cmd))) {
+		n = cl->slots[cluster_key_slot(cmd->argv[i], cmd->argv_len[i])];
+	}
+	if(!n) { /* no key, or unknown slot: keep the current connection */
+		return 1;
+	}
+
+	if(!(ac = pool_get_context(n->pool))) {
+		struct timeval tv = {0, 20*1000};
+
+		if(cmd->cluster_tries++ < CLUSTER_MAX_TRIES) { /* still connecting */
+			event_base_once(cl->w->base, -1, EV_TIMEOUT, cluster_retry, cmd, &tv);
+		} else {
+			if(cmd->cluster_ask) {
+				cmd->cluster_ask->asked--;
+				cmd->cluster_ask = NULL;
+			}
+			format_send_error(cmd, 503, "Service Unavailable");
+		}
+		return 0;
+	}
+	cmd->ac = (redisAsyncContext *)ac;
+
+	if(cmd->cluster_ask) { /* the slot is being migrated */
+		redisAsyncCommand(cmd->ac, NULL, NULL, "ASKING");
+		cmd->cluster_ask->asked--;
+		cmd->cluster_ask = NULL;
+	}
+	return 1;
+}
+
+/**
+ * Reply callback in cluster mode, before the actual formatting function.
+ */
+void
+cluster_on_reply(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *cmd = privdata;
+	redisReply *reply = r;
+	struct cluster *cl;
+	int moved = 0, ask = 0;
+
+	if(cmd && reply && reply->type == REDIS_REPLY_ERROR) {
+		moved = (strncmp(reply->str, "MOVED ", 6) == 0);
+		ask = (strncmp(reply->str, "ASK ", 4) == 0);
+	}
+
+	if((moved || ask) && cmd->cluster_tries < CLUSTER_MAX_TRIES) {
+		/* MOVED 3999 127.0.0.1:6381 */
+		char *slot = strchr(reply->str, ' ') + 1;
+		char *addr = strchr(slot, ' ');
+		char *colon = addr ? strrchr(addr, ':') : NULL;
+
+		if(colon) {
+			struct cluster_node *n;
+
+			cl = cmd->w->cluster;
+			addr++;
+			n = cluster_node_get(cl, addr, colon - addr, (short)atoi(colon + 1));
+			cmd->cluster_tries++;
+
+			if(moved) {
+				cl->moved++;
+				cl->slots[atoi(slot) & (CLUSTER_SLOTS - 1)] = n;
+				cluster_refresh(cl); /* more slots have probably moved */
+			} else {
+				cl->asked++;
+				cmd->cluster_ask = n;
+				n->asked++;
+			}
+			cmd_send(cmd, cmd->f_format);
+			return;
+		}
+	}
+
+	if(cmd) {
+		cmd->f_format(ac, r, cmd);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <event.h>
+#include <hiredis/async.h>
+#include "cmd.h"
+
+#define CLUSTER_SLOTS 16384
+
+struct worker;
+struct pool;
+
+struct cluster_node {
+	char *host;
+	short port;
+	struct pool *pool;
+	int asked; /* commands keeping it as their ASK target */
+	int owner; /* of at least one slot */
+
+	struct cluster_node *next;
+};
+
+struct cluster {
+	struct worker *w;
+
+	struct cluster_node *nodes;
+	int node_count;
+	struct cluster_node *slots[CLUSTER_SLOTS];
+
+	int refreshing; /* CLUSTER SLOTS sent, no reply yet */
+	struct event ev_refresh;
+
+	/* counters */
+	unsigned long moved;
+	unsigned long asked;
+	unsigned long refreshes;
+};
+
+struct cluster *
+cluster_new(struct worker *w);
+
+void
+cluster_start(struct cluster *cl);
+
+void
+cluster_free(struct cluster *cl);
+
+const redisAsyncContext *
+cluster_get_context(struct cluster *cl);
+
+unsigned int
+cluster_key_slot(const char *key, size_t sz);
+
+int
+cluster_route(struct cluster *cl, struct cmd *cmd, formatting_fun f_format);
+
+void
+cluster_on_reply(redisAsyncContext *ac, void *r, void *privdata);
+
+#endif
@@ -6,14 +6,27 @@
 #include "worker.h"
 #include "http.h"
 #include "server.h"
+#include "script.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "replica.h"
+#include "cluster.h"
+#include "shard.h"
+#include "hub.h"
+#include "stream.h"
+#include "changes.h"
+#include "splice.h"
+#include "chunked.h"
 #include "slog.h"
 
 #include "formats/json.h"
 #include "formats/raw.h"
+#include "formats/sse.h"
 #ifdef MSGPACK
 #include "formats/msgpack.h"
 #endif
 #include "formats/custom-type.h"
+#include "formats/common.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +34,9 @@
 #include <hiredis/async.h>
 #include <ctype.h>
 
+static int
+cmd_is_shared_poll(struct cmd *cmd);
+
 struct cmd *
 cmd_new(int count) {
 
@@ -45,6 +61,29 @@ cmd_free(struct cmd *c) {
 		free((char*)c->argv[i]);
 	}
 
+	coalesce_done(c);
+	replicas_done(c);
+	if(c->hub_members) {
+		hub_leave(c);
+	}
+	if(c->reader) {
+		stream_stop(c->reader);
+	}
+	if(c->watcher) {
+		changes_leave(c->watcher);
+	}
+	if(c->chunked) {
+		chunked_free(c->chunked);
+	}
+	cmd_detach(c);
+	if(c->deadline_set) {
+		evtimer_del(&c->ev_deadline);
+	}
+	if(c->heartbeat_set) {
+		evtimer_del(&c->ev_heartbeat);
+	}
+	free(c->cache_key);
+
 	free(c->jsonp);
 	free(c->separator);
 	free(c->if_none_match);
@@ -62,7 +101,7 @@ cmd_free(struct cmd *c) {
 }
 
 /* taken from libevent */
-static char *
+char *
 decode_uri(const char *uri, size_t length, size_t *out_len, int always_decode_plus) {
 	char c;
 	size_t i, j;
@@ -89,19 +128,45 @@ decode_uri(const char *uri, size_t length, size_t *out_len, int always_decode_pl
 	return ret;
 }
 
+/* a client can only shorten the deadline set in the config */
+static void
+cmd_setup_timeout(struct cmd *cmd, const char *val) {
+
+	char *end;
+	long ms = strtol(val, &end, 10);
+
+	if(end == val || *end || ms <= 0) { /* ignored */
+		return;
+	}
+	if(cmd->timeout_ms <= 0 || ms < cmd->timeout_ms) {
+		cmd->timeout_ms = ms;
+	}
+}
+
 /* setup headers */
 void
 cmd_setup(struct cmd *cmd, struct http_client *client) {
 
 	int i;
 	cmd->keep_alive = client->keep_alive;
+	cmd->primary = client->primary;
 	cmd->w = client->w; /* keep track of the worker */
+	cmd->timeout_ms = client->s->cfg->request_timeout_ms;
+
+	/* cancelled if the client goes away */
+	cmd->client = client;
+	cmd->client_next = client->cmds;
+	client->cmds = cmd;
 
 	for(i = 0; i < client->header_count; ++i) {
 		if(strcasecmp(client->headers[i].key, "If-None-Match") == 0) {
 			cmd->if_none_match = calloc(1+client->headers[i].val_sz, 1);
 			memcpy(cmd->if_none_match, client->headers[i].val,
 					client->headers[i].val_sz);
+		} else if(strcasecmp(client->headers[i].key, "X-Webdis-Primary") == 0) {
+			cmd->primary = strcmp(client->headers[i].val, "0") != 0;
+		} else if(strcasecmp(client->headers[i].key, "X-Timeout-Ms") == 0) {
+			cmd_setup_timeout(cmd, client->headers[i].val);
 		} else if(strcasecmp(client->headers[i].key, "Connection") == 0 &&
 				strcasecmp(client->headers[i].val, "Keep-Alive") == 0) {
 			cmd->keep_alive = 1;
@@ -133,6 +198,100 @@ cmd_setup(struct cmd *cmd, struct http_client *client) {
 	cmd->http_version = client->http_version;
 }
 
+/* the client doesn't need to know about this command anymore */
+void
+cmd_detach(struct cmd *cmd) {
+
+	struct cmd **prev;
+
+	if(!cmd->client) {
+		return;
+	}
+	for(prev = &cmd->client->cmds; *prev; prev = &(*prev)->client_next) {
+		if(*prev == cmd) {
+			*prev = cmd->client_next;
+			break;
+		}
+	}
+	cmd->client = NULL;
+	cmd->client_next = NULL;
+}
+
+/**
+ * Nobody is waiting for this reply anymore: it won't be formatted or sent.
+ * The command itself is freed when Redis replies.
+ */
+void
+cmd_abandon(struct cmd *cmd) {
+
+	cmd->abandoned = 1;
+	cmd_detach(cmd);
+	if(cmd->deadline_set) {
+		evtimer_del(&cmd->ev_deadline);
+		cmd->deadline_set = 0;
+	}
+	if(cmd->splice) {
+		splice_abandon(cmd->splice);
+	}
+}
+
+static void
+cmd_on_deadline(int fd, short event, void *ptr) {
+
+	struct cmd *cmd = ptr;
+	struct http_response *resp;
+
+	(void)fd;
+	(void)event;
+
+	cmd->deadline_set = 0;
+	slog(cmd->w->s, WEBDIS_DEBUG, "504", 3);
+
+	if(cmd->is_websocket) {
+		/* an error frame, sent for a stand-in: this command is freed by its reply */
+		struct cmd *e = NULL;
+		if(cmd->client) {
+			e = cmd_new(1);
+			e->argv[0] = malloc(cmd->argv_len[0]);
+			memcpy(e->argv[0], cmd->argv[0], cmd->argv_len[0]);
+			e->argv_len[0] = cmd->argv_len[0];
+			e->is_websocket = 1;
+			e->f_format = cmd->f_format;
+			cmd_setup(e, cmd->client);
+		}
+		cmd_abandon(cmd);
+		if(e) {
+			format_send_error(e, 504, "Gateway Timeout");
+		}
+		return;
+	}
+
+	resp = http_response_init(cmd->w, 504, "Gateway Timeout");
+	resp->http_version = cmd->http_version;
+	http_response_set_keep_alive(resp, cmd->keep_alive);
+	http_response_write(resp, cmd->fd);
+
+	cmd_abandon(cmd);
+}
+
+/* past its timeout, the client is answered and the reply is dropped */
+void
+cmd_set_deadline(struct cmd *cmd) {
+
+	struct timeval tv;
+
+	if(cmd->timeout_ms <= 0) {
+		return;
+	}
+	tv.tv_sec = cmd->timeout_ms / 1000;
+	tv.tv_usec = (cmd->timeout_ms % 1000) * 1000;
+
+	evtimer_set(&cmd->ev_deadline, cmd_on_deadline, cmd);
+	event_base_set(cmd->w->base, &cmd->ev_deadline);
+	evtimer_add(&cmd->ev_deadline, &tv);
+	cmd->deadline_set = 1;
+}
+
 
 cmd_response_t
 cmd_run(struct worker *w, struct http_client *client,
@@ -218,70 +377,258 @@ cmd_run(struct worker *w, struct http_client *client,
 		return CMD_ACL_FAIL;
 	}
 
-	if(cmd_is_subscribe(cmd)) {
+	if(slash) {
+		p = cmd_name + cmd_len + 1;
+		while(p < uri + uri_len) {
+
+			const char *arg = p;
+			int arg_len;
+			char *next = memchr(arg, '/', uri_len - (arg-uri));
+			if(!next || next > uri + uri_len) { /* last argument */
+				p = uri + uri_len;
+				arg_len = p - arg;
+			} else { /* found a slash */
+				arg_len = next - arg;
+				p = next + 1;
+			}
+
+			/* record argument */
+			cmd->argv[cur_param] = decode_uri(arg, arg_len, &cmd->argv_len[cur_param], 1);
+			cur_param++;
+		}
+
+		if(body && body_len) { /* PUT request */
+			cmd->argv[cur_param] = malloc(body_len);
+			memcpy(cmd->argv[cur_param], body, body_len);
+			cmd->argv_len[cur_param] = body_len;
+		}
+	} else { /* no args (e.g. INFO command) */
+		cmd->count = 1;
+	}
+
+	/* an EventSource reconnecting to a stream */
+	if(f_format == sse_reply && client_get_header(client, "Last-Event-ID")) {
+		sse_resume(cmd, client_get_header(client, "Last-Event-ID"));
+	}
+
+	/* Redis Cluster only has DB 0, shards are used with the default one */
+	if((w->cluster && cmd->database != 0)
+			|| (w->shards && cmd->database != w->s->cfg->database)) {
+		cmd_free(cmd);
+		return CMD_PARAM_ERROR;
+	}
+
+	/* answer from the local cache if we can */
+	if(w->cache && cache_lookup(w->cache, cmd, f_format)) {
+		return CMD_SENT;
+	}
+
+	if(!cmd_is_subscribe(cmd)) {
+		cmd_set_deadline(cmd);
+	}
+
+	/* GET of a large value, sent from one socket to the other */
+	if(w->splice && !cmd_is_subscribe(cmd) && splice_run(w->splice, cmd, f_format)) {
+		return CMD_SENT;
+	}
+
+	if(cmd_is_subscribe(cmd) && w->hub && cmd->count > 1) {
+		/* register with the client, used upon disconnection */
+		client->pub_sub = cmd;
+		cmd->pub_sub_client = client;
+
+		/* one Redis subscription per channel, shared by all the clients */
+		hub_subscribe(w->hub, cmd, f_format);
+		return CMD_SENT;
+	} else if(cmd_is_subscribe(cmd)) {
 		/* create a new connection to Redis */
 		cmd->ac = (redisAsyncContext*)pool_connect(w->pool, cmd->database, 0);
 
 		/* register with the client, used upon disconnection */
 		client->pub_sub = cmd;
 		cmd->pub_sub_client = client;
+
+		if(cmd->ac) {
+			cmd_dispatch(cmd, f_format);
+			return CMD_SENT;
+		}
+	} else if(cmd_execute(cmd, f_format) == CMD_SENT) {
+		return CMD_SENT;
+	}
+
+	/* failed to find a suitable connection to Redis. */
+	cmd_free(cmd);
+	client->pub_sub = NULL;
+	return CMD_REDIS_UNAVAIL;
+}
+
+/**
+ * Sends a command other than a subscription on the right connection, or
+ * queues it until one of them has room. Returns CMD_REDIS_UNAVAIL if Redis
+ * can't be reached, and the command is left to the caller.
+ */
+cmd_response_t
+cmd_execute(struct cmd *cmd, formatting_fun f_format) {
+
+	struct worker *w = cmd->w;
+	struct pool *queue = NULL; /* pool to wait on if all its connections are busy */
+
+	if(w->cluster) {
+		/* sent to the right node later on */
+		cmd->ac = (redisAsyncContext*)cluster_get_context(w->cluster);
+	} else if(w->shards) {
+		/* the connection is picked once the keys are known, see shards_route */
+		cmd_dispatch(cmd, f_format);
+		return CMD_SENT;
 	} else if(cmd->database != w->s->cfg->database) {
 		/* create a new connection to Redis for custom DBs */
 		cmd->ac = (redisAsyncContext*)pool_connect(w->pool, cmd->database, 0);
+	} else if(w->blocking && cmd_is_blocking(cmd)) {
+		/* identical long-polls wait for the same reply */
+		if(cmd_is_shared_poll(cmd) && !cmd->is_websocket
+				&& coalesce_join(w->pollers, cmd, f_format)) {
+			return CMD_SENT;
+		}
+		/* kept away from the main pool, one command per connection */
+		cmd->ac = (redisAsyncContext*)pool_get_context(w->blocking);
+		queue = w->blocking;
 	} else {
-		/* get a connection from the pool */
-		cmd->ac = (redisAsyncContext*)pool_get_context(w->pool);
-	}
+		/* reads go to a replica if there is one available */
+		if(w->replicas && !cmd->primary && cmd_is_readonly(cmd)) {
+			cmd->ac = (redisAsyncContext*)replicas_get_context(w->replicas, cmd);
+		}
 
-	/* no args (e.g. INFO command) */
-	if(!slash) {
+		/* get a connection from the pool */
 		if(!cmd->ac) {
-			cmd_free(cmd);
-			return CMD_REDIS_UNAVAIL;
+			cmd->ac = (redisAsyncContext*)pool_get_context(w->pool);
+			queue = w->pool;
 		}
-		redisAsyncCommandArgv(cmd->ac, f_format, cmd, 1,
-				(const char **)cmd->argv, cmd->argv_len);
+	}
+
+	/* send it off! */
+	if(cmd->ac) {
+		cmd_dispatch(cmd, f_format);
 		return CMD_SENT;
 	}
-	p = cmd_name + cmd_len + 1;
-	while(p < uri + uri_len) {
-
-		const char *arg = p;
-		int arg_len;
-		char *next = memchr(arg, '/', uri_len - (arg-uri));
-		if(!next || next > uri + uri_len) { /* last argument */
-			p = uri + uri_len;
-			arg_len = p - arg;
-		} else { /* found a slash */
-			arg_len = next - arg;
-			p = next + 1;
+
+	/* all the connections are busy, wait for one of them */
+	if(queue) {
+		cmd->f_format = f_format;
+		if(pool_enqueue(queue, cmd)) {
+			return CMD_SENT;
 		}
+	}
+	return CMD_REDIS_UNAVAIL;
+}
+
+/**
+ * Send a command that has a connection, unless an identical one is in flight.
+ */
+void
+cmd_dispatch(struct cmd *cmd, formatting_fun f_format) {
+
+	struct worker *w = cmd->w;
 
-		/* record argument */
-		cmd->argv[cur_param] = decode_uri(arg, arg_len, &cmd->argv_len[cur_param], 1);
-		cur_param++;
+	/* WebSocket replies are frames, they aren't shared: see format_send_reply */
+	if(w->coalesce && !cmd->flight && !cmd->pub_sub_client && !cmd->primary
+			&& !cmd->is_websocket && cmd_is_readonly(cmd)
+			&& coalesce_join(w->coalesce, cmd, f_format)) {
+		return; /* waiting for an identical command */
 	}
+	if(cmd->cache_key) {
+		cache_prepare(w->cache, cmd);
+	}
+	cmd_send(cmd, f_format);
+}
 
-	if(body && body_len) { /* PUT request */
-		cmd->argv[cur_param] = malloc(body_len);
-		memcpy(cmd->argv[cur_param], body, body_len);
-		cmd->argv_len[cur_param] = body_len;
+/* reply to a command sent with cmd_send, subscriptions excepted */
+static void
+cmd_on_reply(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *cmd = privdata;
+	struct pool *p = ac->data;
+
+	if(cmd && cmd->chunked) { /* an element of a large array */
+		chunked_item(ac, cmd, r);
+		return;
 	}
 
-	/* send it off! */
-	if(cmd->ac) {
-		cmd_send(cmd, f_format);
-		return CMD_SENT;
+	if(cmd && cmd->w->cache && !cmd_is_readonly(cmd)) {
+		cache_on_write(cmd->w->cache, cmd);
+	}
+	if(cmd && r && ((redisReply*)r)->type == REDIS_REPLY_STREAM) {
+		/* the elements follow, one callback each: the command
+		 * is still in flight until the last one */
+		chunked_start(cmd, r);
+		return;
+	}
+
+	if(cmd) {
+		pool_on_reply(ac, r != NULL, &cmd->sent_at);
+	}
+	if(cmd && cmd->abandoned && !cmd->waiters) {
+		/* timed out, or the client is gone: don't format the reply */
+		cmd_free(cmd);
+	} else if(cmd && cmd->w->cluster) {
+		cluster_on_reply(ac, r, cmd);
+	} else if(cmd) {
+		cmd->f_format(ac, r, cmd);
+	}
+
+	if(p && r) { /* this connection has room for one more command */
+		pool_dispatch(p);
 	}
-	/* failed to find a suitable connection to Redis. */
-	cmd_free(cmd);
-	client->pub_sub = NULL;
-	return CMD_REDIS_UNAVAIL;
 }
 
 void
 cmd_send(struct cmd *cmd, formatting_fun f_format) {
-	redisAsyncCommandArgv(cmd->ac, f_format, cmd, cmd->count,
+
+	formatting_fun f_reply = f_format;
+	size_t stream;
+
+	if(!cmd_is_subscribe(cmd)) {
+		if(cmd->w->cluster) {
+			/* find the right node, and follow redirections */
+			if(!cluster_route(cmd->w->cluster, cmd, f_format)) {
+				return;
+			}
+		} else if(cmd->w->shards) {
+			/* find the right shard, or split the command */
+			if(!shards_route(cmd->w->shards, cmd, f_format)) {
+				return;
+			}
+		}
+
+		/* count it against its connection until the reply comes back */
+		cmd->f_format = f_format;
+		f_reply = cmd_on_reply;
+		gettimeofday(&cmd->sent_at, NULL);
+		pool_on_send(cmd->ac);
+	}
+
+	if(cmd->w->s->cfg->script_cache) {
+		if(script_is_eval(cmd)) { /* might be sent as EVALSHA */
+			script_send(cmd, f_reply);
+			return;
+		}
+		script_check_flush(cmd);
+	}
+
+	if(f_reply == cmd_on_reply && !cmd->w->cluster && !cmd->w->shards
+			&& (stream = chunked_threshold(cmd->w->chunked, cmd, f_format))) {
+		/* large arrays are sent on element by element */
+		redisAsyncStreamCommandArgv(cmd->ac, f_reply, cmd, f_format == raw_reply,
+			stream, cmd->count, (const char **)cmd->argv, cmd->argv_len);
+		return;
+	}
+
+	if(f_format == raw_reply && f_reply == cmd_on_reply && !cmd->w->cluster) {
+		/* nothing to look at in the reply: have it sent on as received */
+		redisAsyncRawCommandArgv(cmd->ac, f_reply, cmd, cmd->count,
+			(const char **)cmd->argv, cmd->argv_len);
+		return;
+	}
+	redisAsyncCommandArgv(cmd->ac, f_reply, cmd, cmd->count,
 		(const char **)cmd->argv, cmd->argv_len);
 }
 
@@ -307,6 +654,7 @@ cmd_select_format(struct http_client *client, struct cmd *cmd,
 	struct reply_format funs[] = {
 		{.s = "json", .sz = 4, .f = json_reply, .ct = "application/json"},
 		{.s = "raw", .sz = 3, .f = raw_reply, .ct = "binary/octet-stream"},
+		{.s = "sse", .sz = 3, .f = sse_reply, .ct = "text/event-stream"},
 
 #ifdef MSGPACK
 		{.s = "msg", .sz = 3, .f = msgpack_reply, .ct = "application/x-msgpack"},
@@ -377,3 +725,285 @@ cmd_is_subscribe(struct cmd *cmd) {
 	}
 	return 0;
 }
+
+int
+cmd_is_unsubscribe(struct cmd *cmd) {
+
+	if(cmd->count >= 1 && cmd->argv[0] &&
+		(strncasecmp(cmd->argv[0], "UNSUBSCRIBE", cmd->argv_len[0]) == 0 ||
+		strncasecmp(cmd->argv[0], "PUNSUBSCRIBE", cmd->argv_len[0]) == 0)) {
+		return 1;
+	}
+	return 0;
+}
+
+/* more replies will follow on the same response */
+int
+cmd_is_streaming(struct cmd *cmd) {
+
+	return cmd->reader != NULL || cmd->watcher != NULL || cmd_is_subscribe(cmd);
+}
+
+/* commands that don't modify the dataset, with the position of their keys. */
+struct cmd_spec {
+	const char *name;
+	int first_key;
+	int last_key; /* negative values count from the end */
+};
+
+static const struct cmd_spec readonly_commands[] = {
+	{"GET", 1, 1}, {"MGET", 1, -1}, {"STRLEN", 1, 1}, {"GETRANGE", 1, 1},
+	{"SUBSTR", 1, 1}, {"GETBIT", 1, 1}, {"BITCOUNT", 1, 1}, {"BITPOS", 1, 1},
+	{"EXISTS", 1, -1}, {"TYPE", 1, 1}, {"TTL", 1, 1}, {"PTTL", 1, 1}, {"DUMP", 1, 1},
+	{"HGET", 1, 1}, {"HMGET", 1, 1}, {"HGETALL", 1, 1}, {"HKEYS", 1, 1},
+	{"HVALS", 1, 1}, {"HLEN", 1, 1}, {"HEXISTS", 1, 1}, {"HSTRLEN", 1, 1},
+	{"LRANGE", 1, 1}, {"LLEN", 1, 1}, {"LINDEX", 1, 1},
+	{"SMEMBERS", 1, 1}, {"SISMEMBER", 1, 1}, {"SCARD", 1, 1},
+	{"SINTER", 1, -1}, {"SUNION", 1, -1}, {"SDIFF", 1, -1},
+	{"ZRANGE", 1, 1}, {"ZREVRANGE", 1, 1}, {"ZRANGEBYSCORE", 1, 1},
+	{"ZREVRANGEBYSCORE", 1, 1}, {"ZRANGEBYLEX", 1, 1}, {"ZREVRANGEBYLEX", 1, 1},
+	{"ZSCORE", 1, 1}, {"ZCARD", 1, 1}, {"ZCOUNT", 1, 1}, {"ZLEXCOUNT", 1, 1},
+	{"ZRANK", 1, 1}, {"ZREVRANK", 1, 1},
+	{"XRANGE", 1, 1}, {"XREVRANGE", 1, 1}, {"XLEN", 1, 1},
+	{"GEOPOS", 1, 1}, {"GEODIST", 1, 1}, {"GEOHASH", 1, 1}
+};
+
+static const struct cmd_spec *
+cmd_readonly_spec(struct cmd *cmd) {
+
+	unsigned int i;
+
+	if(cmd->count < 2 || !cmd->argv[0]) {
+		return NULL;
+	}
+
+	for(i = 0; i < sizeof(readonly_commands)/sizeof(readonly_commands[0]); ++i) {
+		if(strlen(readonly_commands[i].name) == cmd->argv_len[0] &&
+			strncasecmp(readonly_commands[i].name, cmd->argv[0], cmd->argv_len[0]) == 0) {
+			return &readonly_commands[i];
+		}
+	}
+	return NULL;
+}
+
+int
+cmd_is_readonly(struct cmd *cmd) {
+
+	return cmd_readonly_spec(cmd) != NULL;
+}
+
+/**
+ * Returns 1 for read-only commands that access a single key, in argv[1].
+ */
+int
+cmd_reads_single_key(struct cmd *cmd) {
+
+	const struct cmd_spec *spec = cmd_readonly_spec(cmd);
+	int last;
+
+	if(!spec) {
+		return 0;
+	}
+	last = spec->last_key < 0 ? cmd->count + spec->last_key : spec->last_key;
+	return spec->first_key == 1 && last == 1;
+}
+
+static void
+key_add(char **key, size_t *sz, const char *p, size_t len) {
+
+	/* length-prefixed, so that no two commands share a key */
+	*key = realloc(*key, *sz + sizeof(size_t) + len);
+	memcpy(*key + *sz, &len, sizeof(size_t));
+	memcpy(*key + *sz + sizeof(size_t), p, len);
+	*sz += sizeof(size_t) + len;
+}
+
+static void
+key_add_str(char **key, size_t *sz, const char *s) {
+	key_add(key, sz, s ? s : "", s ? strlen(s) + 1 : 0);
+}
+
+/**
+ * Everything that has an influence on the formatted reply:
+ * two commands with the same key get the same HTTP response body.
+ */
+char *
+cmd_reply_key(struct cmd *cmd, formatting_fun f_format, size_t *sz) {
+
+	int i;
+	char *key = NULL;
+
+	*sz = 0;
+	key_add(&key, sz, (const char *)&cmd->database, sizeof(cmd->database));
+	key_add(&key, sz, (const char *)&f_format, sizeof(f_format));
+	key_add_str(&key, sz, cmd->mime);
+	key_add_str(&key, sz, cmd->jsonp);
+	key_add_str(&key, sz, cmd->separator);
+	key_add_str(&key, sz, cmd->filename);
+	for(i = 0; i < cmd->count; ++i) {
+		key_add(&key, sz, cmd->argv[i], cmd->argv_len[i]);
+	}
+
+	return key;
+}
+
+unsigned int
+cmd_hash(const char *p, size_t sz) {
+
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	size_t i;
+	for(i = 0; i < sz; ++i) {
+		h ^= (unsigned char)p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* commands without a key, that can be sent to any node. */
+static const char *keyless_commands[] = {
+	"PING", "ECHO", "INFO", "TIME", "DBSIZE", "FLUSHALL", "FLUSHDB", "RANDOMKEY",
+	"KEYS", "SCAN", "CLUSTER", "CONFIG", "CLIENT", "COMMAND", "SCRIPT", "FUNCTION",
+	"PUBLISH", "PUBSUB", "LASTSAVE", "SAVE", "BGSAVE", "BGREWRITEAOF", "SLOWLOG",
+	"LATENCY", "ROLE", "DEBUG", "WAIT", "READONLY", "READWRITE", "ACL", "MODULE",
+	"LOLWUT", "SWAPDB", "SELECT", "AUTH", "HELLO", "QUIT", "MULTI", "EXEC",
+	"DISCARD", "UNWATCH", "MONITOR", "SHUTDOWN", "REPLICAOF", "SLAVEOF"
+};
+
+static int
+cmd_name_is(struct cmd *cmd, const char *name) {
+
+	return strlen(name) == cmd->argv_len[0]
+		&& strncasecmp(name, cmd->argv[0], cmd->argv_len[0]) == 0;
+}
+
+static long
+cmd_arg_integer(struct cmd *cmd, int i) {
+
+	char buf[24];
+	size_t sz;
+
+	if(i >= cmd->count || !cmd->argv[i]) {
+		return 0;
+	}
+	sz = cmd->argv_len[i] < sizeof(buf) - 1 ? cmd->argv_len[i] : sizeof(buf) - 1;
+	memcpy(buf, cmd->argv[i], sz);
+	buf[sz] = 0;
+	return atol(buf);
+}
+
+/**
+ * Returns the position of the first key in argv, or 0 if there is none.
+ */
+int
+cmd_key_index(struct cmd *cmd) {
+
+	unsigned int i;
+	int pos = 1;
+
+	if(cmd->count < 1 || !cmd->argv[0]) {
+		return 0;
+	}
+
+	for(i = 0; i < sizeof(keyless_commands)/sizeof(keyless_commands[0]); ++i) {
+		if(cmd_name_is(cmd, keyless_commands[i])) {
+			return 0;
+		}
+	}
+
+	if(cmd_name_is(cmd, "EVAL") || cmd_name_is(cmd, "EVALSHA")
+			|| cmd_name_is(cmd, "EVAL_RO") || cmd_name_is(cmd, "EVALSHA_RO")
+			|| cmd_name_is(cmd, "FCALL") || cmd_name_is(cmd, "FCALL_RO")) {
+		pos = cmd_arg_integer(cmd, 2) > 0 ? 3 : 0;
+	} else if(cmd_name_is(cmd, "BITOP") || cmd_name_is(cmd, "OBJECT")
+			|| cmd_name_is(cmd, "MEMORY") || cmd_name_is(cmd, "XINFO")
+			|| cmd_name_is(cmd, "XGROUP")
+			|| cmd_name_is(cmd, "ZUNION") || cmd_name_is(cmd, "ZINTER")
+			|| cmd_name_is(cmd, "ZDIFF") || cmd_name_is(cmd, "SINTERCARD")
+			|| cmd_name_is(cmd, "ZINTERCARD") || cmd_name_is(cmd, "LMPOP")
+			|| cmd_name_is(cmd, "ZMPOP")) {
+		pos = 2;
+	} else if(cmd_name_is(cmd, "BLMPOP") || cmd_name_is(cmd, "BZMPOP")) {
+		pos = 3;
+	} else if(cmd_name_is(cmd, "XREAD") || cmd_name_is(cmd, "XREADGROUP")) {
+		for(pos = 1; pos < cmd->count; ++pos) {
+			if(cmd->argv_len[pos] == 7 && strncasecmp(cmd->argv[pos], "STREAMS", 7) == 0) {
+				break;
+			}
+		}
+		pos++;
+	}
+
+	return pos < cmd->count ? pos : 0;
+}
+
+static int
+cmd_has_arg(struct cmd *cmd, const char *arg) {
+
+	int i;
+	size_t sz = strlen(arg);
+
+	for(i = 1; i < cmd->count; ++i) {
+		if(cmd->argv_len[i] == sz && strncasecmp(cmd->argv[i], arg, sz) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Commands that can keep a connection busy until their timeout.
+ */
+int
+cmd_is_blocking(struct cmd *cmd) {
+
+	const char *blocking[] = {"BLPOP", "BRPOP", "BRPOPLPUSH", "BLMOVE", "BLMPOP",
+		"BZPOPMIN", "BZPOPMAX", "BZMPOP", "WAIT", "WAITAOF"};
+	unsigned int i;
+
+	if(cmd->count < 1 || !cmd->argv[0]) {
+		return 0;
+	}
+	for(i = 0; i < sizeof(blocking)/sizeof(blocking[0]); ++i) {
+		if(cmd_name_is(cmd, blocking[i])) {
+			return 1;
+		}
+	}
+	return (cmd_name_is(cmd, "XREAD") || cmd_name_is(cmd, "XREADGROUP"))
+		&& cmd_has_arg(cmd, "BLOCK");
+}
+
+/**
+ * Blocking commands that don't consume anything: clients waiting with the
+ * same arguments can share a single call and its reply.
+ */
+static int
+cmd_is_shared_poll(struct cmd *cmd) {
+
+	return cmd_name_is(cmd, "XREAD") && cmd_has_arg(cmd, "BLOCK");
+}
+
+/**
+ * Part of the key used to pick a cluster slot or shard: only what's between
+ * the first {...} is hashed, if it is not empty.
+ */
+const char *
+cmd_key_tag(const char *key, size_t *sz) {
+
+	size_t s, e;
+
+	for(s = 0; s < *sz; ++s) {
+		if(key[s] == '{') break;
+	}
+	if(s == *sz) {
+		return key;
+	}
+	for(e = s + 1; e < *sz; ++e) {
+		if(key[e] == '}') break;
+	}
+	if(e == *sz || e == s + 1) {
+		return key;
+	}
+	*sz = e - s - 1;
+	return key + s + 1;
+}
@@ -12,6 +12,16 @@ struct http_client;
 struct server;
 struct worker;
 struct cmd;
+struct coalesce_entry;
+struct replica;
+struct cluster_node;
+struct hub_member;
+struct stream_reader;
+struct changes_watcher;
+struct changes_note;
+struct shard_part;
+struct splice_get;
+struct chunked_reply;
 
 typedef void (*formatting_fun)(redisAsyncContext *, void *, void *);
 typedef enum {CMD_SENT,
@@ -42,10 +52,51 @@ struct cmd {
 	int is_websocket;
 	int http_version;
 	int database;
+	int primary; /* don't send to a replica */
 
 	struct http_client *pub_sub_client;
 	redisAsyncContext *ac;
+	struct hub_member *hub_members; /* channels shared through the hub */
+	struct stream_reader *reader; /* tailing a Redis Stream */
+	struct changes_watcher *watcher; /* following keyspace changes */
+	struct splice_get *splice; /* GET on a connection of its own */
+	struct chunked_reply *chunked; /* large array, sent as it is read */
+	struct changes_note *note; /* GET of a changed key, for its watchers */
+	struct shard_part *shard_part; /* one shard's share of a split command */
+
+	/* HTTP client waiting for the reply, until it disconnects */
+	struct http_client *client;
+	struct cmd *client_next;
+
+	/* deadline: past it, the client gets a 504 and the reply is dropped */
+	long timeout_ms;
+	struct event ev_deadline;
+	int deadline_set;
+	int abandoned;
+
+	/* Server-Sent Events keep-alive comments */
+	struct event ev_heartbeat;
+	int heartbeat_set;
+
+	struct replica *replica;
 	struct worker *w;
+
+	/* formatting function, called once redirections are followed */
+	formatting_fun f_format;
+	struct timeval sent_at;
+	struct cmd *next_queued; /* waiting for a pooled connection */
+	struct cluster_node *cluster_ask;
+	int cluster_tries;
+
+	/* identical commands waiting for the same reply */
+	struct coalesce_entry *flight;
+	struct cmd *waiters;
+	struct cmd *next_waiter;
+
+	/* reply to be stored in the local cache */
+	char *cache_key;
+	size_t cache_key_sz;
+	unsigned long cache_epoch;
 };
 
 struct subscription {
@@ -59,6 +110,9 @@ cmd_new(int count);
 void
 cmd_free(struct cmd *c);
 
+char *
+decode_uri(const char *uri, size_t length, size_t *out_len, int always_decode_plus);
+
 cmd_response_t
 cmd_run(struct worker *w, struct http_client *client,
 		const char *uri, size_t uri_len,
@@ -71,10 +125,52 @@ cmd_select_format(struct http_client *client, struct cmd *cmd,
 int
 cmd_is_subscribe(struct cmd *cmd);
 
+int
+cmd_is_unsubscribe(struct cmd *cmd);
+
+int
+cmd_is_streaming(struct cmd *cmd);
+
+int
+cmd_is_readonly(struct cmd *cmd);
+
+int
+cmd_reads_single_key(struct cmd *cmd);
+
+int
+cmd_key_index(struct cmd *cmd);
+
+int
+cmd_is_blocking(struct cmd *cmd);
+
+const char *
+cmd_key_tag(const char *key, size_t *sz);
+
+char *
+cmd_reply_key(struct cmd *cmd, formatting_fun f_format, size_t *sz);
+
+unsigned int
+cmd_hash(const char *p, size_t sz);
+
+cmd_response_t
+cmd_execute(struct cmd *cmd, formatting_fun f_format);
+
+void
+cmd_dispatch(struct cmd *cmd, formatting_fun f_format);
+
 void
 cmd_send(struct cmd *cmd, formatting_fun f_format);
 
 void
 cmd_setup(struct cmd *cmd, struct http_client *client);
 
+void
+cmd_abandon(struct cmd *cmd);
+
+void
+cmd_set_deadline(struct cmd *cmd);
+
+void
+cmd_detach(struct cmd *cmd);
+
 #endif
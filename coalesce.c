@@ -0,0 +1,96 @@
+#include "coalesce.h"
+#include "cmd.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Single-flight coalescing: identical read-only commands that arrive while
+ * one of them is still waiting for Redis are attached to the pending one.
+ * Its reply is formatted once and sent to all of them.
+ */
+
+struct coalesce_entry {
+	char *key;
+	size_t key_sz;
+	unsigned int hash;
+
+	struct coalesce *co;
+	struct cmd *leader;
+	struct coalesce_entry *next;
+};
+
+struct coalesce *
+coalesce_new(unsigned int size) {
+
+	struct coalesce *co = calloc(1, sizeof(struct coalesce));
+
+	co->size = size;
+	co->buckets = calloc(size, sizeof(struct coalesce_entry *));
+
+	return co;
+}
+
+/**
+ * Returns 1 if the command was attached to an identical pending command,
+ * or 0 if it is now pending itself and needs to be sent to Redis.
+ */
+int
+coalesce_join(struct coalesce *co, struct cmd *cmd, formatting_fun f_format) {
+
+	struct coalesce_entry *e;
+	size_t key_sz;
+	char *key = cmd_reply_key(cmd, f_format, &key_sz);
+	unsigned int hash = cmd_hash(key, key_sz);
+
+	for(e = co->buckets[hash % co->size]; e; e = e->next) {
+		if(e->hash == hash && e->key_sz == key_sz && memcmp(e->key, key, key_sz) == 0) {
+
+			/* wait for the same reply */
+			cmd->next_waiter = e->leader->waiters;
+			e->leader->waiters = cmd;
+
+			if(cmd->next_waiter == NULL) {
+				co->merges++;
+			}
+			co->hits++;
+			free(key);
+			return 1;
+		}
+	}
+
+	/* first one, register it */
+	e = calloc(1, sizeof(struct coalesce_entry));
+	e->key = key;
+	e->key_sz = key_sz;
+	e->hash = hash;
+	e->co = co;
+	e->leader = cmd;
+	e->next = co->buckets[hash % co->size];
+	co->buckets[hash % co->size] = e;
+
+	cmd->flight = e;
+	return 0;
+}
+
+/**
+ * Called when the reply has arrived: new commands won't be attached to
+ * this one anymore.
+ */
+void
+coalesce_done(struct cmd *cmd) {
+
+	struct coalesce_entry *e = cmd->flight, **prev;
+
+	if(!e) return;
+	for(prev = &e->co->buckets[e->hash % e->co->size]; *prev; prev = &(*prev)->next) {
+		if(*prev == e) {
+			*prev = e->next;
+			break;
+		}
+	}
+
+	cmd->flight = NULL;
+	free(e->key);
+	free(e);
+}
@@ -0,0 +1,26 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "cmd.h"
+
+struct coalesce_entry;
+
+struct coalesce {
+	struct coalesce_entry **buckets;
+	unsigned int size;
+
+	/* counters */
+	unsigned long hits;	/* commands answered with another command's reply */
+	unsigned long merges;	/* commands whose reply was shared */
+};
+
+struct coalesce *
+coalesce_new(unsigned int size);
+
+int
+coalesce_join(struct coalesce *co, struct cmd *cmd, formatting_fun f_format);
+
+void
+coalesce_done(struct cmd *cmd);
+
+#endif
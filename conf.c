@@ -16,6 +16,18 @@
 static struct acl *
 conf_parse_acls(json_t *jtab);
 
+static void
+conf_parse_cache_prefixes(struct conf *conf, json_t *jlist);
+
+static struct conf_server *
+conf_parse_servers(json_t *jlist, int *count);
+
+static pool_selection_t
+conf_parse_pool_selection(const char *s);
+
+static etag_mode_t
+conf_parse_etag_mode(const char *s);
+
 struct conf *
 conf_read(const char *filename) {
 
@@ -40,6 +52,20 @@ conf_read(const char *filename) {
 	conf->pidfile = "webdis.pid";
 	conf->database = 0;
 	conf->pool_size_per_thread = 2;
+	conf->pool_queue_size = 1024;
+	conf->blocking_pool_size = 4;
+	conf->reconnect_min_ms = 100;
+	conf->reconnect_max_ms = 5000;
+	conf->breaker_failures = 3;
+	conf->ready_ratio = 1.0;
+	conf->ready_timeout_ms = 5000;
+	conf->script_cache = 1;
+	conf->pubsub_hub = 1;
+	conf->sse_heartbeat_ms = 15000;
+	conf->stream_count = 100;
+	conf->stream_block_ms = 10000;
+	conf->replica_max_lag = 30; /* well above repl-ping-replica-period */
+	conf->replica_max_lag_bytes = 1048576;
 
 	j = json_load_file(filename, 0, &error);
 	if(!j) {
@@ -57,6 +83,18 @@ conf_read(const char *filename) {
 			conf->redis_port = (short)json_integer_value(jtmp);
 		} else if(strcmp(json_object_iter_key(kv), "redis_auth") == 0 && json_typeof(jtmp) == JSON_STRING) {
 			conf->redis_auth = strdup(json_string_value(jtmp));
+		} else if(strcmp(json_object_iter_key(kv), "cluster") == 0 && json_typeof(jtmp) == JSON_TRUE) {
+			conf->cluster = 1;
+		} else if(strcmp(json_object_iter_key(kv), "shards") == 0 && json_typeof(jtmp) == JSON_ARRAY) {
+			conf->shards = conf_parse_servers(jtmp, &conf->shard_count);
+		} else if(strcmp(json_object_iter_key(kv), "replicas") == 0 && json_typeof(jtmp) == JSON_ARRAY) {
+			conf->replicas = conf_parse_servers(jtmp, &conf->replica_count);
+		} else if(strcmp(json_object_iter_key(kv), "replica_routing") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->replica_round_robin = (strcasecmp(json_string_value(jtmp), "round-robin") == 0);
+		} else if(strcmp(json_object_iter_key(kv), "replica_max_lag") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->replica_max_lag = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "replica_max_lag_bytes") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->replica_max_lag_bytes = json_integer_value(jtmp);
 		} else if(strcmp(json_object_iter_key(kv), "http_host") == 0 && json_typeof(jtmp) == JSON_STRING) {
 			free(conf->http_host);
 			conf->http_host = strdup(json_string_value(jtmp));
@@ -95,6 +133,56 @@ conf_read(const char *filename) {
 			conf->database = json_integer_value(jtmp);
 		} else if(strcmp(json_object_iter_key(kv), "pool_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
 			conf->pool_size_per_thread = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "pool_selection") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->pool_selection = conf_parse_pool_selection(json_string_value(jtmp));
+		} else if(strcmp(json_object_iter_key(kv), "pool_max_pending") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->pool_max_pending = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "pool_queue_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->pool_queue_size = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "request_timeout_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->request_timeout_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "blocking_pool_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->blocking_pool_size = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "reconnect_min_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->reconnect_min_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "reconnect_max_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->reconnect_max_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "breaker_failures") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->breaker_failures = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "ready_ratio") == 0 && json_is_number(jtmp)) {
+			conf->ready_ratio = json_number_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "ready_timeout_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->ready_timeout_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "script_cache") == 0 && json_typeof(jtmp) == JSON_FALSE) {
+			conf->script_cache = 0;
+		} else if(strcmp(json_object_iter_key(kv), "coalesce_reads") == 0 && json_typeof(jtmp) == JSON_TRUE) {
+			conf->coalesce_reads = 1;
+		} else if(strcmp(json_object_iter_key(kv), "pubsub_hub") == 0 && json_typeof(jtmp) == JSON_FALSE) {
+			conf->pubsub_hub = 0;
+		} else if(strcmp(json_object_iter_key(kv), "sse_heartbeat_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->sse_heartbeat_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "stream_count") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->stream_count = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "stream_block_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->stream_block_ms = json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "cache_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->cache_size = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "splice_threshold") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->splice_threshold = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "chunked_threshold") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->chunked_threshold = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "max_reply_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->max_reply_size = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "etag") == 0 && json_typeof(jtmp) == JSON_FALSE) {
+			conf->etag_mode = ETAG_NEVER;
+		} else if(strcmp(json_object_iter_key(kv), "etag") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->etag_mode = conf_parse_etag_mode(json_string_value(jtmp));
+		} else if(strcmp(json_object_iter_key(kv), "etag_max_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->etag_max_size = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "cache_mode") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->cache_optin = (strcasecmp(json_string_value(jtmp), "optin") == 0);
+		} else if(strcmp(json_object_iter_key(kv), "cache_prefixes") == 0 && json_typeof(jtmp) == JSON_ARRAY) {
+			conf_parse_cache_prefixes(conf, jtmp);
 		} else if(strcmp(json_object_iter_key(kv), "default_root") == 0 && json_typeof(jtmp) == JSON_STRING) {
 			conf->default_root = strdup(json_string_value(jtmp));
 		}
@@ -221,6 +309,69 @@ conf_parse_acls(json_t *jtab) {
 	return head;
 }
 
+static void
+conf_parse_cache_prefixes(struct conf *conf, json_t *jlist) {
+
+	unsigned int i;
+
+	conf->cache_prefixes = calloc(json_array_size(jlist), sizeof(char*));
+	for(i = 0; i < json_array_size(jlist); ++i) {
+		json_t *jelem = json_array_get(jlist, i);
+		if(json_typeof(jelem) == JSON_STRING) {
+			conf->cache_prefixes[conf->cache_prefix_count++] = strdup(json_string_value(jelem));
+		}
+	}
+}
+
+/* list of {"host": ..., "port": ...} objects */
+static struct conf_server *
+conf_parse_servers(json_t *jlist, int *count) {
+
+	unsigned int i;
+	struct conf_server *servers = calloc(json_array_size(jlist), sizeof(struct conf_server));
+
+	*count = 0;
+	for(i = 0; i < json_array_size(jlist); ++i) {
+		json_t *jelem = json_array_get(jlist, i), *jhost, *jport;
+		struct conf_server *r = &servers[*count];
+
+		if(json_typeof(jelem) != JSON_OBJECT) {
+			continue;
+		}
+		jhost = json_object_get(jelem, "host");
+		jport = json_object_get(jelem, "port");
+
+		r->host = strdup(jhost && json_typeof(jhost) == JSON_STRING ?
+				json_string_value(jhost) : "127.0.0.1");
+		r->port = jport && json_typeof(jport) == JSON_INTEGER ?
+				(short)json_integer_value(jport) : 6379;
+		(*count)++;
+	}
+	return servers;
+}
+
+static pool_selection_t
+conf_parse_pool_selection(const char *s) {
+
+	if(strcasecmp(s, "power-of-two") == 0) {
+		return POOL_TWO_CHOICES;
+	} else if(strcasecmp(s, "round-robin") == 0) {
+		return POOL_ROUND_ROBIN;
+	}
+	return POOL_LEAST_PENDING;
+}
+
+static etag_mode_t
+conf_parse_etag_mode(const char *s) {
+
+	if(strcasecmp(s, "if-none-match") == 0) {
+		return ETAG_IF_NONE_MATCH;
+	} else if(strcasecmp(s, "never") == 0) {
+		return ETAG_NEVER;
+	}
+	return ETAG_ALWAYS;
+}
+
 void
 conf_free(struct conf *conf) {
 
@@ -4,6 +4,21 @@
 #include <sys/types.h>
 #include "slog.h"
 
+typedef enum {
+	POOL_LEAST_PENDING = 0,
+	POOL_TWO_CHOICES,
+	POOL_ROUND_ROBIN} pool_selection_t;
+
+typedef enum {
+	ETAG_ALWAYS = 0,
+	ETAG_IF_NONE_MATCH,
+	ETAG_NEVER} etag_mode_t;
+
+struct conf_server {
+	char *host;
+	short port;
+};
+
 struct conf {
 
 	/* connection to Redis */
@@ -11,6 +26,20 @@ struct conf {
 	short redis_port;
 	char *redis_auth;
 
+	/* replicas serving read-only commands, none by default */
+	struct conf_server *replicas;
+	int replica_count;
+	int replica_round_robin; /* instead of least outstanding */
+	int replica_max_lag; /* in seconds */
+	long long replica_max_lag_bytes; /* behind the primary, 0 for no limit */
+
+	/* Redis Cluster, using redis_host and redis_port to find the nodes */
+	int cluster;
+
+	/* independent servers, keys are spread across them */
+	struct conf_server *shards;
+	int shard_count;
+
 	/* HTTP server interface */
 	char *http_host;
 	short http_port;
@@ -19,6 +48,20 @@ struct conf {
 
 	/* pool size, one pool per worker thread */
 	int pool_size_per_thread;
+	pool_selection_t pool_selection; /* how a connection is picked */
+	int pool_max_pending; /* commands in flight per connection, 0 for no limit */
+	int pool_queue_size; /* commands waiting when all the connections are full */
+	int blocking_pool_size; /* connections for BLPOP & co, 0 to use the main pool */
+	int request_timeout_ms; /* 504 past this delay, 0 to wait forever */
+
+	/* reconnection backoff, and failed attempts before failing fast */
+	int reconnect_min_ms;
+	int reconnect_max_ms;
+	int breaker_failures;
+
+	/* share of the pool connections needed before accepting clients */
+	double ready_ratio;
+	int ready_timeout_ms; /* start anyway after this delay */
 
 	/* daemonize process, off by default */
 	int daemonize;
@@ -30,6 +73,41 @@ struct conf {
 	/* database number */
 	int database;
 
+	/* send EVAL scripts as EVALSHA when possible, on by default */
+	int script_cache;
+
+	/* share replies between identical read commands, off by default */
+	int coalesce_reads;
+
+	/* one Redis subscription per channel and worker, on by default */
+	int pubsub_hub;
+
+	/* comment sent on idle Server-Sent Events streams, 0 to disable */
+	int sse_heartbeat_ms;
+
+	/* /_stream: entries per read, and how long each read blocks */
+	int stream_count;
+	int stream_block_ms;
+
+	/* local cache of read replies in bytes, 0 (default) disables it */
+	size_t cache_size;
+	int cache_optin; /* OPTIN tracking instead of BCAST */
+	char **cache_prefixes; /* BCAST prefixes, all keys if empty */
+	int cache_prefix_count;
+
+	/* when replies get an ETag, and up to what size (bytes, 0 for any) */
+	etag_mode_t etag_mode;
+	size_t etag_max_size;
+
+	/* GETs of values this large (bytes) are spliced, 0 (default) disables it */
+	size_t splice_threshold;
+
+	/* arrays this large (elements) are sent chunked as they are read, 0 (default) disables it */
+	size_t chunked_threshold;
+
+	/* replies larger than this (bytes) are dropped, 0 (default) for no limit */
+	size_t max_reply_size;
+
 	/* ACL */
 	struct acl *perms;
 
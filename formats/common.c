@@ -3,43 +3,103 @@
 #include "http.h"
 #include "client.h"
 #include "websocket.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "worker.h"
+#include "hub.h"
+#include "server.h"
+#include "conf.h"
 
-#include "md5/md5.h"
+#include "xxhash/xxh64.h"
 #include <string.h>
 #include <unistd.h>
 
-/* TODO: replace this with a faster hash function? */
-char *etag_new(const char *p, size_t sz) {
+#define ETAG_SIZE (1 + 16 + 1 + 1) /* quoted 64-bit hex, and a NUL */
 
-	md5_byte_t buf[16];
-	char *etag = calloc(34 + 1, 1);
+static const char etag_hex[] = "0123456789abcdef";
+
+/* quoted XXH64 of the body, in hex */
+static void
+etag_write(char *etag, const char *p, size_t sz) {
+
+	uint64_t h = xxh64(p, sz, 0);
 	int i;
 
-	if(!etag)
-		return NULL;
+	etag[0] = '"';
+	for(i = 16; i > 0; --i) {
+		etag[i] = etag_hex[h & 0xF];
+		h >>= 4;
+	}
+	etag[17] = '"';
+	etag[18] = 0;
+}
 
-	md5_state_t pms;
+/* whether hashing this reply can be of any use */
+static int
+etag_wanted(struct cmd *cmd, size_t sz) {
 
-	md5_init(&pms);
-	md5_append(&pms, (const md5_byte_t *)p, (int)sz);
-	md5_finish(&pms, buf);
+	struct conf *cfg = cmd->w->s->cfg;
+	struct cmd *waiter;
 
-	for(i = 0; i < 16; ++i) {
-		sprintf(etag + 1 + 2*i, "%.2x", (unsigned char)buf[i]);
+	if(cfg->etag_mode == ETAG_NEVER
+			|| (cfg->etag_max_size && sz > cfg->etag_max_size)) {
+		return 0;
+	}
+	if(cfg->etag_mode == ETAG_ALWAYS || cmd->if_none_match || cmd->cache_key) {
+		return 1; /* the cached copy may be revalidated later */
 	}
+	for(waiter = cmd->waiters; waiter; waiter = waiter->next_waiter) {
+		if(waiter->if_none_match) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	etag[0] = '"';
-	etag[33] = '"';
+void
+format_buf_init(struct format_buf *b, size_t cap) {
 
-	return etag;
+	b->p = malloc(cap ? cap : 1);
+	b->sz = 0;
+	b->cap = cap ? cap : 1;
+}
+
+/* room for sz more bytes, written at the returned address */
+char *
+format_buf_reserve(struct format_buf *b, size_t sz) {
+
+	if(b->sz + sz > b->cap) {
+		b->cap *= 2;
+		if(b->cap < b->sz + sz) {
+			b->cap = b->sz + sz;
+		}
+		b->p = realloc(b->p, b->cap);
+	}
+	return b->p + b->sz;
 }
 
 void
-format_send_error(struct cmd *cmd, short code, const char *msg) {
+format_buf_append(struct format_buf *b, const char *p, size_t sz) {
+
+	memcpy(format_buf_reserve(b, sz), p, sz);
+	b->sz += sz;
+}
+
+static void
+format_send_error_one(struct cmd *cmd, short code, const char *msg) {
 
 	struct http_response *resp;
+	redisReply r;
 
-	if(!cmd->is_websocket && !cmd->pub_sub_client) {
+	if(cmd->is_websocket && !cmd->pub_sub_client && !cmd->abandoned && cmd->f_format) {
+		/* an error frame, in the format of the replies */
+		memset(&r, 0, sizeof(r));
+		r.type = REDIS_REPLY_ERROR;
+		r.str = (char*)msg;
+		r.len = strlen(msg);
+		cmd->f_format(NULL, &r, cmd);
+		return;
+	} else if(!cmd->is_websocket && !cmd->pub_sub_client && !cmd->abandoned) {
 		resp = http_response_init(cmd->w, code, msg);
 		resp->http_version = cmd->http_version;
 		http_response_set_keep_alive(resp, cmd->keep_alive);
@@ -54,6 +114,83 @@ format_send_error(struct cmd *cmd, short code, const char *msg) {
 	}
 }
 
+void
+format_send_error(struct cmd *cmd, short code, const char *msg) {
+
+	struct cmd *waiter, *next;
+
+	/* the same error for all the commands waiting for this reply */
+	coalesce_done(cmd);
+	for(waiter = cmd->waiters; waiter; waiter = next) {
+		next = waiter->next_waiter;
+		format_send_error_one(waiter, code, msg);
+	}
+	cmd->waiters = NULL;
+
+	format_send_error_one(cmd, code, msg);
+}
+
+static void
+format_send_etag_reply(struct cmd *cmd, const char *p, size_t sz,
+		const char *ct, const char *etag) {
+
+	struct http_response *resp;
+
+	if(cmd->abandoned) { /* already answered, or the client is gone */
+		return;
+	}
+
+	/* check If-None-Match */
+	if(etag && cmd->if_none_match && strcmp(cmd->if_none_match, etag) == 0) {
+		/* SAME! send 304. */
+		resp = http_response_init(cmd->w, 304, "Not Modified");
+	} else {
+		resp = http_response_init(cmd->w, 200, "OK");
+		if(cmd->filename) {
+			http_response_set_header(resp, "Content-Disposition", cmd->filename);
+		}
+		http_response_set_header(resp, "Content-Type", ct);
+		if(etag) {
+			http_response_set_header(resp, "ETag", etag);
+		}
+		http_response_set_body(resp, p, sz);
+	}
+	resp->http_version = cmd->http_version;
+	http_response_set_keep_alive(resp, cmd->keep_alive);
+	http_response_write(resp, cmd->fd);
+}
+
+/* send a reply formatted earlier */
+void
+format_send_cached(struct cmd *cmd, const char *p, size_t sz,
+		const char *ct, const char *etag) {
+
+	format_send_etag_reply(cmd, p, sz, ct, etag);
+	cmd_free(cmd);
+}
+
+/* queued on the client, in order with the previous frames */
+static void
+format_send_frame(struct cmd *cmd, struct http_frame *f) {
+
+	struct hub *h = cmd->w->hub;
+
+	if(!f) {
+		return;
+	}
+
+	/* the hub sends the same frame to the other subscribers with the same output */
+	if(h && h->capturing && !h->captured) {
+		f->refs++;
+		h->captured = f;
+	}
+
+	if(cmd->client) {
+		http_client_send(cmd->client, f);
+	}
+	http_frame_release(f);
+}
+
 void
 format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content_type) {
 
@@ -62,15 +199,19 @@ format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content
 	struct http_response *resp;
 
 	if(cmd->is_websocket) {
-		ws_reply(cmd, p, sz);
+		if(!cmd->abandoned) {
+			/* MessagePack isn't text */
+			format_send_frame(cmd, strcmp(content_type, "application/x-msgpack") == 0
+					? ws_binary_frame(p, sz) : ws_frame(p, sz));
+		}
 
 		/* If it's a subscribe command, there'll be more responses */
-		if(!cmd_is_subscribe(cmd))
+		if(!cmd_is_streaming(cmd))
 			cmd_free(cmd);
 		return;
 	}
 
-	if(cmd_is_subscribe(cmd)) {
+	if(cmd_is_streaming(cmd)) {
 		free_cmd = 0;
 
 		/* start streaming */
@@ -85,45 +226,104 @@ format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content
 			http_response_set_keep_alive(resp, 1);
 			http_response_set_header(resp, "Transfer-Encoding", "chunked");
 			http_response_set_body(resp, p, sz);
-			http_response_write(resp, cmd->fd);
+			if(cmd->client) {
+				http_response_send(resp, cmd->client);
+			} else {
+				http_response_write(resp, cmd->fd);
+			}
 		} else {
 			/* Asynchronous chunk write. */
-			http_response_write_chunk(cmd->fd, cmd->w, p, sz);
+			format_send_frame(cmd, http_frame_chunk(p, sz));
 		}
 
 	} else {
-		/* compute ETag */
-		char *etag = etag_new(p, sz);
+		struct cmd *waiter, *next;
+		char etag[ETAG_SIZE], *tag = NULL;
 
-		if(etag) {
-			/* check If-None-Match */
-			if(cmd->if_none_match && strcmp(cmd->if_none_match, etag) == 0) {
-				/* SAME! send 304. */
-				resp = http_response_init(cmd->w, 304, "Not Modified");
-			} else {
-				resp = http_response_init(cmd->w, 200, "OK");
-				if(cmd->filename) {
-					http_response_set_header(resp, "Content-Disposition", cmd->filename);
-				}
-				http_response_set_header(resp, "Content-Type", ct);
-				http_response_set_header(resp, "ETag", etag);
-				http_response_set_body(resp, p, sz);
-			}
-			resp->http_version = cmd->http_version;
-			http_response_set_keep_alive(resp, cmd->keep_alive);
-			http_response_write(resp, cmd->fd);
-			free(etag);
-		} else {
-			format_send_error(cmd, 503, "Service Unavailable");
+		if(etag_wanted(cmd, sz)) {
+			etag_write(etag, p, sz);
+			tag = etag;
+		}
+
+		/* same reply for all the commands waiting for it */
+		coalesce_done(cmd);
+		for(waiter = cmd->waiters; waiter; waiter = next) {
+			next = waiter->next_waiter;
+			format_send_etag_reply(waiter, p, sz, ct, tag);
+			cmd_free(waiter);
+		}
+		cmd->waiters = NULL;
+
+		format_send_etag_reply(cmd, p, sz, ct, tag);
+		if(cmd->cache_key) {
+			cache_store(cmd->w->cache, cmd, p, sz, ct, tag);
 		}
 	}
-	
+
 	/* cleanup */
 	if(free_cmd) {
 		cmd_free(cmd);
 	}
 }
 
+static void
+format_on_heartbeat(int fd, short event, void *ptr) {
+
+	struct cmd *cmd = ptr;
+	char *beat = malloc(3);
+
+	(void)fd;
+	(void)event;
+
+	/* a comment, ignored by the browser but not by idle timeouts */
+	memcpy(beat, ":\n\n", 3);
+	format_send_frame(cmd, http_frame_new(beat, 3));
+}
+
+/**
+ * Server-Sent Events: the response starts with the first event, and stays
+ * open for the next ones.
+ */
+void
+format_send_event(struct cmd *cmd, const char *p, size_t sz) {
+
+	struct http_response *resp;
+	struct conf *cfg = cmd->w->s->cfg;
+	struct timeval tv;
+	char *out;
+
+	if(cmd->started_responding) {
+		out = malloc(sz);
+		memcpy(out, p, sz);
+		format_send_frame(cmd, http_frame_new(out, sz));
+		return;
+	}
+	cmd->started_responding = 1;
+
+	resp = http_response_init(cmd->w, 200, "OK");
+	resp->http_version = cmd->http_version;
+	resp->stream = 1;
+	http_response_set_header(resp, "Content-Type", "text/event-stream");
+	http_response_set_header(resp, "Cache-Control", "no-cache");
+	http_response_set_header(resp, "X-Accel-Buffering", "no"); /* nginx */
+	http_response_set_keep_alive(resp, 1);
+	http_response_set_body(resp, p, sz);
+	if(cmd->client) {
+		http_response_send(resp, cmd->client);
+	} else {
+		http_response_write(resp, cmd->fd);
+	}
+
+	if(cfg->sse_heartbeat_ms > 0) {
+		tv.tv_sec = cfg->sse_heartbeat_ms / 1000;
+		tv.tv_usec = (cfg->sse_heartbeat_ms % 1000) * 1000;
+		event_set(&cmd->ev_heartbeat, -1, EV_PERSIST, format_on_heartbeat, cmd);
+		event_base_set(cmd->w->base, &cmd->ev_heartbeat);
+		evtimer_add(&cmd->ev_heartbeat, &tv);
+		cmd->heartbeat_set = 1;
+	}
+}
+
 int
 integer_length(long long int i) {
 	int sz = 0;
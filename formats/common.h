@@ -5,11 +5,34 @@
 
 struct cmd;
 
+/* output buffer, presized and grown geometrically */
+struct format_buf {
+	char *p;
+	size_t sz;
+	size_t cap;
+};
+
+void
+format_buf_init(struct format_buf *b, size_t cap);
+
+void
+format_buf_append(struct format_buf *b, const char *p, size_t sz);
+
+char *
+format_buf_reserve(struct format_buf *b, size_t sz);
+
 void
 format_send_reply(struct cmd *cmd,
 		const char *p, size_t sz,
 		const char *content_type);
 
+void
+format_send_cached(struct cmd *cmd, const char *p, size_t sz,
+		const char *ct, const char *etag);
+
+void
+format_send_event(struct cmd *cmd, const char *p, size_t sz);
+
 void
 format_send_error(struct cmd *cmd, short code, const char *msg);
 int
@@ -19,7 +19,6 @@ custom_type_reply(redisAsyncContext *c, void *r, void *privdata) {
 	char int_buffer[50];
 	char *status_buf;
 	int int_len;
-	struct http_response *resp;
 	size_t sz;
 	char *array_out;
 
@@ -62,14 +61,7 @@ custom_type_reply(redisAsyncContext *c, void *r, void *privdata) {
 	}
 
 	/* couldn't make sense of what the client wanted. */
-	resp = http_response_init(cmd->w, 400, "Bad Request");
-	http_response_set_header(resp, "Content-Length", "0");
-	http_response_set_keep_alive(resp, cmd->keep_alive);
-	http_response_write(resp, cmd->fd);
-
-	if(!cmd_is_subscribe(cmd)) {
-		cmd_free(cmd);
-	}
+	format_send_error(cmd, 400, "Bad Request");
 }
 
 static char *
@@ -0,0 +1,225 @@
+#include "escape.h"
+
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * JSON string escaping. Most of a large value usually needs no escaping:
+ * the vectorized scan looks for the next quote, backslash, control
+ * character or non-ASCII byte 32 (AVX2) or 16 (SSE2) bytes at a time, and
+ * the clean run before it is copied as is. Non-ASCII bytes are checked to
+ * be valid UTF-8 where the scan stops.
+ */
+
+static const char escape_hex[] = "0123456789abcdef";
+
+/* escape sequences for ASCII: 0 for none, 'u' for \u00XX */
+static const char escape_ascii[128] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	['"'] = '"', ['\\'] = '\\'
+};
+
+/* length of the UTF-8 sequence at p, 0 if it isn't valid */
+static size_t
+escape_utf8_len(const unsigned char *p, const unsigned char *end) {
+
+	unsigned int cp;
+	size_t n, i;
+
+	if(p[0] >= 0xC2 && p[0] <= 0xDF) {
+		n = 2; cp = p[0] & 0x1F;
+	} else if(p[0] >= 0xE0 && p[0] <= 0xEF) {
+		n = 3; cp = p[0] & 0x0F;
+	} else if(p[0] >= 0xF0 && p[0] <= 0xF4) {
+		n = 4; cp = p[0] & 0x07;
+	} else {
+		return 0;
+	}
+	if((size_t)(end - p) < n) {
+		return 0;
+	}
+	for(i = 1; i < n; ++i) {
+		if((p[i] & 0xC0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (p[i] & 0x3F);
+	}
+	/* overlong, surrogate, or out of range */
+	if((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000)
+			|| (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+		return 0;
+	}
+	return n;
+}
+
+static size_t
+escape_ascii_size(unsigned char c) {
+
+	return escape_ascii[c] == 0 ? 1 : (escape_ascii[c] == 'u' ? 6 : 2);
+}
+
+static char *
+escape_ascii_write(char *out, unsigned char c) {
+
+	*out++ = '\\';
+	if(escape_ascii[c] == 'u') {
+		memcpy(out, "u00", 3);
+		out[3] = escape_hex[c >> 4];
+		out[4] = escape_hex[c & 0xF];
+		return out + 5;
+	}
+	*out++ = escape_ascii[c];
+	return out;
+}
+
+/* first byte from p that can't be copied as is */
+static const unsigned char *
+escape_scan(const unsigned char *p, const unsigned char *end) {
+
+#if defined(__AVX2__)
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i space = _mm256_set1_epi8(0x20);
+
+	while(end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		/* signed: below 0x20 is a control character or a non-ASCII byte */
+		__m256i m = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+		if(mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(0x20);
+
+	while(end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i m = _mm_or_si128(_mm_cmplt_epi8(v, space),
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+		if(mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif
+	while(p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+		p++;
+	}
+	return p;
+}
+
+size_t
+escape_json_size(const char *s, size_t len) {
+
+	const unsigned char *p = (const unsigned char *)s, *end = p + len, *q;
+	size_t sz = 2, n;
+
+	while(p < end) {
+		q = escape_scan(p, end);
+		sz += q - p;
+		if((p = q) == end) {
+			break;
+		}
+		if(*p < 0x80) {
+			sz += escape_ascii_size(*p);
+			p++;
+		} else if((n = escape_utf8_len(p, end))) {
+			sz += n;
+			p += n;
+		} else {
+			return 0;
+		}
+	}
+	return sz;
+}
+
+char *
+escape_json_write(char *out, const char *s, size_t len) {
+
+	const unsigned char *p = (const unsigned char *)s, *end = p + len, *q;
+	char *start = out;
+	size_t n;
+
+	*out++ = '"';
+	while(p < end) {
+		q = escape_scan(p, end);
+		memcpy(out, p, q - p);
+		out += q - p;
+		if((p = q) == end) {
+			break;
+		}
+		if(*p < 0x80) {
+			out = escape_ascii_write(out, *p);
+			p++;
+		} else if((n = escape_utf8_len(p, end))) {
+			memcpy(out, p, n);
+			out += n;
+			p += n;
+		} else {
+			memcpy(start, "null", 4);
+			return start + 4;
+		}
+	}
+	*out++ = '"';
+
+	return out;
+}
+
+size_t
+escape_json_size_scalar(const char *s, size_t len) {
+
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	size_t sz = 2, n;
+
+	while(p < end) {
+		if(*p < 0x80) {
+			sz += escape_ascii_size(*p);
+			p++;
+		} else if((n = escape_utf8_len(p, end))) {
+			sz += n;
+			p += n;
+		} else {
+			return 0;
+		}
+	}
+	return sz;
+}
+
+char *
+escape_json_write_scalar(char *out, const char *s, size_t len) {
+
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	char *start = out;
+	size_t n;
+
+	*out++ = '"';
+	while(p < end) {
+		if(*p < 0x80 && escape_ascii[*p]) {
+			out = escape_ascii_write(out, *p);
+			p++;
+		} else if(*p < 0x80) {
+			*out++ = *p++;
+		} else if((n = escape_utf8_len(p, end))) {
+			memcpy(out, p, n);
+			out += n;
+			p += n;
+		} else {
+			memcpy(start, "null", 4);
+			return start + 4;
+		}
+	}
+	*out++ = '"';
+
+	return out;
+}
@@ -0,0 +1,21 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stdlib.h>
+
+/* size of s as a quoted JSON string, 0 if it isn't valid UTF-8 */
+size_t
+escape_json_size(const char *s, size_t len);
+
+/* writes s as a quoted JSON string (or null), returns the end of the output */
+char *
+escape_json_write(char *out, const char *s, size_t len);
+
+/* byte by byte, for reference */
+size_t
+escape_json_size_scalar(const char *s, size_t len);
+
+char *
+escape_json_write_scalar(char *out, const char *s, size_t len);
+
+#endif
@@ -3,21 +3,22 @@
 #include "cmd.h"
 #include "http.h"
 #include "client.h"
+#include "escape.h"
 
 #include <string.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
-static json_t *
-json_wrap_redis_reply(const struct cmd *cmd, const redisReply *r);
+static char *
+json_wrap_output(const struct cmd *cmd, const redisReply *r, const char *jsonp, size_t *sz);
 
 void
 json_reply(redisAsyncContext *c, void *r, void *privdata) {
 
 	redisReply *reply = r;
 	struct cmd *cmd = privdata;
-	json_t *j;
 	char *jstr;
+	size_t sz;
 	(void)c;
 
 	if(cmd == NULL) {
@@ -30,17 +31,13 @@ json_reply(redisAsyncContext *c, void *r, void *privdata) {
 		return;
 	}
 
-	/* encode redis reply as JSON */
-	j = json_wrap_redis_reply(cmd, r);
-
-	/* get JSON as string, possibly with JSONP wrapper */
-	jstr = json_string_output(j, cmd->jsonp);
+	/* encode redis reply as JSON, possibly with JSONP wrapper */
+	jstr = json_wrap_output(cmd, reply, cmd->jsonp, &sz);
 
 	/* send reply */
-	format_send_reply(cmd, jstr, strlen(jstr), "application/json");
+	format_send_reply(cmd, jstr, sz, "application/json");
 
 	/* cleanup */
-	json_decref(j);
 	free(jstr);
 }
 
@@ -88,153 +85,256 @@ json_info_reply(const char *s) {
 	return jroot;
 }
 
-static json_t *
-json_hgetall_reply(const redisReply *r) {
-	/* zip keys and values together in a json object */
-	json_t *jroot;
-	unsigned int i;
+/**
+ * The JSON output is written straight from the reply, in two passes: the
+ * first one computes its exact size, the second one fills a single buffer.
+ * Strings that aren't valid UTF-8 are sent as null, see escape.c.
+ */
 
-	if(r->elements % 2 != 0) {
-		return NULL;
+static size_t
+json_value_size(const redisReply *r) {
+
+	char buf[24];
+	size_t sz, i;
+
+	switch(r->type) {
+		case REDIS_REPLY_STRING:
+			return (sz = escape_json_size(r->str, r->len)) ? sz : 4;
+
+		case REDIS_REPLY_INTEGER:
+			return sprintf(buf, "%lld", r->integer);
+
+		case REDIS_REPLY_ARRAY: /* nested arrays, e.g. XREAD entries */
+			sz = 2 + (r->elements ? r->elements - 1 : 0);
+			for(i = 0; i < r->elements; ++i) {
+				sz += json_value_size(r->element[i]);
+			}
+			return sz;
+
+		default:
+			return 4;
 	}
+}
+
+static char *
+json_write_value(char *out, const redisReply *r) {
+
+	size_t i;
+
+	switch(r->type) {
+		case REDIS_REPLY_STRING:
+			return escape_json_write(out, r->str, r->len);
+
+		case REDIS_REPLY_INTEGER:
+			return out + sprintf(out, "%lld", r->integer);
 
-	jroot = json_object();
-	for(i = 0; i < r->elements; i += 2) {
-		redisReply *k = r->element[i], *v = r->element[i+1];
+		case REDIS_REPLY_ARRAY:
+			*out++ = '[';
+			for(i = 0; i < r->elements; ++i) {
+				if(i) *out++ = ',';
+				out = json_write_value(out, r->element[i]);
+			}
+			*out++ = ']';
+			return out;
+
+		default:
+			memcpy(out, "null", 4);
+			return out + 4;
+	}
+}
+
+/* HGETALL as an object, if all the fields and values are strings */
+static int
+json_hgetall_reply(const redisReply *r) {
 
-		/* keys and values need to be strings */
-		if(k->type != REDIS_REPLY_STRING || v->type != REDIS_REPLY_STRING) {
-			json_decref(jroot);
-			return NULL;
+	size_t i;
+
+	if(r->elements % 2 != 0) {
+		return 0;
+	}
+	for(i = 0; i < r->elements; ++i) {
+		const redisReply *e = r->element[i];
+		if(e->type != REDIS_REPLY_STRING
+				|| (i % 2 == 0 && !escape_json_size(e->str, e->len))) {
+			return 0;
 		}
-		json_object_set_new(jroot, k->str, json_string(v->str));
 	}
-	return jroot;
+	return 1;
 }
 
-static json_t *
-json_wrap_redis_reply(const struct cmd *cmd, const redisReply *r) {
+static size_t
+json_hgetall_size(const redisReply *r) {
 
-	unsigned int i;
-	json_t *jlist, *jroot = json_object(); /* that's what we return */
+	size_t sz = 2, i;
 
+	for(i = 0; i < r->elements; ++i) {
+		sz += json_value_size(r->element[i]) + 1; /* ':' or ',' */
+	}
+	return r->elements ? sz - 1 : sz;
+}
 
-	/* copy verb, as jansson only takes a char* but not its length. */
-	char *verb;
-	if(cmd->count) {
-		verb = calloc(cmd->argv_len[0]+1, 1);
-		memcpy(verb, cmd->argv[0], cmd->argv_len[0]);
-	} else {
-		verb = strdup("");
+static char *
+json_write_hgetall(char *out, const redisReply *r) {
+
+	size_t i;
+
+	*out++ = '{';
+	for(i = 0; i < r->elements; ++i) {
+		if(i) *out++ = (i % 2) ? ':' : ',';
+		out = json_write_value(out, r->element[i]);
 	}
+	*out++ = '}';
 
+	return out;
+}
+
+/* {"VERB": reply}, possibly with JSONP wrapper */
+static char *
+json_wrap_output(const struct cmd *cmd, const redisReply *r, const char *jsonp, size_t *sz) {
+
+	const char *verb = cmd->count ? cmd->argv[0] : "";
+	size_t verb_len = cmd->count ? cmd->argv_len[0] : 0;
+	size_t jsonp_len = jsonp ? strlen(jsonp) : 0;
+	size_t verb_sz, body_sz, status_sz = 0;
+	char *info = NULL, *out, *p;
+	int object = 0;
+
+	/* the key needs to be a string */
+	if(!(verb_sz = escape_json_size(verb, verb_len))) {
+		verb = "";
+		verb_len = 0;
+		verb_sz = 2;
+	}
 
 	switch(r->type) {
 		case REDIS_REPLY_STATUS:
-		case REDIS_REPLY_ERROR:
-			jlist = json_array();
-			json_array_append_new(jlist,
-				r->type == REDIS_REPLY_ERROR ? json_false() : json_true());
-			json_array_append_new(jlist, json_string(r->str));
-			json_object_set_new(jroot, verb, jlist);
+		case REDIS_REPLY_ERROR: /* [true, "OK"] or [false, "ERR …"] */
+			status_sz = escape_json_size(r->str, r->len);
+			body_sz = (r->type == REDIS_REPLY_ERROR ? 5 : 4) + 3 + (status_sz ? status_sz : 4);
 			break;
 
 		case REDIS_REPLY_STRING:
-			if(strcasecmp(verb, "INFO") == 0) {
-				json_object_set_new(jroot, verb, json_info_reply(r->str));
-			} else {
-				json_object_set_new(jroot, verb, json_string(r->str));
+			if(verb_len == 4 && strncasecmp(verb, "INFO", 4) == 0) {
+				json_t *j = json_info_reply(r->str);
+				info = json_dumps(j, JSON_COMPACT);
+				json_decref(j);
+				body_sz = strlen(info);
+				break;
 			}
-			break;
-
-		case REDIS_REPLY_INTEGER:
-			json_object_set_new(jroot, verb, json_integer(r->integer));
+			body_sz = json_value_size(r);
 			break;
 
 		case REDIS_REPLY_ARRAY:
-			if(strcasecmp(verb, "HGETALL") == 0) {
-				json_t *jobj = json_hgetall_reply(r);
-				if(jobj) {
-					json_object_set_new(jroot, verb, jobj);
-					break;
-				}
-			}
-			jlist = json_array();
-			for(i = 0; i < r->elements; ++i) {
-				redisReply *e = r->element[i];
-				switch(e->type) {
-					case REDIS_REPLY_STRING:
-						json_array_append_new(jlist, json_string(e->str));
-						break;
-					case REDIS_REPLY_INTEGER:
-						json_array_append_new(jlist, json_integer(e->integer));
-						break;
-					default:
-						json_array_append_new(jlist, json_null());
-						break;
-				}
+			if(verb_len == 7 && strncasecmp(verb, "HGETALL", 7) == 0
+					&& json_hgetall_reply(r)) {
+				object = 1;
+				body_sz = json_hgetall_size(r);
+				break;
 			}
-			json_object_set_new(jroot, verb, jlist);
+			body_sz = json_value_size(r);
 			break;
 
 		default:
-			json_object_set_new(jroot, verb, json_null());
+			body_sz = json_value_size(r);
 			break;
 	}
 
-	free(verb);
-	return jroot;
-}
+	*sz = 1 + verb_sz + 1 + body_sz + 1;
+	if(jsonp_len) { /* "fun(" ... ");\n" */
+		*sz += jsonp_len + 1 + 3;
+	}
 
+	p = out = malloc(*sz + 1);
+	if(jsonp_len) {
+		memcpy(p, jsonp, jsonp_len);
+		p += jsonp_len;
+		*p++ = '(';
+	}
+	*p++ = '{';
+	p = escape_json_write(p, verb, verb_len);
+	*p++ = ':';
+
+	if(info) {
+		memcpy(p, info, body_sz);
+		p += body_sz;
+		free(info);
+	} else if(object) {
+		p = json_write_hgetall(p, r);
+	} else if(r->type == REDIS_REPLY_STATUS || r->type == REDIS_REPLY_ERROR) {
+		p += sprintf(p, "[%s,", r->type == REDIS_REPLY_ERROR ? "false" : "true");
+		p = escape_json_write(p, r->str, r->len);
+		*p++ = ']';
+	} else {
+		p = json_write_value(p, r);
+	}
 
-char *
-json_string_output(json_t *j, const char *jsonp) {
+	*p++ = '}';
+	if(jsonp_len) {
+		memcpy(p, ");\n", 3);
+		p += 3;
+	}
+	*p = 0;
 
-	char *json_reply = json_dumps(j, JSON_COMPACT);
+	return out;
+}
 
-	/* check for JSONP */
-	if(jsonp) {
-		size_t jsonp_len = strlen(jsonp);
-		size_t json_len = strlen(json_reply);
-		size_t ret_len = jsonp_len + 1 + json_len + 3;
-		char *ret = calloc(1 + ret_len, 1);
+/**
+ * A large array sent as it is read, see chunked.c: {"VERB":[ first, then
+ * each element, and the closing ]} once they are all out.
+ */
+void
+json_chunked_head(const struct cmd *cmd, size_t count, struct format_buf *b) {
 
-		memcpy(ret, jsonp, jsonp_len);
-		ret[jsonp_len]='(';
-		memcpy(ret + jsonp_len + 1, json_reply, json_len);
-		memcpy(ret + jsonp_len + 1 + json_len, ");\n", 3);
-		free(json_reply);
+	const char *verb = cmd->count ? cmd->argv[0] : "";
+	size_t verb_len = cmd->count ? cmd->argv_len[0] : 0;
+	size_t verb_sz = escape_json_size(verb, verb_len);
+	char *p;
+	(void)count;
 
-		return ret;
+	if(!verb_sz) { /* the key needs to be a string */
+		verb_len = 0;
+		verb_sz = 2;
+	}
+	if(cmd->jsonp) {
+		format_buf_append(b, cmd->jsonp, strlen(cmd->jsonp));
+		format_buf_append(b, "(", 1);
 	}
+	p = format_buf_reserve(b, 1 + verb_sz + 2);
+	*p++ = '{';
+	p = escape_json_write(p, verb, verb_len);
+	*p++ = ':';
+	*p++ = '[';
+	b->sz = p - b->p;
+}
+
+void
+json_chunked_item(const redisReply *r, size_t idx, struct format_buf *b) {
+
+	char *p = format_buf_reserve(b, 1 + json_value_size(r));
 
-	return json_reply;
+	if(idx) *p++ = ',';
+	p = json_write_value(p, r);
+	b->sz = p - b->p;
 }
 
-/* extract JSON from WebSocket frame and fill struct cmd. */
-struct cmd *
-json_ws_extract(struct http_client *c, const char *p, size_t sz) {
+void
+json_chunked_tail(const struct cmd *cmd, struct format_buf *b) {
 
-	struct cmd *cmd = NULL;
-	json_t *j;
-	char *jsonz; /* null-terminated */
+	format_buf_append(b, "]}", 2);
+	if(cmd->jsonp) {
+		format_buf_append(b, ");\n", 3);
+	}
+}
 
+/* fill a struct cmd from a JSON array of strings and integers. */
+static struct cmd *
+json_array_to_cmd(json_t *j) {
+
+	struct cmd *cmd = NULL;
 	unsigned int i, cur;
 	int argc = 0;
-	json_error_t jerror;
-
-	(void)c;
 
-	jsonz = calloc(sz + 1, 1);
-	memcpy(jsonz, p, sz);
-	j = json_loads(jsonz, sz, &jerror);
-	free(jsonz);
-
-	if(!j) {
-		return NULL;
-	}
 	if(json_typeof(j) != JSON_ARRAY) {
-		json_decref(j);
 		return NULL; /* invalid JSON */
 	}
 
@@ -254,7 +354,6 @@ json_ws_extract(struct http_client *c, const char *p, size_t sz) {
 	}
 
 	if(!argc) { /* not a single item could be decoded */
-		json_decref(j);
 		return NULL;
 	}
 
@@ -287,7 +386,111 @@ json_ws_extract(struct http_client *c, const char *p, size_t sz) {
 		}
 	}
 
+	return cmd;
+}
+
+static json_t *
+json_load_buffer(const char *p, size_t sz) {
+
+	json_t *j;
+	json_error_t jerror;
+	char *jsonz = calloc(sz + 1, 1); /* null-terminated */
+
+	memcpy(jsonz, p, sz);
+	j = json_loads(jsonz, sz, &jerror);
+	free(jsonz);
+
+	return j;
+}
+
+/* extract JSON from WebSocket frame and fill struct cmd. */
+struct cmd *
+json_ws_extract(struct http_client *c, const char *p, size_t sz) {
+
+	struct cmd *cmd;
+	json_t *j;
+
+	(void)c;
+
+	if(!(j = json_load_buffer(p, sz))) {
+		return NULL;
+	}
+
+	cmd = json_array_to_cmd(j);
 	json_decref(j);
 	return cmd;
 }
 
+/**
+ * Extract a list of commands from a JSON array of arrays.
+ * Entries that can't be decoded are left as NULL in the output array.
+ */
+int
+json_batch_extract(const char *p, size_t sz, struct cmd ***cmds) {
+
+	json_t *j;
+	unsigned int i;
+	int count;
+
+	if(!(j = json_load_buffer(p, sz))) {
+		return -1;
+	}
+	if(json_typeof(j) != JSON_ARRAY || json_array_size(j) == 0) {
+		json_decref(j);
+		return -1;
+	}
+
+	count = (int)json_array_size(j);
+	*cmds = calloc(count, sizeof(struct cmd *));
+	for(i = 0; i < (unsigned int)count; ++i) {
+		(*cmds)[i] = json_array_to_cmd(json_array_get(j, i));
+	}
+
+	json_decref(j);
+	return count;
+}
+
+/* encode a single reply, without JSONP wrapper. */
+char *
+json_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz) {
+
+	return json_wrap_output(cmd, r, NULL, sz);
+}
+
+/* concatenate encoded replies into a JSON list, possibly with JSONP wrapper. */
+char *
+json_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz) {
+
+	int i;
+	char *out, *p;
+	size_t jsonp_len = cmd->jsonp ? strlen(cmd->jsonp) : 0;
+
+	/* compute size: "[" + items separated by "," + "]" */
+	*sz = 2 + (count ? count - 1 : 0);
+	for(i = 0; i < count; ++i) {
+		*sz += items_sz[i];
+	}
+	if(jsonp_len) { /* "fun(" ... ");\n" */
+		*sz += jsonp_len + 1 + 3;
+	}
+
+	p = out = malloc(*sz);
+	if(jsonp_len) {
+		memcpy(p, cmd->jsonp, jsonp_len);
+		p += jsonp_len;
+		*p++ = '(';
+	}
+	*p++ = '[';
+	for(i = 0; i < count; ++i) {
+		if(i) *p++ = ',';
+		memcpy(p, items[i], items_sz[i]);
+		p += items_sz[i];
+	}
+	*p++ = ']';
+	if(jsonp_len) {
+		memcpy(p, ");\n", 3);
+	}
+
+	return out;
+}
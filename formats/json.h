@@ -7,14 +7,31 @@
 
 struct cmd;
 struct http_client;
+struct format_buf;
 
 void
 json_reply(redisAsyncContext *c, void *r, void *privdata);
 
-char *
-json_string_output(json_t *j, const char *jsonp);
-
 struct cmd *
 json_ws_extract(struct http_client *c, const char *p, size_t sz);
 
+int
+json_batch_extract(const char *p, size_t sz, struct cmd ***cmds);
+
+char *
+json_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz);
+
+char *
+json_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz);
+
+void
+json_chunked_head(const struct cmd *cmd, size_t count, struct format_buf *b);
+
+void
+json_chunked_item(const redisReply *r, size_t idx, struct format_buf *b);
+
+void
+json_chunked_tail(const struct cmd *cmd, struct format_buf *b);
+
 #endif
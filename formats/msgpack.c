@@ -8,20 +8,15 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
-struct msg_out {
-	char *p;
-	size_t sz;
-};
-
 static void
-msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *, const redisReply *r);
+msgpack_wrap_redis_reply(const struct cmd *cmd, struct format_buf *out, const redisReply *r);
 
 void
 msgpack_reply(redisAsyncContext *c, void *r, void *privdata) {
 
 	redisReply *reply = r;
 	struct cmd *cmd = privdata;
-	struct msg_out out;
+	struct format_buf out;
 	(void)c;
 
 	if(cmd == NULL) {
@@ -34,10 +29,6 @@ msgpack_reply(redisAsyncContext *c, void *r, void *privdata) {
 		return;
 	}
 
-	/* prepare data structure for output */
-	out.p = NULL;
-	out.sz = 0;
-
 	/* encode redis reply */
 	msgpack_wrap_redis_reply(cmd, &out, r);
 
@@ -51,74 +42,88 @@ msgpack_reply(redisAsyncContext *c, void *r, void *privdata) {
 static int
 on_msgpack_write(void *data, const char *s, unsigned int sz) {
 
-	struct msg_out *out = data;
+	format_buf_append(data, s, sz);
+	return sz;
+}
+
+/* upper bound of the packed size in most cases, it can still grow */
+static size_t
+msg_size_estimate(const redisReply *r) {
 
-	out->p = realloc(out->p, out->sz + sz);
-	memcpy(out->p + out->sz, s, sz);
-	out->sz += sz;
+	size_t sz, i;
 
-	return sz;
+	switch(r->type) {
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_ERROR:
+			return 1 + 1 + 5 + r->len;
+
+		case REDIS_REPLY_STRING:
+			return 5 + r->len;
+
+		case REDIS_REPLY_INTEGER:
+			return 9;
+
+		case REDIS_REPLY_ARRAY:
+			sz = 5;
+			for(i = 0; i < r->elements; ++i) {
+				sz += msg_size_estimate(r->element[i]);
+			}
+			return sz;
+
+		default:
+			return 1;
+	}
 }
 
+struct msg_info_field {
+	const char *key;
+	size_t key_sz;
+	const char *val;
+	size_t val_sz;
+};
+
 /**
- * Parse info message and return object.
+ * Parse info message and return object. The text is read once, keeping
+ * pointers to the "key:value" lines since the map size comes first.
  */
 void
 msg_info_reply(msgpack_packer* pk, const char *s, size_t sz) {
 
-	const char *p = s;
-	unsigned int count = 0;
+	const char *p = s, *end = s + sz, *eol, *line_end, *colon;
+	struct msg_info_field *fields = NULL;
+	unsigned int i, count = 0, cap = 0;
 
-	/* TODO: handle new format */
-
-	/* count number of lines */
-	while(p < s + sz) {
-		p = strchr(p, '\r');
-		if(!p) break;
+	while(p < end) {
+		eol = memchr(p, '\n', end - p);
+		line_end = eol ? eol : end;
+		if(line_end > p && line_end[-1] == '\r') {
+			line_end--;
+		}
 
-		p++;
-		count++;
+		/* skip blank lines and "# Section" titles */
+		if(line_end > p && *p != '#' && (colon = memchr(p, ':', line_end - p))) {
+			if(count == cap) {
+				cap = cap ? 2 * cap : 64;
+				fields = realloc(fields, cap * sizeof(struct msg_info_field));
+			}
+			fields[count].key = p;
+			fields[count].key_sz = colon - p;
+			fields[count].val = colon + 1;
+			fields[count].val_sz = line_end - colon - 1;
+			count++;
+		}
+		p = eol ? eol + 1 : end;
 	}
 
 	/* create msgpack object */
 	msgpack_pack_map(pk, count);
-
-	p = s;
-	while(p < s + sz) {
-		char *key, *val, *nl, *colon;
-		size_t key_sz, val_sz;
-
-		/* find key */
-		colon = strchr(p, ':');
-		if(!colon) {
-			break;
-		}
-		key_sz = colon - p;
-		key = calloc(key_sz + 1, 1);
-		memcpy(key, p, key_sz);
-		p = colon + 1;
-
-		/* find value */
-		nl = strchr(p, '\r');
-		if(!nl) {
-			free(key);
-			break;
-		}
-		val_sz = nl - p;
-		val = calloc(val_sz + 1, 1);
-		memcpy(val, p, val_sz);
-		p = nl + 1;
-		if(*p == '\n') p++;
-
-		/* add to object */
-		msgpack_pack_raw(pk, key_sz);
-		msgpack_pack_raw_body(pk, key, key_sz);
-		msgpack_pack_raw(pk, val_sz);
-		msgpack_pack_raw_body(pk, val, val_sz);
-
-		free(key);
-		free(val);
+	for(i = 0; i < count; ++i) {
+		msgpack_pack_raw(pk, fields[i].key_sz);
+		msgpack_pack_raw_body(pk, fields[i].key, fields[i].key_sz);
+		msgpack_pack_raw(pk, fields[i].val_sz);
+		msgpack_pack_raw_body(pk, fields[i].val, fields[i].val_sz);
 	}
+	free(fields);
 }
 
 static void
@@ -152,12 +157,11 @@ msg_hgetall_reply(msgpack_packer* pk, const redisReply *r) {
 }
 
 static void
-msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redisReply *r) {
+msgpack_wrap_redis_reply(const struct cmd *cmd, struct format_buf *out, const redisReply *r) {
 
 	unsigned int i;
-	msgpack_packer* pk = msgpack_packer_new(out, on_msgpack_write);
+	msgpack_packer pk_buf, *pk = &pk_buf;
 
-	/* copy verb, as jansson only takes a char* but not its length. */
 	char *verb = "";
 	size_t verb_sz = 0;
 	if(cmd->count) {
@@ -165,6 +169,10 @@ msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redis
 		verb = cmd->argv[0];
 	}
 
+	/* sized from the reply, so that packing rarely reallocates */
+	format_buf_init(out, 1 + 5 + verb_sz + msg_size_estimate(r));
+	msgpack_packer_init(pk, out, on_msgpack_write);
+
 	/* Create map object */
 	msgpack_pack_map(pk, 1);
 
@@ -231,6 +239,126 @@ msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redis
 			msgpack_pack_nil(pk);
 			break;
 	}
+}
+
+/* encode a single reply. */
+char *
+msgpack_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz) {
+
+	struct format_buf out;
+
+	msgpack_wrap_redis_reply(cmd, &out, r);
+
+	*sz = out.sz;
+	return out.p;
+}
+
+/* concatenate encoded replies into a msgpack array. */
+char *
+msgpack_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz) {
+
+	int i;
+	size_t total = 5;
+	struct format_buf out;
+	msgpack_packer pk;
+	(void)cmd;
+
+	for(i = 0; i < count; ++i) {
+		total += items_sz[i];
+	}
+	format_buf_init(&out, total);
+
+	msgpack_packer_init(&pk, &out, on_msgpack_write);
+	msgpack_pack_array(&pk, count);
+
+	for(i = 0; i < count; ++i) {
+		format_buf_append(&out, items[i], items_sz[i]);
+	}
+
+	*sz = out.sz;
+	return out.p;
+}
+
+/* fill a struct cmd from a msgpack array of raw strings and integers. */
+static struct cmd *
+msgpack_array_to_cmd(const msgpack_object *o) {
+
+	struct cmd *cmd;
+	unsigned int i;
+
+	if(o->type != MSGPACK_OBJECT_ARRAY || o->via.array.size == 0) {
+		return NULL;
+	}
+
+	cmd = cmd_new(o->via.array.size);
+	for(i = 0; i < o->via.array.size; ++i) {
+		const msgpack_object *e = &o->via.array.ptr[i];
+		switch(e->type) {
+			case MSGPACK_OBJECT_RAW:
+				cmd->argv_len[i] = e->via.raw.size;
+				cmd->argv[i] = calloc(cmd->argv_len[i] + 1, 1);
+				memcpy(cmd->argv[i], e->via.raw.ptr, e->via.raw.size);
+				break;
+
+			case MSGPACK_OBJECT_POSITIVE_INTEGER:
+			case MSGPACK_OBJECT_NEGATIVE_INTEGER:
+				cmd->argv[i] = calloc(40, 1);
+				cmd->argv_len[i] = sprintf(cmd->argv[i], "%lld",
+					e->type == MSGPACK_OBJECT_POSITIVE_INTEGER ?
+					(long long)e->via.u64 : (long long)e->via.i64);
+				break;
+
+			default:
+				cmd_free(cmd);
+				return NULL;
+		}
+	}
+
+	return cmd;
+}
+
+/* extract a msgpack array from a WebSocket frame and fill struct cmd. */
+struct cmd *
+msgpack_ws_extract(struct http_client *c, const char *p, size_t sz) {
+
+	msgpack_unpacked msg;
+	struct cmd *cmd = NULL;
+	size_t off = 0;
+	(void)c;
+
+	msgpack_unpacked_init(&msg);
+	if(msgpack_unpack_next(&msg, p, sz, &off)) {
+		cmd = msgpack_array_to_cmd(&msg.data);
+	}
+	msgpack_unpacked_destroy(&msg);
+
+	return cmd;
+}
+
+/**
+ * Extract a list of commands from a msgpack array of arrays.
+ * Entries that can't be decoded are left as NULL in the output array.
+ */
+int
+msgpack_batch_extract(const char *p, size_t sz, struct cmd ***cmds) {
+
+	msgpack_unpacked msg;
+	size_t off = 0;
+	unsigned int i;
+	int count = -1;
+
+	msgpack_unpacked_init(&msg);
+	if(msgpack_unpack_next(&msg, p, sz, &off) &&
+		msg.data.type == MSGPACK_OBJECT_ARRAY && msg.data.via.array.size) {
+
+		count = (int)msg.data.via.array.size;
+		*cmds = calloc(count, sizeof(struct cmd *));
+		for(i = 0; i < (unsigned int)count; ++i) {
+			(*cmds)[i] = msgpack_array_to_cmd(&msg.data.via.array.ptr[i]);
+		}
+	}
+	msgpack_unpacked_destroy(&msg);
 
-	msgpack_packer_free(pk);
+	return count;
 }
@@ -5,7 +5,23 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
+struct cmd;
+struct http_client;
+
 void
 msgpack_reply(redisAsyncContext *c, void *r, void *privdata);
 
+char *
+msgpack_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz);
+
+char *
+msgpack_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz);
+
+struct cmd *
+msgpack_ws_extract(struct http_client *c, const char *p, size_t sz);
+
+int
+msgpack_batch_extract(const char *p, size_t sz, struct cmd ***cmds);
+
 #endif
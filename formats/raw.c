@@ -25,6 +25,11 @@ raw_reply(redisAsyncContext *c, void *r, void *privdata) {
 		return;
 	}
 
+	if(reply->type == REDIS_REPLY_RAW) { /* as received, see cmd_send */
+		format_send_reply(cmd, reply->str, reply->len, "binary/octet-stream");
+		return;
+	}
+
 	raw_out = raw_wrap(r, &sz);
 
 	/* send reply */
@@ -99,35 +104,46 @@ end:
 }
 
 
-static char *
-raw_array(const redisReply *r, size_t *sz) {
-	
+/* size of a multi-bulk reply, nested arrays included */
+static size_t
+raw_array_size(const redisReply *r) {
+
 	unsigned int i;
-	char *ret, *p;
+	size_t sz = 1 + integer_length(r->elements) + 2;
 
-	/* compute size */
-	*sz = 0;
-	*sz += 1 + integer_length(r->elements) + 2;
 	for(i = 0; i < r->elements; ++i) {
 		redisReply *e = r->element[i];
 		switch(e->type) {
 			case REDIS_REPLY_STRING:
-				*sz += 1 + integer_length(e->len) + 2
+				sz += 1 + integer_length(e->len) + 2
 					+ e->len + 2;
 				break;
 			case REDIS_REPLY_INTEGER:
-				*sz += 1 + integer_length(integer_length(e->integer)) + 2
+				sz += 1 + integer_length(integer_length(e->integer)) + 2
 					+ integer_length(e->integer) + 2;
 				break;
-
+			case REDIS_REPLY_STATUS:
+			case REDIS_REPLY_ERROR:
+				sz += 1 + e->len + 2;
+				break;
+			case REDIS_REPLY_NIL:
+				sz += 5;
+				break;
+			case REDIS_REPLY_ARRAY:
+				sz += raw_array_size(e);
+				break;
 		}
 	}
+	return sz;
+}
 
-	/* allocate */
-	p = ret = malloc(1+*sz);
-	p += sprintf(p, "*%zd\r\n", r->elements);
+/* writes a multi-bulk reply to p, returns the end of what was written */
+static char *
+raw_array_copy(const redisReply *r, char *p) {
 
-	/* copy */
+	unsigned int i;
+
+	p += sprintf(p, "*%zd\r\n", r->elements);
 	for(i = 0; i < r->elements; ++i) {
 		redisReply *e = r->element[i];
 		switch(e->type) {
@@ -144,8 +160,34 @@ raw_array(const redisReply *r, size_t *sz) {
 				p += sprintf(p, "$%d\r\n%lld\r\n",
 					integer_length(e->integer), e->integer);
 				break;
+			case REDIS_REPLY_STATUS: /* e.g. EXEC results */
+			case REDIS_REPLY_ERROR:
+				*p++ = (e->type == REDIS_REPLY_STATUS ? '+' : '-');
+				memcpy(p, e->str, e->len);
+				p += e->len;
+				memcpy(p, "\r\n", 2);
+				p += 2;
+				break;
+			case REDIS_REPLY_NIL:
+				memcpy(p, "$-1\r\n", 5);
+				p += 5;
+				break;
+			case REDIS_REPLY_ARRAY: /* e.g. XREAD entries */
+				p = raw_array_copy(e, p);
+				break;
 		}
 	}
+	return p;
+}
+
+static char *
+raw_array(const redisReply *r, size_t *sz) {
+
+	char *ret;
+
+	*sz = raw_array_size(r);
+	ret = malloc(1 + *sz);
+	raw_array_copy(r, ret);
 
 	return ret;
 }
@@ -190,3 +232,68 @@ raw_wrap(const redisReply *r, size_t *sz) {
 	}
 }
 
+
+/* a large array sent as it is read, see chunked.c */
+void
+raw_chunked_head(const struct cmd *cmd, size_t count, struct format_buf *b) {
+
+	char *p = format_buf_reserve(b, 24);
+	(void)cmd;
+
+	b->sz += sprintf(p, "*%zu\r\n", count);
+}
+
+void
+raw_chunked_item(const redisReply *r, size_t idx, struct format_buf *b) {
+
+	char *out;
+	size_t sz;
+	(void)idx;
+
+	if(r->type == REDIS_REPLY_RAW) { /* as received, see cmd_send */
+		format_buf_append(b, r->str, r->len);
+		return;
+	}
+	out = raw_wrap(r, &sz);
+	format_buf_append(b, out, sz);
+	free(out);
+}
+
+void
+raw_chunked_tail(const struct cmd *cmd, struct format_buf *b) {
+
+	(void)cmd;
+	(void)b;
+}
+
+/* encode a single reply in the Redis protocol. */
+char *
+raw_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz) {
+
+	(void)cmd;
+	return raw_wrap(r, sz);
+}
+
+/* concatenate encoded replies into a multi-bulk reply. */
+char *
+raw_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz) {
+
+	int i;
+	char *out, *p;
+	(void)cmd;
+
+	*sz = 1 + integer_length(count) + 2;
+	for(i = 0; i < count; ++i) {
+		*sz += items_sz[i];
+	}
+
+	p = out = malloc(1 + *sz);
+	p += sprintf(p, "*%d\r\n", count);
+	for(i = 0; i < count; ++i) {
+		memcpy(p, items[i], items_sz[i]);
+		p += items_sz[i];
+	}
+
+	return out;
+}
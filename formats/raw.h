@@ -6,6 +6,7 @@
 
 struct cmd;
 struct http_client;
+struct format_buf;
 
 void
 raw_reply(redisAsyncContext *c, void *r, void *privdata);
@@ -13,4 +14,20 @@ raw_reply(redisAsyncContext *c, void *r, void *privdata);
 struct cmd *
 raw_ws_extract(struct http_client *c, const char *p, size_t sz);
 
+char *
+raw_wrap_reply(const struct cmd *cmd, const redisReply *r, size_t *sz);
+
+char *
+raw_wrap_list(const struct cmd *cmd, char **items, size_t *items_sz,
+		int count, size_t *sz);
+
+void
+raw_chunked_head(const struct cmd *cmd, size_t count, struct format_buf *b);
+
+void
+raw_chunked_item(const redisReply *r, size_t idx, struct format_buf *b);
+
+void
+raw_chunked_tail(const struct cmd *cmd, struct format_buf *b);
+
 #endif
@@ -0,0 +1,253 @@
+#include "sse.h"
+#include "json.h"
+#include "common.h"
+#include "cmd.h"
+
+#include <string.h>
+#include <strings.h>
+#include <jansson.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+/**
+ * Server-Sent Events (text/event-stream). Subscriptions are streamed as
+ * one event per message; the entries read from a Redis Stream carry their
+ * ID, so that a browser reconnecting with Last-Event-ID resumes after the
+ * last entry it received. Other replies are sent as a single event with
+ * the JSON output as data.
+ */
+
+struct sse_buffer {
+	char *p;
+	size_t sz;
+	size_t size;
+};
+
+static void
+sse_add(struct sse_buffer *b, const char *p, size_t sz) {
+
+	if(b->sz + sz > b->size) {
+		b->size = 2 * (b->sz + sz) + 64;
+		b->p = realloc(b->p, b->size);
+	}
+	memcpy(b->p + b->sz, p, sz);
+	b->sz += sz;
+}
+
+/* "name: value", split on new lines */
+static void
+sse_add_field(struct sse_buffer *b, const char *name, const char *p, size_t sz) {
+
+	const char *nl;
+
+	do {
+		size_t len = sz;
+		if((nl = memchr(p, '\n', sz))) {
+			len = nl - p;
+		}
+
+		sse_add(b, name, strlen(name));
+		sse_add(b, ": ", 2);
+		sse_add(b, p, (len && p[len-1] == '\r') ? len - 1 : len);
+		sse_add(b, "\n", 1);
+
+		if(nl) {
+			sz -= len + 1;
+			p = nl + 1;
+		}
+	} while(nl);
+}
+
+static void
+sse_add_reply(struct sse_buffer *b, const char *name, const redisReply *r) {
+
+	char buf[32];
+	int sz;
+
+	if(r->type == REDIS_REPLY_INTEGER) {
+		sz = sprintf(buf, "%lld", r->integer);
+		sse_add_field(b, name, buf, sz);
+	} else if(r->type == REDIS_REPLY_NIL) {
+		sse_add_field(b, name, "", 0);
+	} else {
+		sse_add_field(b, name, r->str, r->len);
+	}
+}
+
+/* [id, [field, value, …]], with the fields as a JSON object */
+static void
+sse_add_entry(struct sse_buffer *b, const char *event, size_t event_sz, const redisReply *e) {
+
+	json_t *j = json_object();
+	const redisReply *f;
+	char *str, *name;
+	size_t i;
+
+	if(e->type != REDIS_REPLY_ARRAY || e->elements != 2
+			|| e->element[0]->type != REDIS_REPLY_STRING) {
+		json_decref(j);
+		return;
+	}
+
+	f = e->element[1];
+	for(i = 0; f->type == REDIS_REPLY_ARRAY && i + 1 < f->elements; i += 2) {
+		if(f->element[i]->type != REDIS_REPLY_STRING
+				|| f->element[i+1]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		name = calloc(f->element[i]->len + 1, 1);
+		memcpy(name, f->element[i]->str, f->element[i]->len);
+		json_object_set_new(j, name, json_string(f->element[i+1]->str));
+		free(name);
+	}
+	str = json_dumps(j, JSON_COMPACT);
+
+	if(event) {
+		sse_add_field(b, "event", event, event_sz);
+	}
+	sse_add_reply(b, "id", e->element[0]);
+	sse_add_field(b, "data", str, strlen(str));
+	sse_add(b, "\n", 1);
+
+	free(str);
+	json_decref(j);
+}
+
+static int
+sse_cmd_is(const struct cmd *cmd, const char *name) {
+
+	return cmd->argv_len[0] == strlen(name)
+		&& strncasecmp(cmd->argv[0], name, cmd->argv_len[0]) == 0;
+}
+
+/* ["message", channel, payload] or ["pmessage", pattern, channel, payload] */
+static void
+sse_add_message(struct sse_buffer *b, const struct cmd *cmd, const redisReply *r) {
+
+	const char *kind;
+	int pattern;
+
+	if(r->type != REDIS_REPLY_ARRAY || r->elements < 3
+			|| r->element[0]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+
+	kind = r->element[0]->str;
+	pattern = (strcmp(kind, "pmessage") == 0);
+	if(strcmp(kind, "message") == 0 || (pattern && r->elements == 4)) {
+		const redisReply *ch = r->element[1 + pattern];
+
+		/* with several channels or patterns, the channel names the event */
+		if(cmd->count > 2 && ch->type == REDIS_REPLY_STRING) {
+			sse_add_field(b, "event", ch->str, ch->len);
+		}
+		sse_add_reply(b, "data", r->element[2 + pattern]);
+		sse_add(b, "\n", 1);
+	} else if(r->element[1]->type == REDIS_REPLY_STRING) {
+		/* (un)subscription confirmation, as a comment */
+		sse_add(b, ": ", 2);
+		sse_add(b, kind, strlen(kind));
+		sse_add(b, " ", 1);
+		sse_add(b, r->element[1]->str, r->element[1]->len);
+		sse_add(b, "\n\n", 2);
+	}
+}
+
+void
+sse_reply(redisAsyncContext *c, void *r, void *privdata) {
+
+	redisReply *reply = r;
+	struct cmd *cmd = privdata;
+	struct sse_buffer b = {NULL, 0, 0};
+	size_t i, j;
+	(void)c;
+
+	if(cmd == NULL) {
+		/* broken connection */
+		return;
+	}
+
+	if(reply == NULL) { /* broken Redis link */
+		format_send_error(cmd, 503, "Service Unavailable");
+		return;
+	}
+
+	if(cmd_is_subscribe(cmd)) {
+		sse_add_message(&b, cmd, reply);
+		if(b.sz) {
+			format_send_event(cmd, b.p, b.sz);
+		}
+		free(b.p);
+		return;
+	}
+
+	if((sse_cmd_is(cmd, "XREAD") || sse_cmd_is(cmd, "XREADGROUP"))
+			&& reply->type == REDIS_REPLY_ARRAY) {
+		/* [[stream, [entry, …]], …], the stream names the event if there are several */
+		for(i = 0; i < reply->elements; ++i) {
+			redisReply *s = reply->element[i];
+			if(s->type != REDIS_REPLY_ARRAY || s->elements != 2
+					|| s->element[0]->type != REDIS_REPLY_STRING
+					|| s->element[1]->type != REDIS_REPLY_ARRAY) {
+				continue;
+			}
+			for(j = 0; j < s->element[1]->elements; ++j) {
+				sse_add_entry(&b, reply->elements > 1 ? s->element[0]->str : NULL,
+						s->element[0]->len, s->element[1]->element[j]);
+			}
+		}
+	} else if((sse_cmd_is(cmd, "XRANGE") || sse_cmd_is(cmd, "XREVRANGE"))
+			&& reply->type == REDIS_REPLY_ARRAY) {
+		for(i = 0; i < reply->elements; ++i) {
+			sse_add_entry(&b, NULL, 0, reply->element[i]);
+		}
+	} else if(reply->type != REDIS_REPLY_NIL || !sse_cmd_is(cmd, "XREAD")) {
+		size_t sz;
+		char *out = json_wrap_reply(cmd, reply, &sz);
+
+		sse_add_field(&b, "data", out, sz);
+		sse_add(&b, "\n", 1);
+		free(out);
+	}
+
+	if(cmd->reader) { /* tailing a stream, more to come */
+		if(b.sz) {
+			format_send_event(cmd, b.p, b.sz);
+		}
+		free(b.p);
+		return;
+	}
+
+	/* nothing new: the browser reconnects and reads again */
+	format_send_reply(cmd, b.p ? b.p : "", b.sz, "text/event-stream");
+	free(b.p);
+}
+
+/**
+ * Last-Event-ID is the ID of the last entry received from the stream: read
+ * after it instead of the ID given in the URL. Only for XREAD on a single
+ * stream.
+ */
+void
+sse_resume(struct cmd *cmd, const char *last_event_id) {
+
+	int i;
+	size_t sz = strlen(last_event_id);
+
+	if(!sse_cmd_is(cmd, "XREAD") || sz == 0) {
+		return;
+	}
+	for(i = 1; i < cmd->count; ++i) {
+		if(cmd->argv_len[i] == 7 && strncasecmp(cmd->argv[i], "STREAMS", 7) == 0) {
+			break;
+		}
+	}
+	if(i + 3 != cmd->count) {
+		return;
+	}
+
+	free(cmd->argv[i + 2]);
+	cmd->argv[i + 2] = malloc(sz);
+	memcpy(cmd->argv[i + 2], last_event_id, sz);
+	cmd->argv_len[i + 2] = sz;
+}
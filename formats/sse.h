@@ -0,0 +1,15 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+struct cmd;
+
+void
+sse_reply(redisAsyncContext *c, void *r, void *privdata);
+
+void
+sse_resume(struct cmd *cmd, const char *last_event_id);
+
+#endif
@@ -389,7 +389,13 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
     void *reply = NULL;
     int status;
 
-    while((status = redisGetReply(c,&reply)) == REDIS_OK) {
+    for (;;) {
+        /* A reply that starts now goes to the first callback. */
+        c->reader->raw = ac->replies.head != NULL && ac->replies.head->raw;
+        c->reader->stream = ac->replies.head != NULL ? ac->replies.head->stream : 0;
+        if ((status = redisGetReply(c,&reply)) != REDIS_OK)
+            break;
+
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
@@ -408,9 +414,13 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
             break;
         }
 
+        /* The elements of a streamed array all go to the first callback,
+         * which is done with after the last one. */
+        if (c->reader->streamleft > 0 && ac->replies.head != NULL) {
+            cb = *ac->replies.head;
         /* Even if the context is subscribed, pending regular callbacks will
          * get a reply before pub/sub messages arrive. */
-        if (__redisShiftCallback(&ac->replies,&cb) != REDIS_OK) {
+        } else if (__redisShiftCallback(&ac->replies,&cb) != REDIS_OK) {
             /*
              * A spontaneous reply in a not-subscribed context can be the error
              * reply that is sent when a new connection exceeds the maximum
@@ -553,7 +563,7 @@ static char *nextArgument(char *start, char **str, size_t *len) {
 /* Helper function for the redisAsyncCommand* family of functions. Writes a
  * formatted command to the output buffer and registers the provided callback
  * function with the context. */
-static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, char *cmd, size_t len) {
+static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int raw, size_t stream, char *cmd, size_t len) {
     redisContext *c = &(ac->c);
     redisCallback cb;
     int pvariant, hasnext;
@@ -568,6 +578,8 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     /* Setup callback */
     cb.fn = fn;
     cb.privdata = privdata;
+    cb.raw = 0;
+    cb.stream = 0;
 
     /* Find out which command will be appended. */
     p = nextArgument(cmd,&cstr,&clen);
@@ -605,8 +617,11 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
             /* This will likely result in an error reply, but it needs to be
              * received and passed to the callback. */
             __redisPushCallback(&ac->sub.invalid,&cb);
-        else
+        else {
+            cb.raw = raw;
+            cb.stream = stream;
             __redisPushCallback(&ac->replies,&cb);
+        }
     }
 
     __redisAppendCommand(c,cmd,len);
@@ -622,7 +637,7 @@ int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdat
     int len;
     int status;
     len = redisvFormatCommand(&cmd,format,ap);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
+    status = __redisAsyncCommand(ac,fn,privdata,0,0,cmd,len);
     free(cmd);
     return status;
 }
@@ -641,7 +656,32 @@ int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *priv
     int len;
     int status;
     len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    status = __redisAsyncCommand(ac,fn,privdata,cmd,len);
+    status = __redisAsyncCommand(ac,fn,privdata,0,0,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* Same as redisAsyncCommandArgv, but the reply isn't parsed into objects: the
+ * callback gets a REDIS_REPLY_RAW with the bytes of the reply, as received. */
+int redisAsyncRawCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    status = __redisAsyncCommand(ac,fn,privdata,1,0,cmd,len);
+    free(cmd);
+    return status;
+}
+
+/* Same as redisAsyncCommandArgv, raw as in redisAsyncRawCommandArgv. When
+ * the reply is an array of at least stream elements, the callback gets a
+ * REDIS_REPLY_STREAM with their number, then each element as it is read. */
+int redisAsyncStreamCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int raw, size_t stream, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    int status;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    status = __redisAsyncCommand(ac,fn,privdata,raw,stream,cmd,len);
     free(cmd);
     return status;
 }
@@ -46,6 +46,8 @@ typedef struct redisCallback {
     struct redisCallback *next; /* simple singly linked list */
     redisCallbackFn *fn;
     void *privdata;
+    int raw; /* the reply is passed as a REDIS_REPLY_RAW */
+    size_t stream; /* arrays this large are passed element by element */
 } redisCallback;
 
 /* List of callbacks for either regular replies or pub/sub */
@@ -117,6 +119,8 @@ void redisAsyncHandleWrite(redisAsyncContext *ac);
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...);
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisAsyncRawCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisAsyncStreamCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int raw, size_t stream, int argc, const char **argv, const size_t *argvlen);
 
 #ifdef __cplusplus
 }
@@ -90,6 +90,10 @@ void freeReplyObject(void *reply) {
         if (r->str != NULL)
             free(r->str);
         break;
+    case REDIS_REPLY_RAW:
+        break; /* str belongs to the reader */
+    case REDIS_REPLY_STREAM:
+        break; /* elements are returned one by one */
     }
     free(r);
 }
@@ -186,10 +190,9 @@ static void *createNilObject(const redisReadTask *task) {
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     size_t len;
 
-    if (r->reply != NULL && r->fn && r->fn->freeObject) {
+    if (r->reply != NULL && !r->rawreply && r->fn && r->fn->freeObject)
         r->fn->freeObject(r->reply);
-        r->reply = NULL;
-    }
+    r->reply = NULL;
 
     /* Clear input buffer on errors. */
     if (r->buf != NULL) {
@@ -360,13 +363,13 @@ static int processLineItem(redisReader *r) {
 
     if ((p = readLine(r,&len)) != NULL) {
         if (cur->type == REDIS_REPLY_INTEGER) {
-            if (r->fn && r->fn->createInteger)
+            if (!r->rawreply && r->fn && r->fn->createInteger)
                 obj = r->fn->createInteger(cur,readLongLong(p));
             else
                 obj = (void*)REDIS_REPLY_INTEGER;
         } else {
             /* Type will be error or status. */
-            if (r->fn && r->fn->createString)
+            if (!r->rawreply && r->fn && r->fn->createString)
                 obj = r->fn->createString(cur,p,len);
             else
                 obj = (void*)(size_t)(cur->type);
@@ -403,7 +406,7 @@ static int processBulkItem(redisReader *r) {
 
         if (len < 0) {
             /* The nil object can always be created. */
-            if (r->fn && r->fn->createNil)
+            if (!r->rawreply && r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
             else
                 obj = (void*)REDIS_REPLY_NIL;
@@ -412,7 +415,7 @@ static int processBulkItem(redisReader *r) {
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
-                if (r->fn && r->fn->createString)
+                if (!r->rawreply && r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
                     obj = (void*)REDIS_REPLY_STRING;
@@ -457,8 +460,22 @@ static int processMultiBulkItem(redisReader *r) {
         elements = readLongLong(p);
         root = (r->ridx == 0);
 
+        if (root && r->stream && !r->streamitem && elements >= (long)r->stream) {
+            /* Streamed: only the header is returned for now. */
+            if ((obj = createReplyObject(REDIS_REPLY_STREAM)) == NULL) {
+                __redisReaderSetErrorOOM(r);
+                return REDIS_ERR;
+            }
+            ((redisReply*)obj)->elements = elements;
+            r->rawreply = 0;
+            r->streamleft = elements;
+            r->reply = obj;
+            moveToNextTask(r);
+            return REDIS_OK;
+        }
+
         if (elements == -1) {
-            if (r->fn && r->fn->createNil)
+            if (!r->rawreply && r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
             else
                 obj = (void*)REDIS_REPLY_NIL;
@@ -470,7 +487,7 @@ static int processMultiBulkItem(redisReader *r) {
 
             moveToNextTask(r);
         } else {
-            if (r->fn && r->fn->createArray)
+            if (!r->rawreply && r->fn && r->fn->createArray)
                 obj = r->fn->createArray(cur,elements);
             else
                 obj = (void*)REDIS_REPLY_ARRAY;
@@ -510,6 +527,14 @@ static int processItem(redisReader *r) {
 
     /* check if we need to read type */
     if (cur->type < 0) {
+        /* A new reply starts here. */
+        if (r->ridx == 0) {
+            r->rawreply = r->raw;
+            r->rawpos = r->pos;
+            r->streamitem = r->streamleft > 0;
+            r->replypos = r->pos;
+            r->replybytes = 0;
+        }
         if ((p = readBytes(r,1)) != NULL) {
             switch (p[0]) {
             case '-':
@@ -575,7 +600,7 @@ redisReader *redisReaderCreate(void) {
 }
 
 void redisReaderFree(redisReader *r) {
-    if (r->reply != NULL && r->fn && r->fn->freeObject)
+    if (r->reply != NULL && !r->rawreply && r->fn && r->fn->freeObject)
         r->fn->freeObject(r->reply);
     if (r->buf != NULL)
         sdsfree(r->buf);
@@ -615,6 +640,8 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
 }
 
 int redisReaderGetReply(redisReader *r, void **reply) {
+    size_t discard;
+
     /* Default target pointer to NULL. */
     if (reply != NULL)
         *reply = NULL;
@@ -647,16 +674,43 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
+    /* An incomplete reply has all the bytes after its start. */
+    if (r->maxreply && r->ridx >= 0 &&
+        r->replybytes + (r->len - r->replypos) > r->maxreply) {
+        __redisReaderSetError(r,REDIS_ERR_PROTOCOL,"Reply too large");
+        return REDIS_ERR;
+    }
+
     /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        r->buf = sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
+     * doing unnecessary calls to memmove() in sds.c. A raw reply is kept
+     * whole. */
+    discard = r->rawreply ? r->rawpos : r->pos;
+    if (discard >= 1024) {
+        if (r->ridx >= 0) {
+            r->replybytes += discard - r->replypos;
+            r->replypos = 0;
+        }
+        r->buf = sdsrange(r->buf,discard,-1);
+        r->pos -= discard;
+        if (r->rawreply) r->rawpos = 0;
         r->len = sdslen(r->buf);
     }
 
     /* Emit a reply when there is one. */
     if (r->ridx == -1) {
+        if (r->rawreply) {
+            r->rawreply = 0;
+            if ((r->reply = createReplyObject(REDIS_REPLY_RAW)) == NULL) {
+                __redisReaderSetErrorOOM(r);
+                return REDIS_ERR;
+            }
+            ((redisReply*)r->reply)->str = r->buf+r->rawpos;
+            ((redisReply*)r->reply)->len = r->pos-r->rawpos;
+        }
+        if (r->streamitem) {
+            r->streamitem = 0;
+            r->streamleft--;
+        }
         if (reply != NULL)
             *reply = r->reply;
         r->reply = NULL;
@@ -85,6 +85,8 @@
 #define REDIS_REPLY_NIL 4
 #define REDIS_REPLY_STATUS 5
 #define REDIS_REPLY_ERROR 6
+#define REDIS_REPLY_RAW 7 /* str/len are the reply as received, see redisReader.raw */
+#define REDIS_REPLY_STREAM 8 /* elements of an array to come, see redisReader.stream */
 
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
 
@@ -135,6 +137,27 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+
+    /* When set as a reply starts, the reply is only delimited: no objects
+     * are created and it is returned as a REDIS_REPLY_RAW pointing into buf,
+     * valid until the next call on the reader. Needs the default functions. */
+    int raw;
+    int rawreply; /* the reply being read is a raw one */
+    size_t rawpos; /* where it starts in buf */
+
+    /* When set as a reply starts, a top-level array of at least this many
+     * elements isn't built: it is returned as a REDIS_REPLY_STREAM with the
+     * number of elements, then each element is returned as a reply of its
+     * own. streamleft counts the elements still to come. */
+    size_t stream;
+    size_t streamleft;
+    int streamitem; /* the reply being read is one of these elements */
+
+    /* A reply (or streamed element) larger than this many bytes is an
+     * error, 0 for no limit. */
+    size_t maxreply;
+    size_t replypos; /* where the reply being read starts in buf */
+    size_t replybytes; /* of it, already discarded from buf */
 } redisReader;
 
 /* Public API for the protocol parser. */
@@ -90,18 +90,11 @@ http_response_set_body(struct http_response *r, const char *body, size_t body_le
 }
 
 static void
-http_response_cleanup(struct http_response *r, int fd, int success) {
+http_response_free(struct http_response *r) {
 
 	int i;
 
-	/* cleanup buffer */
 	free(r->out);
-	if(!r->keep_alive || !success) {
-		/* Close fd is client doesn't support Keep-Alive. */
-		close(fd);
-	}
-
-	/* cleanup response object */
 	for(i = 0; i < r->header_count; ++i) {
 		free(r->headers[i].key);
 		free(r->headers[i].val);
@@ -111,6 +104,18 @@ http_response_cleanup(struct http_response *r, int fd, int success) {
 	free(r);
 }
 
+static void
+http_response_cleanup(struct http_response *r, int fd, int success) {
+
+	if(!r->keep_alive || !success) {
+		/* Close fd is client doesn't support Keep-Alive. */
+		close(fd);
+	}
+
+	/* cleanup response object */
+	http_response_free(r);
+}
+
 static void
 http_can_write(int fd, short event, void *p) {
 
@@ -162,8 +167,8 @@ format_chunk(const char *p, size_t sz, size_t *out_sz) {
 	return out;
 }
 
-void
-http_response_write(struct http_response *r, int fd) {
+static void
+http_response_format(struct http_response *r) {
 
 	char *p;
 	int i, ret;
@@ -176,8 +181,8 @@ http_response_write(struct http_response *r, int fd) {
 	(void)ret;
 	p = r->out;
 
-	if(!r->chunked) {
-		if(r->code == 200 && r->body) {
+	if(!r->chunked && !r->stream && !r->head) {
+		if(r->body) {
 			char content_length[10];
 			sprintf(content_length, "%zd", r->body_len);
 			http_response_set_header(r, "Content-Length", content_length);
@@ -239,11 +244,59 @@ http_response_write(struct http_response *r, int fd) {
 		}
 	}
 
+}
+
+void
+http_response_write(struct http_response *r, int fd) {
+
+	http_response_format(r);
+
 	/* send buffer to client */
 	r->sent = 0;
 	http_schedule_write(fd, r);
 }
 
+/**
+ * Queue a response behind what the client is already being sent, for
+ * streams made of several writes. The connection is left open.
+ */
+void
+http_response_send(struct http_response *r, struct http_client *c) {
+
+	struct http_frame *f;
+
+	http_response_format(r);
+	f = http_frame_new(r->out, r->out_sz);
+	r->out = NULL; /* now owned by the frame */
+
+	http_client_send(c, f);
+	http_frame_release(f);
+	http_response_free(r);
+}
+
+/**
+ * Status line and headers of a response whose body_len bytes are written by
+ * the caller. The response is freed.
+ */
+char *
+http_response_head(struct http_response *r, size_t body_len, size_t *sz) {
+
+	char content_length[22], *out;
+
+	sprintf(content_length, "%zu", body_len);
+	http_response_set_header(r, "Content-Length", content_length);
+	r->head = 1;
+	r->body = NULL;
+
+	http_response_format(r);
+	out = r->out;
+	*sz = r->out_sz;
+	r->out = NULL;
+	http_response_free(r);
+
+	return out;
+}
+
 static void
 http_response_set_connection_header(struct http_client *c, struct http_response *r) {
 	http_response_set_keep_alive(r, c->keep_alive);
@@ -312,19 +365,37 @@ http_send_options(struct http_client *c) {
 	http_client_reset(c);
 }
 
+/* takes ownership of the buffer */
+struct http_frame *
+http_frame_new(char *out, size_t out_sz) {
+
+	struct http_frame *f = malloc(sizeof(struct http_frame));
+
+	f->refs = 1;
+	f->out = out;
+	f->out_sz = out_sz;
+
+	return f;
+}
+
 /**
- * Write HTTP chunk.
+ * HTTP chunk.
  */
-void
-http_response_write_chunk(int fd, struct worker *w, const char *p, size_t sz) {
+struct http_frame *
+http_frame_chunk(const char *p, size_t sz) {
 
-	struct http_response *r = http_response_init(w, 0, NULL);
-	r->keep_alive = 1; /* chunks are always keep-alive */
+	size_t out_sz;
+	char *out = format_chunk(p, sz, &out_sz);
 
-	/* format packet */
-	r->out = format_chunk(p, sz, &r->out_sz);
+	return http_frame_new(out, out_sz);
+}
 
-	/* send async write */
-	http_schedule_write(fd, r);
+void
+http_frame_release(struct http_frame *f) {
+
+	if(--f->refs == 0) {
+		free(f->out);
+		free(f);
+	}
 }
 
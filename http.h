@@ -33,6 +33,8 @@ struct http_response {
 	size_t out_sz;
 
 	int chunked;
+	int stream; /* no length, the body ends with the connection */
+	int head; /* Content-Length set, the body is sent separately */
 	int http_version;
 	int keep_alive;
 	int sent;
@@ -40,6 +42,13 @@ struct http_response {
 	struct worker *w;
 };
 
+/* immutable output buffer, shared by all the clients it is sent to */
+struct http_frame {
+	int refs;
+	char *out;
+	size_t out_sz;
+};
+
 /* HTTP response */
 
 struct http_response *
@@ -67,9 +76,23 @@ void
 http_send_options(struct http_client *c);
 
 void
-http_response_write_chunk(int fd, struct worker *w, const char *p, size_t sz);
+http_response_set_keep_alive(struct http_response *r, int enabled);
 
 void
-http_response_set_keep_alive(struct http_response *r, int enabled);
+http_response_send(struct http_response *r, struct http_client *c);
+
+char *
+http_response_head(struct http_response *r, size_t body_len, size_t *sz);
+
+/* frames */
+
+struct http_frame *
+http_frame_new(char *out, size_t out_sz);
+
+struct http_frame *
+http_frame_chunk(const char *p, size_t sz);
+
+void
+http_frame_release(struct http_frame *f);
 
 #endif
@@ -0,0 +1,505 @@
+#include "hub.h"
+#include "cmd.h"
+#include "client.h"
+#include "pool.h"
+#include "worker.h"
+#include "slog.h"
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Shared pub/sub connection: each worker subscribes to a channel or pattern
+ * once, however many clients are listening to it, and fans the messages out
+ * locally. SUBSCRIBE and UNSUBSCRIBE are only sent to Redis when the number
+ * of local subscribers goes from 0 to 1 and back.
+ *
+ * The connection always listens to a private channel, so that it never
+ * leaves the subscribed state when the last client goes away.
+ */
+
+#define HUB_PRIVATE_CHANNEL "__webdis__:hub"
+
+/* distinct outputs formatted once per message, others are formatted each time */
+#define HUB_OUTPUTS 8
+
+typedef enum {
+	HUB_SUBSCRIBED = 0,
+	HUB_UNSUBSCRIBING /* UNSUBSCRIBE sent, no reply yet */
+} hub_state_t;
+
+struct hub_member {
+	struct hub_channel *ch;
+	struct cmd *cmd;
+	formatting_fun f_format;
+
+	struct hub_member *prev;	/* same channel */
+	struct hub_member *next;
+	struct hub_member *next_of_cmd;
+};
+
+struct hub_channel {
+	char *name;
+	size_t sz;
+	int pattern;
+	unsigned int hash;
+
+	int refs;
+	hub_state_t state;
+	struct hub_member *members;
+
+	struct hub_channel *next;	/* same bucket */
+};
+
+static void
+hub_connect(struct hub *h);
+
+struct hub *
+hub_new(struct worker *w) {
+
+	struct hub *h = calloc(1, sizeof(struct hub));
+	h->w = w;
+
+	return h;
+}
+
+static struct hub_channel *
+hub_find(struct hub *h, const char *name, size_t sz, int pattern) {
+
+	struct hub_channel *ch;
+	unsigned int hash = cmd_hash(name, sz);
+
+	for(ch = h->buckets[hash % HUB_BUCKETS]; ch; ch = ch->next) {
+		if(ch->hash == hash && ch->pattern == pattern && ch->sz == sz
+				&& memcmp(ch->name, name, sz) == 0) {
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+static struct hub_channel *
+hub_channel_new(struct hub *h, const char *name, size_t sz, int pattern) {
+
+	struct hub_channel *ch = calloc(1, sizeof(struct hub_channel));
+
+	ch->name = malloc(sz);
+	memcpy(ch->name, name, sz);
+	ch->sz = sz;
+	ch->pattern = pattern;
+	ch->hash = cmd_hash(name, sz);
+
+	ch->next = h->buckets[ch->hash % HUB_BUCKETS];
+	h->buckets[ch->hash % HUB_BUCKETS] = ch;
+	h->channels++;
+
+	return ch;
+}
+
+static void
+hub_channel_free(struct hub *h, struct hub_channel *ch) {
+
+	struct hub_channel **prev;
+
+	for(prev = &h->buckets[ch->hash % HUB_BUCKETS]; *prev; prev = &(*prev)->next) {
+		if(*prev == ch) {
+			*prev = ch->next;
+			break;
+		}
+	}
+	h->channels--;
+
+	free(ch->name);
+	free(ch);
+}
+
+static void
+hub_on_message(redisAsyncContext *ac, void *r, void *privdata);
+
+static void
+hub_send_subscribe(struct hub *h, struct hub_channel *ch) {
+
+	redisAsyncCommand(h->ac, hub_on_message, h, ch->pattern ? "PSUBSCRIBE %b" : "SUBSCRIBE %b",
+			ch->name, ch->sz);
+}
+
+/* last local subscriber gone */
+static void
+hub_release(struct hub *h, struct hub_channel *ch) {
+
+	if(ch->state == HUB_UNSUBSCRIBING) {
+		return; /* freed when Redis confirms */
+	} else if(h->ac) {
+		ch->state = HUB_UNSUBSCRIBING;
+		redisAsyncCommand(h->ac, hub_on_message, h, ch->pattern ? "PUNSUBSCRIBE %b" : "UNSUBSCRIBE %b",
+				ch->name, ch->sz);
+	} else {
+		hub_channel_free(h, ch);
+	}
+}
+
+static void
+hub_member_remove(struct hub *h, struct hub_member *m) {
+
+	struct hub_channel *ch = m->ch;
+
+	if(m->prev) m->prev->next = m->next;
+	else ch->members = m->next;
+	if(m->next) m->next->prev = m->prev;
+	h->members--;
+
+	if(--ch->refs == 0) {
+		hub_release(h, ch);
+	}
+	free(m);
+}
+
+/* a WebSocket client has one command per SUBSCRIBE, an HTTP client just one. */
+static int
+hub_same_owner(struct cmd *a, struct cmd *b) {
+
+	return a == b || (a->client && a->client == b->client);
+}
+
+/* number of channels or patterns this client is subscribed to */
+static long long
+hub_owner_count(struct cmd *cmd) {
+
+	struct cmd *o;
+	struct hub_member *m;
+	long long n = 0;
+
+	if(!cmd->client) {
+		for(m = cmd->hub_members; m; m = m->next_of_cmd) n++;
+		return n;
+	}
+	for(o = cmd->client->cmds; o; o = o->client_next) {
+		for(m = o->hub_members; m; m = m->next_of_cmd) n++;
+	}
+	return n;
+}
+
+static redisReply *
+hub_reply_string(const char *p, size_t sz) {
+
+	redisReply *r = calloc(1, sizeof(redisReply));
+	r->type = REDIS_REPLY_STRING;
+	r->str = malloc(sz + 1);
+	memcpy(r->str, p, sz);
+	r->str[sz] = 0;
+	r->len = (int)sz;
+	return r;
+}
+
+/* what Redis would have replied to this client on its own connection */
+static void
+hub_confirm(struct hub *h, struct cmd *cmd, formatting_fun f_format,
+		const char *kind, struct hub_channel *ch) {
+
+	redisReply *r = calloc(1, sizeof(redisReply));
+
+	r->type = REDIS_REPLY_ARRAY;
+	r->elements = 3;
+	r->element = calloc(3, sizeof(redisReply *));
+	r->element[0] = hub_reply_string(kind, strlen(kind));
+	r->element[1] = hub_reply_string(ch->name, ch->sz);
+	r->element[2] = calloc(1, sizeof(redisReply));
+	r->element[2]->type = REDIS_REPLY_INTEGER;
+	r->element[2]->integer = hub_owner_count(cmd);
+
+	f_format(h->ac, r, cmd);
+	freeReplyObject(r);
+}
+
+static int
+hub_is_pattern(struct cmd *cmd) {
+
+	return cmd->argv_len[0] > 0 && (cmd->argv[0][0] == 'p' || cmd->argv[0][0] == 'P');
+}
+
+void
+hub_subscribe(struct hub *h, struct cmd *cmd, formatting_fun f_format) {
+
+	int i, pattern = hub_is_pattern(cmd);
+	struct hub_channel *ch;
+	struct hub_member *m;
+
+	for(i = 1; i < cmd->count; ++i) {
+		ch = hub_find(h, cmd->argv[i], cmd->argv_len[i], pattern);
+		if(!ch) {
+			ch = hub_channel_new(h, cmd->argv[i], cmd->argv_len[i], pattern);
+		}
+
+		/* already subscribed, Redis would only confirm it again */
+		for(m = ch->members; m; m = m->next) {
+			if(hub_same_owner(m->cmd, cmd)) break;
+		}
+
+		if(!m) {
+			m = calloc(1, sizeof(struct hub_member));
+			m->ch = ch;
+			m->cmd = cmd;
+			m->f_format = f_format;
+			m->next = ch->members;
+			if(ch->members) ch->members->prev = m;
+			ch->members = m;
+			m->next_of_cmd = cmd->hub_members;
+			cmd->hub_members = m;
+			h->members++;
+
+			/* first local subscriber; re-sent on reconnection otherwise. */
+			if(ch->refs++ == 0 && ch->state == HUB_SUBSCRIBED && h->ac) {
+				hub_send_subscribe(h, ch);
+			}
+		}
+
+		hub_confirm(h, cmd, f_format, pattern ? "psubscribe" : "subscribe", ch);
+	}
+}
+
+static int
+hub_unsubscribe_matches(struct cmd *cmd, struct hub_channel *ch, int pattern) {
+
+	int i;
+	if(ch->pattern != pattern) {
+		return 0;
+	}
+	if(cmd->count == 1) { /* all of them */
+		return 1;
+	}
+	for(i = 1; i < cmd->count; ++i) {
+		if(cmd->argv_len[i] == ch->sz && memcmp(cmd->argv[i], ch->name, ch->sz) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * (P)UNSUBSCRIBE from a WebSocket client. Confirmations go through the
+ * commands that subscribed, like they did with one connection per client.
+ */
+void
+hub_unsubscribe(struct hub *h, struct cmd *cmd) {
+
+	int pattern = hub_is_pattern(cmd);
+	struct cmd *o, *next;
+	struct hub_member **prev, *m;
+
+	for(o = cmd->client ? cmd->client->cmds : NULL; o; o = next) {
+		next = o->client_next;
+
+		prev = &o->hub_members;
+		while((m = *prev)) {
+			struct hub_channel *ch = m->ch;
+			formatting_fun f_format = m->f_format;
+
+			if(!hub_unsubscribe_matches(cmd, ch, pattern)) {
+				prev = &m->next_of_cmd;
+				continue;
+			}
+			*prev = m->next_of_cmd;
+
+			/* the channel might be released with the last member */
+			ch->refs++;
+			hub_member_remove(h, m);
+			hub_confirm(h, o, f_format, pattern ? "punsubscribe" : "unsubscribe", ch);
+			if(--ch->refs == 0) {
+				hub_release(h, ch);
+			}
+		}
+
+		/* nothing left to listen to */
+		if(o != cmd && !o->hub_members && cmd_is_subscribe(o)) {
+			cmd_free(o);
+		}
+	}
+
+	cmd_free(cmd);
+}
+
+/* called when a subscribed command is freed */
+void
+hub_leave(struct cmd *cmd) {
+
+	struct hub *h = cmd->w->hub;
+	struct hub_member *m;
+
+	while((m = cmd->hub_members)) {
+		cmd->hub_members = m->next_of_cmd;
+		hub_member_remove(h, m);
+	}
+}
+
+/* the same message gives the same bytes for these two subscribers */
+static int
+hub_same_output(struct hub_member *a, struct hub_member *b) {
+
+	struct cmd *x = a->cmd, *y = b->cmd;
+
+	return a->f_format == b->f_format
+		&& x->is_websocket == y->is_websocket
+		&& (x->count > 2) == (y->count > 2) /* SSE events are named with several channels */
+		&& x->argv_len[0] == y->argv_len[0] /* used as the JSON key */
+		&& memcmp(x->argv[0], y->argv[0], x->argv_len[0]) == 0
+		&& (x->jsonp == y->jsonp || (x->jsonp && y->jsonp && strcmp(x->jsonp, y->jsonp) == 0))
+		&& (x->separator == y->separator
+			|| (x->separator && y->separator && strcmp(x->separator, y->separator) == 0));
+}
+
+/* whether the frame sent to this subscriber can be reused for others */
+static int
+hub_can_share(struct hub_member *m) {
+
+	return m->cmd->client && (m->cmd->is_websocket || m->cmd->started_responding);
+}
+
+/**
+ * Each message is formatted once per kind of output (format, transport,
+ * JSONP…), and the resulting frame queued by reference on the clients.
+ */
+static void
+hub_deliver(struct hub *h, redisAsyncContext *ac, redisReply *reply, struct hub_channel *ch) {
+
+	struct hub_member *m, *next;
+	struct hub_member *leaders[HUB_OUTPUTS];
+	struct http_frame *frames[HUB_OUTPUTS];
+	int i, n = 0;
+
+	h->messages++;
+	for(m = ch->members; m; m = next) {
+		next = m->next;
+		h->deliveries++;
+
+		if(hub_can_share(m)) {
+			for(i = 0; i < n && !hub_same_output(leaders[i], m); ++i);
+			if(i < n) {
+				http_client_send(m->cmd->client, frames[i]);
+				continue;
+			}
+		}
+
+		/* first of its kind: keep the frame it gets */
+		h->formatted++;
+		if(n < HUB_OUTPUTS && hub_can_share(m)) {
+			h->capturing = 1;
+			h->captured = NULL;
+			m->f_format(ac, reply, m->cmd);
+			h->capturing = 0;
+			if(h->captured) {
+				leaders[n] = m;
+				frames[n++] = h->captured;
+			}
+		} else {
+			m->f_format(ac, reply, m->cmd);
+		}
+	}
+
+	for(i = 0; i < n; ++i) {
+		http_frame_release(frames[i]);
+	}
+}
+
+static void
+hub_can_connect(int fd, short event, void *ptr) {
+
+	(void)fd;
+	(void)event;
+
+	hub_connect(ptr);
+}
+
+/* subscribers stay registered, and are subscribed again once reconnected. */
+static void
+hub_lost(struct hub *h) {
+
+	struct timeval tv = {1, 0};
+	struct hub_channel *ch, *next;
+	int i;
+
+	h->ac = NULL;
+	for(i = 0; i < HUB_BUCKETS; ++i) {
+		for(ch = h->buckets[i]; ch; ch = next) {
+			next = ch->next;
+			ch->state = HUB_SUBSCRIBED;
+			if(ch->refs == 0) {
+				hub_channel_free(h, ch);
+			}
+		}
+	}
+
+	evtimer_set(&h->ev_reconnect, hub_can_connect, h);
+	event_base_set(h->w->base, &h->ev_reconnect);
+	evtimer_add(&h->ev_reconnect, &tv);
+}
+
+static void
+hub_on_message(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct hub *h = privdata;
+	redisReply *reply = r;
+	struct hub_channel *ch;
+	const char *kind;
+	int pattern;
+
+	if(ac != h->ac) {
+		return;
+	}
+	if(!reply) {
+		slog(h->w->s, WEBDIS_WARNING, "Pub/sub connection lost", 0);
+		hub_lost(h);
+		return;
+	}
+	if(reply->type != REDIS_REPLY_ARRAY || reply->elements < 3
+			|| reply->element[0]->type != REDIS_REPLY_STRING
+			|| reply->element[1]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+
+	kind = reply->element[0]->str;
+	pattern = (kind[0] == 'p');
+	ch = hub_find(h, reply->element[1]->str, reply->element[1]->len, pattern);
+	if(!ch) {
+		return;
+	}
+
+	if(strcmp(kind, "message") == 0 || strcmp(kind, "pmessage") == 0) {
+		hub_deliver(h, ac, reply, ch);
+	} else if((strcmp(kind, "unsubscribe") == 0 || strcmp(kind, "punsubscribe") == 0)
+			&& ch->state == HUB_UNSUBSCRIBING) {
+		ch->state = HUB_SUBSCRIBED;
+		if(ch->refs > 0) { /* someone subscribed in the meantime */
+			hub_send_subscribe(h, ch);
+		} else {
+			hub_channel_free(h, ch);
+		}
+	}
+}
+
+static void
+hub_connect(struct hub *h) {
+
+	struct hub_channel *ch;
+	int i;
+
+	h->ac = pool_connect(h->w->pool, 0, 0);
+	if(!h->ac) {
+		hub_lost(h);
+		return;
+	}
+
+	redisAsyncCommand(h->ac, hub_on_message, h, "SUBSCRIBE " HUB_PRIVATE_CHANNEL);
+	for(i = 0; i < HUB_BUCKETS; ++i) {
+		for(ch = h->buckets[i]; ch; ch = ch->next) {
+			hub_send_subscribe(h, ch);
+		}
+	}
+}
+
+void
+hub_start(struct hub *h) {
+
+	hub_connect(h);
+}
@@ -0,0 +1,51 @@
+#ifndef HUB_H
+#define HUB_H
+
+#include <event.h>
+#include <hiredis/async.h>
+#include "cmd.h"
+
+#define HUB_BUCKETS 1024
+
+struct worker;
+struct hub_channel;
+struct http_frame;
+
+struct hub {
+	struct worker *w;
+
+	/* single pub/sub connection shared by all the subscribers */
+	redisAsyncContext *ac;
+	struct event ev_reconnect;
+
+	/* channels and patterns with local subscribers */
+	struct hub_channel *buckets[HUB_BUCKETS];
+
+	/* frame formatted for the first subscriber of a kind, sent to the others */
+	int capturing;
+	struct http_frame *captured;
+
+	/* counters */
+	unsigned long channels;
+	unsigned long members; /* (subscriber, channel) pairs */
+	unsigned long messages; /* received from Redis */
+	unsigned long deliveries; /* sent to subscribers */
+	unsigned long formatted; /* deliveries that needed formatting */
+};
+
+struct hub *
+hub_new(struct worker *w);
+
+void
+hub_start(struct hub *h);
+
+void
+hub_subscribe(struct hub *h, struct cmd *cmd, formatting_fun f_format);
+
+void
+hub_unsubscribe(struct hub *h, struct cmd *cmd);
+
+void
+hub_leave(struct cmd *cmd);
+
+#endif
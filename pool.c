@@ -2,22 +2,38 @@
 #include "worker.h"
 #include "conf.h"
 #include "server.h"
+#include "script.h"
+#include "cache.h"
+#include "cmd.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <event.h>
 #include <hiredis/adapters/libevent.h>
 
+/* successful replies needed to close a half-open circuit breaker */
+#define POOL_BREAKER_PROBES 32
+
 struct pool *
-pool_new(struct worker *w, int count) {
+pool_new(struct worker *w, const char *host, short port, int count) {
 
 	struct pool *p = calloc(1, sizeof(struct pool));
 
+	p->host = host;
+	p->port = port;
 	p->count = count;
 	p->ac = calloc(count, sizeof(redisAsyncContext*));
+	p->pending = calloc(count, sizeof(int));
+	p->rtt = calloc(count, sizeof(long));
+	p->sent = calloc(count, sizeof(unsigned long));
+	p->seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)p;
 
 	p->w = w;
 	p->cfg = w->s->cfg;
+	p->max_pending = p->cfg->pool_max_pending;
+	p->queue_size = p->cfg->pool_queue_size;
 
 	return p;
 }
@@ -31,59 +47,225 @@ pool_free_context(redisAsyncContext *ac) {
 	}
 }
 
-static void
-pool_on_connect(const redisAsyncContext *ac, int status) {
-	struct pool *p = ac->data;
-	int i = 0;
+static int
+pool_connected(struct pool *p) {
 
-	if(!p || status == REDIS_ERR || ac->err) {
-		return;
+	int i, n = 0;
+	for(i = 0; i < p->count; ++i) {
+		n += (p->ac[i] != NULL);
 	}
-	/* connected to redis! */
+	return n;
+}
 
-	/* add to pool */
+/* nothing in flight, waiting or connecting: the pool can be freed */
+int
+pool_is_idle(struct pool *p) {
+
+	int i;
+
+	if(p->connecting || p->queued) {
+		return 0;
+	}
 	for(i = 0; i < p->count; ++i) {
-		if(p->ac[i] == NULL) {
-			p->ac[i] = ac;
-			return;
+		if(p->pending[i]) {
+			return 0;
 		}
 	}
+	return 1;
 }
 
-struct pool_reconnect {
-	struct event ev;
-	struct pool *p;
+void
+pool_free(struct pool *p) {
 
-	struct timeval tv;
-};
+	int i;
+
+	if(p->reconnecting) {
+		evtimer_del(&p->ev_reconnect);
+	}
+	for(i = 0; i < p->count; ++i) {
+		if(p->ac[i]) {
+			redisAsyncContext *ac = (redisAsyncContext *)p->ac[i];
+			ac->data = NULL; /* not reconnected */
+			redisAsyncFree(ac);
+		}
+	}
+	free(p->ac);
+	free(p->pending);
+	free(p->rtt);
+	free(p->sent);
+	free(p);
+}
+
+static void
+pool_set_breaker(struct pool *p, pool_breaker_t state) {
+
+	const char *names[] = {"closed", "open", "half-open"};
+	char msg[256];
+	int sz;
+
+	if(p->breaker == state) {
+		return;
+	}
+	p->breaker = state;
+	p->probes = 0;
+	if(state == POOL_OPEN) {
+		p->trips++;
+	}
+
+	sz = snprintf(msg, sizeof(msg), "Circuit breaker for %s:%d is %s",
+			p->host, p->port, names[state]);
+	slog(p->w->s, state == POOL_OPEN ? WEBDIS_WARNING : WEBDIS_INFO, msg, (size_t)sz);
+	worker_update_ready(p->w);
+}
 
 static void
 pool_can_connect(int fd, short event, void *ptr) {
-	struct pool_reconnect *pr = ptr;
-	struct pool *p = pr->p;
+
+	struct pool *p = ptr;
+	int missing;
 
 	(void)fd;
 	(void)event;
 
-	free(pr);
-
-	pool_connect(p, p->cfg->database, 1);
+	/* refill the pool, one timer for all the missing connections */
+	p->reconnecting = 0;
+	missing = p->count - pool_connected(p) - p->connecting;
+	while(missing-- > 0) {
+		pool_connect(p, p->database, 1);
+	}
 }
+
+/**
+ * Reconnect after min_ms * 2^failures, capped to max_ms. Half of the delay
+ * is random so that the pools of all the workers don't retry in lockstep.
+ */
 static void
 pool_schedule_reconnect(struct pool *p) {
 
-	struct pool_reconnect *pr = malloc(sizeof(struct pool_reconnect));
-	pr->p = p;
+	struct timeval tv;
+	long delay = p->cfg->reconnect_min_ms;
+	int i;
+
+	if(p->reconnecting) {
+		return;
+	}
+	for(i = 0; i < p->failures && delay < p->cfg->reconnect_max_ms; ++i) {
+		delay *= 2;
+	}
+	if(delay > p->cfg->reconnect_max_ms) {
+		delay = p->cfg->reconnect_max_ms;
+	}
+	delay = delay / 2 + rand_r(&p->seed) % (delay / 2 + 1);
+
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+
+	p->reconnecting = 1;
+	evtimer_set(&p->ev_reconnect, pool_can_connect, p);
+	event_base_set(p->w->base, &p->ev_reconnect);
+	evtimer_add(&p->ev_reconnect, &tv);
+}
+
+/* a connection attempt failed, or a connection was lost */
+static void
+pool_on_failure(struct pool *p, int connect_failed) {
+
+	if(connect_failed) {
+		p->failures++;
+	}
+
+	/* open the breaker when Redis can't be reached anymore */
+	if(!pool_connected(p) && (p->breaker == POOL_HALF_OPEN
+			|| p->failures >= p->cfg->breaker_failures)) {
+		pool_set_breaker(p, POOL_OPEN);
+	}
+	pool_schedule_reconnect(p);
+}
+
+static void
+pool_on_connect(const redisAsyncContext *ac, int status) {
+	struct pool *p = ac->data;
+
+	if(!p) {
+		return;
+	}
+
+	if(status == REDIS_ERR || ac->err) {
+		/* hiredis doesn't call pool_on_disconnect in this case */
+		p->connecting--;
+		pool_on_failure(p, 1);
+	}
+	/* connected, but only used once AUTH and SELECT have been processed */
+}
+
+/* reply to AUTH or SELECT */
+static void
+pool_on_setup(redisAsyncContext *ac, void *r, void *privdata) {
+
+	redisReply *reply = r;
+	struct pool *p = privdata;
+	char msg[256];
+	int sz;
 
-	pr->tv.tv_sec = 0;
-	pr->tv.tv_usec = 100*1000; /* 0.1 sec*/
+	if(reply && reply->type == REDIS_REPLY_ERROR) {
+		sz = snprintf(msg, sizeof(msg), "Connection setup failed on %s:%d: %s",
+				p->host, p->port, reply->str);
+		slog(p->w->s, WEBDIS_ERROR, msg, (size_t)sz);
 
-	evtimer_set(&pr->ev, pool_can_connect, pr);
-	event_base_set(p->w->base, &pr->ev);
-	evtimer_add(&pr->ev, &pr->tv);
+		/* not pooled: PING gets a NULL reply, see pool_on_ready */
+		pool_on_failure(p, 1);
+		redisAsyncFree(ac);
+	}
 }
 
+/* reply to the PING sent after AUTH and SELECT: the connection can be used */
+static void
+pool_on_ready(redisAsyncContext *ac, void *r, void *privdata) {
+
+	redisReply *reply = r;
+	struct pool *p = privdata;
+	int i = 0;
+
+	if(!reply) { /* disconnected, see pool_on_disconnect */
+		return;
+	}
+	if(reply->type == REDIS_REPLY_ERROR) { /* e.g. NOAUTH */
+		pool_on_failure(p, 1);
+		redisAsyncFree(ac);
+		return;
+	}
+	p->connecting--;
+
+	/* connected to redis! */
+	p->failures = 0;
+	if(p->breaker == POOL_OPEN) { /* let a few commands through */
+		pool_set_breaker(p, POOL_HALF_OPEN);
+	}
+
+	/* Redis might have restarted and lost its script cache. */
+	if(p->cfg->script_cache) {
+		script_flush();
+	}
+
+	/* add to pool */
+	for(i = 0; i < p->count; ++i) {
+		if(p->ac[i] == NULL) {
+			p->ac[i] = ac;
+			p->pending[i] = 0;
+			p->rtt[i] = 0;
+			if(p->w->cache) {
+				cache_on_pool_connect(p->w->cache, ac);
+			}
+			worker_update_ready(p->w);
+			pool_dispatch(p); /* new room for queued commands */
+			return;
+		}
+	}
 
+	/* the pool is already full */
+	ac->data = NULL;
+	redisAsyncFree(ac);
+}
 
 static void
 pool_on_disconnect(const redisAsyncContext *ac, int status) {
@@ -102,12 +284,21 @@ pool_on_disconnect(const redisAsyncContext *ac, int status) {
 	for(i = 0; i < p->count; ++i) {
 		if(p->ac[i] == ac) {
 			p->ac[i] = NULL;
+			p->pending[i] = 0;
 			break;
 		}
 	}
+	if(i == p->count) { /* lost before it was ready */
+		p->connecting--;
+	} else {
+		worker_update_ready(p->w);
+	}
+	if(p->w->cache) {
+		cache_on_pool_disconnect(p->w->cache, ac);
+	}
 
 	/* schedule reconnect */
-	pool_schedule_reconnect(p);
+	pool_on_failure(p, 0);
 }
 
 /**
@@ -117,14 +308,15 @@ redisAsyncContext *
 pool_connect(struct pool *p, int db_num, int attach) {
 
 	struct redisAsyncContext *ac;
-	if(p->cfg->redis_host[0] == '/') { /* unix socket */
-		ac = redisAsyncConnectUnix(p->cfg->redis_host);
+	if(p->host[0] == '/') { /* unix socket */
+		ac = redisAsyncConnectUnix(p->host);
 	} else {
-		ac = redisAsyncConnect(p->cfg->redis_host, p->cfg->redis_port);
+		ac = redisAsyncConnect(p->host, p->port);
 	}
 
 	if(attach) {
 		ac->data = p;
+		p->database = db_num;
 	} else {
 		ac->data = NULL;
 	}
@@ -139,37 +331,217 @@ pool_connect(struct pool *p, int db_num, int attach) {
 			free(err);
 		}
 		redisAsyncFree(ac);
-		pool_schedule_reconnect(p);
+		if(attach) {
+			pool_on_failure(p, 1);
+		}
 		return NULL;
 	}
+	if(attach) {
+		p->connecting++;
+	}
+
+	/* larger replies are an error, and the connection is closed */
+	ac->c.reader->maxreply = p->w->s->cfg->max_reply_size;
 
 	redisLibeventAttach(ac, p->w->base);
 	redisAsyncSetConnectCallback(ac, pool_on_connect);
 	redisAsyncSetDisconnectCallback(ac, pool_on_disconnect);
 
 	if(p->cfg->redis_auth) { /* authenticate. */
-		redisAsyncCommand(ac, NULL, NULL, "AUTH %s", p->cfg->redis_auth);
+		redisAsyncCommand(ac, attach ? pool_on_setup : NULL, p, "AUTH %s", p->cfg->redis_auth);
 	}
 	if(db_num) { /* change database. */
-		redisAsyncCommand(ac, NULL, NULL, "SELECT %d", db_num);
+		redisAsyncCommand(ac, attach ? pool_on_setup : NULL, p, "SELECT %d", db_num);
+	}
+	if(attach) { /* pooled once the commands above have been processed */
+		redisAsyncCommand(ac, pool_on_ready, p, "PING");
 	}
 	return ac;
 }
 
+/**
+ * A pool is ready once ready_ratio of its connections can be used.
+ */
+int
+pool_is_ready(struct pool *p) {
+
+	int needed = (int)(p->cfg->ready_ratio * p->count + 0.999);
+
+	if(needed < 1) {
+		needed = 1;
+	} else if(needed > p->count) {
+		needed = p->count;
+	}
+	return p->breaker != POOL_OPEN && pool_connected(p) >= needed;
+}
+
+static int
+pool_slot(struct pool *p, const redisAsyncContext *ac) {
+
+	int i;
+	for(i = 0; i < p->count; ++i) {
+		if(p->ac[i] == ac) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* can this connection take one more command? */
+static int
+pool_has_room(struct pool *p, int i) {
+
+	return p->ac[i] != NULL &&
+		(p->max_pending <= 0 || p->pending[i] < p->max_pending);
+}
+
+/**
+ * Pick a connection: by default the one with the fewest commands in flight,
+ * so that a slow command (KEYS, a big LRANGE...) doesn't hold back the
+ * requests sent after it. Connections with max_pending commands in
+ * flight are skipped; NULL is returned if none can be used.
+ */
 const redisAsyncContext *
 pool_get_context(struct pool *p) {
 
-	int orig = p->cur++;
+	int i, best = -1, in_flight = 0;
+
+	/* circuit breaker: nothing goes through while open, and while
+	 * half-open one more command is allowed in flight for each reply */
+	if(p->breaker == POOL_OPEN) {
+		return NULL;
+	} else if(p->breaker == POOL_HALF_OPEN) {
+		for(i = 0; i < p->count; ++i) {
+			in_flight += p->pending[i];
+		}
+		if(in_flight > p->probes) {
+			return NULL;
+		}
+	}
+
+	if(p->cfg->pool_selection == POOL_ROUND_ROBIN) {
+		for(i = 0; i < p->count; ++i) {
+			p->cur = (p->cur + 1) % p->count;
+			if(pool_has_room(p, p->cur)) {
+				return p->ac[p->cur];
+			}
+		}
+		return NULL;
+	}
+
+	if(p->cfg->pool_selection == POOL_TWO_CHOICES && p->count > 1) {
+		/* the least busy of two random connections */
+		int a = rand_r(&p->seed) % p->count;
+		int b = (a + 1 + rand_r(&p->seed) % (p->count - 1)) % p->count;
+		if(pool_has_room(p, b) && (!pool_has_room(p, a) || p->pending[b] < p->pending[a])) {
+			a = b;
+		}
+		if(pool_has_room(p, a)) {
+			return p->ac[a];
+		}
+		/* both are full, look at all of them */
+	}
 
-	do {
-		p->cur++;
-		p->cur %= p->count;
-		if(p->ac[p->cur] != NULL) {
-			return p->ac[p->cur];
+	/* start after the last connection used, to break ties */
+	for(i = 0; i < p->count; ++i) {
+		int n = (p->cur + 1 + i) % p->count;
+		if(pool_has_room(p, n) && (best < 0 || p->pending[n] < p->pending[best])) {
+			best = n;
 		}
-	} while(p->cur != orig);
+	}
+
+	if(best < 0) {
+		return NULL;
+	}
+	p->cur = best;
+	return p->ac[best];
+}
+
+void
+pool_on_send(const redisAsyncContext *ac) {
+
+	struct pool *p = ac->data;
+	int i;
+
+	if(p && (i = pool_slot(p, ac)) >= 0) {
+		p->pending[i]++;
+		p->sent[i]++;
+	}
+}
+
+void
+pool_on_reply(const redisAsyncContext *ac, int ok, const struct timeval *sent_at) {
+
+	struct pool *p = ac->data;
+	struct timeval now;
+	long sample;
+	int i;
+
+	if(!p || (i = pool_slot(p, ac)) < 0 || p->pending[i] == 0) {
+		return; /* reconnected since */
+	}
+	p->pending[i]--;
 
-	return NULL;
+	gettimeofday(&now, NULL);
+	sample = (now.tv_sec - sent_at->tv_sec) * 1000000 + (now.tv_usec - sent_at->tv_usec);
+	if(p->rtt[i]) {
+		p->rtt[i] += (sample - p->rtt[i]) / 8;
+	} else {
+		p->rtt[i] = sample;
+	}
+
+	if(ok && p->breaker == POOL_HALF_OPEN && ++p->probes >= POOL_BREAKER_PROBES) {
+		pool_set_breaker(p, POOL_CLOSED);
+	}
+}
+
+/**
+ * All the connections are full: wait for one of them to reply, unless too
+ * many commands are already waiting.
+ */
+int
+pool_enqueue(struct pool *p, struct cmd *cmd) {
+
+	if(!pool_connected(p) || p->breaker == POOL_OPEN) {
+		return 0;
+	}
+	if(p->queued >= p->queue_size) {
+		p->shed++;
+		return 0;
+	}
 
+	cmd->next_queued = NULL;
+	if(p->queue_tail) {
+		p->queue_tail->next_queued = cmd;
+	} else {
+		p->queue_head = cmd;
+	}
+	p->queue_tail = cmd;
+	p->queued++;
+	return 1;
 }
 
+/* send queued commands, as long as there is room for them */
+void
+pool_dispatch(struct pool *p) {
+
+	const redisAsyncContext *ac;
+
+	while(p->queue_head && (ac = pool_get_context(p))) {
+		struct cmd *cmd = p->queue_head;
+
+		p->queue_head = cmd->next_queued;
+		if(!p->queue_head) {
+			p->queue_tail = NULL;
+		}
+		p->queued--;
+
+		cmd->next_queued = NULL;
+		if(cmd->abandoned && !cmd->waiters) { /* nobody to reply to */
+			cmd_free(cmd);
+			continue;
+		}
+		cmd->ac = (redisAsyncContext *)ac;
+		cmd_dispatch(cmd, cmd->f_format);
+	}
+}
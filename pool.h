@@ -1,33 +1,91 @@
 #ifndef POOL_H
 #define POOL_H
 
+#include <sys/time.h>
+#include <event.h>
 #include <hiredis/async.h>
 
 struct conf;
 struct worker;
+struct cmd;
+
+typedef enum {
+	POOL_CLOSED = 0, /* normal traffic */
+	POOL_OPEN, /* Redis is down: no traffic at all */
+	POOL_HALF_OPEN} pool_breaker_t; /* Redis is back: ramping traffic up */
 
 struct pool {
 
 	struct worker *w;
 	struct conf *cfg;
 
+	/* Redis server */
+	const char *host;
+	short port;
+
 	const redisAsyncContext **ac;
 	int count;
 	int cur;
 
+	/* for each connection: commands in flight, smoothed RTT in usec */
+	int *pending;
+	long *rtt;
+	unsigned long *sent;
+	unsigned int seed;
+
+	/* commands waiting for a connection below max_pending */
+	int max_pending; /* 0 for no limit */
+	int queue_size;
+	struct cmd *queue_head;
+	struct cmd *queue_tail;
+	int queued;
+	unsigned long shed;
+
+	/* reconnections, with exponential backoff */
+	int database;
+	int connecting;
+	int failures; /* consecutive failed connection attempts */
+	int reconnecting; /* ev_reconnect is armed */
+	struct event ev_reconnect;
+
+	/* circuit breaker */
+	pool_breaker_t breaker;
+	int probes; /* successful replies while half-open */
+	unsigned long trips;
 };
 
 
 struct pool *
-pool_new(struct worker *w, int count);
+pool_new(struct worker *w, const char *host, short port, int count);
 
 void
 pool_free_context(redisAsyncContext *ac);
 
+int
+pool_is_idle(struct pool *p);
+
+void
+pool_free(struct pool *p);
+
 redisAsyncContext *
 pool_connect(struct pool *p, int db_num, int attach);
 
 const redisAsyncContext *
 pool_get_context(struct pool *p);
 
+int
+pool_is_ready(struct pool *p);
+
+void
+pool_on_send(const redisAsyncContext *ac);
+
+void
+pool_on_reply(const redisAsyncContext *ac, int ok, const struct timeval *sent_at);
+
+int
+pool_enqueue(struct pool *p, struct cmd *cmd);
+
+void
+pool_dispatch(struct pool *p);
+
 #endif
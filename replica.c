@@ -0,0 +1,221 @@
+#include "replica.h"
+#include "pool.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "cmd.h"
+#include "slog.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Read-only commands can be sent to replicas instead of the primary.
+ * Each replica has its own pool in every worker, and is checked every
+ * second with INFO replication: replicas that lost their link to the
+ * primary or lag behind are skipped until they catch up. A replica lags
+ * when its offset in the replication stream is too far behind the
+ * primary's, read from the primary at the same time.
+ */
+
+#define REPLICA_CHECK_INTERVAL 1 /* seconds */
+
+struct replicas *
+replicas_new(struct worker *w) {
+
+	struct conf *cfg = w->s->cfg;
+	struct replicas *rs = calloc(1, sizeof(struct replicas));
+	int i;
+
+	rs->w = w;
+	rs->primary_offset = -1;
+	rs->count = cfg->replica_count;
+	rs->r = calloc(rs->count, sizeof(struct replica));
+
+	for(i = 0; i < rs->count; ++i) {
+		rs->r[i].rs = rs;
+		rs->r[i].lag = -1;
+		rs->r[i].behind = -1;
+		rs->r[i].pool = pool_new(w, cfg->replicas[i].host, cfg->replicas[i].port,
+				cfg->pool_size_per_thread);
+	}
+
+	return rs;
+}
+
+static void
+replica_set_health(struct replica *r, int healthy) {
+
+	char msg[256];
+	int sz;
+
+	if(r->healthy == healthy) {
+		return;
+	}
+	r->healthy = healthy;
+
+	sz = snprintf(msg, sizeof(msg), "Replica %s:%d %s", r->pool->host, r->pool->port,
+			healthy ? "is available for reads" : "is lagging or unreachable, skipped");
+	slog(r->rs->w->s, healthy ? WEBDIS_INFO : WEBDIS_WARNING, msg, (size_t)sz);
+}
+
+/* value of a numeric INFO field, or -1 */
+static long long
+replica_info_field(const char *info, const char *field) {
+
+	const char *p = strstr(info, field);
+
+	return p ? strtoll(p + strlen(field), NULL, 10) : -1;
+}
+
+static void
+replica_on_primary_info(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct replicas *rs = privdata;
+	redisReply *reply = r;
+
+	(void)ac;
+	rs->checking_primary = 0;
+	rs->primary_offset = (reply && reply->type == REDIS_REPLY_STRING)
+		? replica_info_field(reply->str, "master_repl_offset:") : -1;
+}
+
+static void
+replica_on_info(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct replica *rep = privdata;
+	redisReply *reply = r;
+	const char *link;
+	long long offset, max_bytes = rep->rs->w->s->cfg->replica_max_lag_bytes;
+	int max_lag = rep->rs->w->s->cfg->replica_max_lag;
+
+	(void)ac;
+	rep->checking = 0;
+
+	if(!reply || reply->type != REDIS_REPLY_STRING) {
+		replica_set_health(rep, 0);
+		return;
+	}
+
+	/* the link to the primary must be up, with recent traffic: an idle
+	 * primary only pings its replicas every repl-ping-replica-period (10s) */
+	link = strstr(reply->str, "master_link_status:up");
+	rep->lag = replica_info_field(reply->str, "master_last_io_seconds_ago:");
+
+	/* a connected replica can still be far behind, e.g. after a burst of writes */
+	offset = replica_info_field(reply->str, "slave_repl_offset:");
+	if(offset >= 0 && rep->rs->primary_offset >= 0) {
+		rep->behind = rep->rs->primary_offset > offset ? rep->rs->primary_offset - offset : 0;
+	} else {
+		rep->behind = -1;
+	}
+
+	replica_set_health(rep, link && rep->lag >= 0 && rep->lag <= max_lag
+			&& (!max_bytes || rep->behind < 0 || rep->behind <= max_bytes));
+}
+
+static void
+replicas_check(int fd, short event, void *ptr) {
+
+	struct replicas *rs = ptr;
+	struct timeval tv = {REPLICA_CHECK_INTERVAL, 0};
+	int i;
+
+	(void)fd;
+	(void)event;
+
+	/* the primary's offset: replicas are compared to the latest one known */
+	if(!rs->checking_primary) {
+		redisAsyncContext *ac = (redisAsyncContext *)pool_get_context(rs->w->pool);
+		if(ac) {
+			rs->checking_primary = 1;
+			redisAsyncCommand(ac, replica_on_primary_info, rs, "INFO replication");
+		} else {
+			rs->primary_offset = -1;
+		}
+	}
+
+	for(i = 0; i < rs->count; ++i) {
+		struct replica *r = &rs->r[i];
+		redisAsyncContext *ac = (redisAsyncContext *)pool_get_context(r->pool);
+
+		if(!ac || r->checking) { /* no connection, or too slow to reply */
+			replica_set_health(r, 0);
+		}
+		if(ac && !r->checking) {
+			r->checking = 1;
+			redisAsyncCommand(ac, replica_on_info, r, "INFO replication");
+		}
+	}
+
+	evtimer_add(&rs->ev_check, &tv);
+}
+
+void
+replicas_start(struct replicas *rs) {
+
+	int i, j;
+	struct timeval tv = {0, 0};
+
+	for(i = 0; i < rs->count; ++i) {
+		for(j = 0; j < rs->r[i].pool->count; ++j) {
+			pool_connect(rs->r[i].pool, rs->w->s->cfg->database, 1);
+		}
+	}
+
+	/* replicas are only used once they have been checked */
+	evtimer_set(&rs->ev_check, replicas_check, rs);
+	event_base_set(rs->w->base, &rs->ev_check);
+	evtimer_add(&rs->ev_check, &tv);
+}
+
+/**
+ * Pick a healthy replica, or return NULL to use the primary.
+ */
+const redisAsyncContext *
+replicas_get_context(struct replicas *rs, struct cmd *cmd) {
+
+	struct replica *best = NULL;
+	const redisAsyncContext *ac = NULL;
+	int i;
+
+	/* start after the last replica used, to break ties */
+	rs->cur = (rs->cur + 1) % rs->count;
+	for(i = 0; i < rs->count; ++i) {
+		struct replica *r = &rs->r[(rs->cur + i) % rs->count];
+		const redisAsyncContext *r_ac;
+
+		if(!r->healthy || (best && r->outstanding >= best->outstanding)) {
+			continue;
+		}
+		if(!(r_ac = pool_get_context(r->pool))) {
+			continue;
+		}
+		best = r;
+		ac = r_ac;
+		if(rs->w->s->cfg->replica_round_robin) {
+			break;
+		}
+	}
+
+	if(!best) {
+		rs->fallbacks++;
+		return NULL;
+	}
+
+	best->outstanding++;
+	best->reads++;
+	cmd->replica = best;
+	return ac;
+}
+
+void
+replicas_done(struct cmd *cmd) {
+
+	if(cmd->replica) {
+		cmd->replica->outstanding--;
+		cmd->replica = NULL;
+	}
+}
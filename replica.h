@@ -0,0 +1,52 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <event.h>
+#include <hiredis/async.h>
+
+struct worker;
+struct pool;
+struct cmd;
+struct replicas;
+
+struct replica {
+	struct replicas *rs;
+	struct pool *pool;
+
+	int healthy;
+	int checking; /* INFO sent, no reply yet */
+	long lag; /* seconds since the last interaction with the primary */
+	long long behind; /* bytes of replication stream not applied yet, -1 if unknown */
+
+	unsigned long outstanding; /* commands sent, not freed yet */
+	unsigned long reads;
+};
+
+struct replicas {
+	struct worker *w;
+
+	struct replica *r;
+	int count;
+	int cur;
+
+	struct event ev_check;
+	long long primary_offset; /* from the primary's INFO, -1 if unknown */
+	int checking_primary;
+
+	/* reads sent to the primary because no replica was available */
+	unsigned long fallbacks;
+};
+
+struct replicas *
+replicas_new(struct worker *w);
+
+void
+replicas_start(struct replicas *rs);
+
+const redisAsyncContext *
+replicas_get_context(struct replicas *rs, struct cmd *cmd);
+
+void
+replicas_done(struct cmd *cmd);
+
+#endif
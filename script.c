@@ -0,0 +1,172 @@
+#include "script.h"
+#include "cmd.h"
+#include "sha1/sha1.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+/**
+ * EVAL scripts are sent as EVALSHA once we know that Redis has them in its
+ * script cache. The table of known scripts is shared by all the workers;
+ * it is direct-mapped so a collision only costs an extra EVAL.
+ */
+
+#define SCRIPT_TABLE_SIZE 1024
+
+struct script_entry {
+	int used;
+	char sha[40];
+};
+
+static struct script_entry script_table[SCRIPT_TABLE_SIZE];
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct script_call {
+	struct cmd *cmd;
+	formatting_fun f_format;
+
+	char sha[41];
+	int sent_evalsha;
+};
+
+static unsigned int
+script_slot(const char *sha) {
+
+	unsigned int h;
+	sscanf(sha, "%8x", &h);
+	return h % SCRIPT_TABLE_SIZE;
+}
+
+static int
+script_known(const char *sha) {
+
+	int ret;
+	struct script_entry *e = &script_table[script_slot(sha)];
+
+	pthread_mutex_lock(&script_lock);
+	ret = e->used && memcmp(e->sha, sha, 40) == 0;
+	pthread_mutex_unlock(&script_lock);
+
+	return ret;
+}
+
+static void
+script_set_known(const char *sha, int known) {
+
+	struct script_entry *e = &script_table[script_slot(sha)];
+
+	pthread_mutex_lock(&script_lock);
+	if(known) {
+		e->used = 1;
+		memcpy(e->sha, sha, 40);
+	} else if(e->used && memcmp(e->sha, sha, 40) == 0) {
+		e->used = 0;
+	}
+	pthread_mutex_unlock(&script_lock);
+}
+
+/* forget all the scripts, e.g. after SCRIPT FLUSH or a Redis restart. */
+void
+script_flush(void) {
+
+	pthread_mutex_lock(&script_lock);
+	memset(script_table, 0, sizeof(script_table));
+	pthread_mutex_unlock(&script_lock);
+}
+
+int
+script_is_eval(struct cmd *cmd) {
+
+	return (cmd->count >= 3 && cmd->argv_len[0] == 4 &&
+		strncasecmp(cmd->argv[0], "EVAL", 4) == 0);
+}
+
+void
+script_check_flush(struct cmd *cmd) {
+
+	if(cmd->count >= 2 && cmd->argv_len[0] == 6 && cmd->argv_len[1] == 5 &&
+		strncasecmp(cmd->argv[0], "SCRIPT", 6) == 0 &&
+		strncasecmp(cmd->argv[1], "FLUSH", 5) == 0) {
+		script_flush();
+	}
+}
+
+static void
+script_on_reply(redisAsyncContext *ac, void *r, void *privdata);
+
+static void
+script_send_call(struct script_call *sc, int evalsha) {
+
+	struct cmd *cmd = sc->cmd;
+	const char **argv = (const char **)cmd->argv;
+	size_t *argv_len = cmd->argv_len;
+
+	sc->sent_evalsha = evalsha;
+	if(evalsha) { /* same arguments, with the SHA instead of the body */
+		argv = malloc(cmd->count * sizeof(char*));
+		argv_len = malloc(cmd->count * sizeof(size_t));
+		memcpy(argv, cmd->argv, cmd->count * sizeof(char*));
+		memcpy(argv_len, cmd->argv_len, cmd->count * sizeof(size_t));
+
+		argv[0] = "EVALSHA";
+		argv_len[0] = 7;
+		argv[1] = sc->sha;
+		argv_len[1] = 40;
+	}
+
+	redisAsyncCommandArgv(cmd->ac, script_on_reply, sc, cmd->count,
+		argv, argv_len);
+
+	if(evalsha) {
+		free(argv);
+		free(argv_len);
+	}
+}
+
+static void
+script_on_reply(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct script_call *sc = privdata;
+	redisReply *reply = r;
+
+	if(reply && reply->type == REDIS_REPLY_ERROR) {
+		if(sc->sent_evalsha && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+			/* the script cache was flushed behind our back: retry with EVAL */
+			script_set_known(sc->sha, 0);
+			script_send_call(sc, 0);
+			return;
+		}
+	} else if(reply && !sc->sent_evalsha) { /* EVAL has loaded the script */
+		script_set_known(sc->sha, 1);
+	}
+
+	sc->f_format(ac, r, sc->cmd);
+	free(sc);
+}
+
+/**
+ * Send an EVAL command, replacing it with EVALSHA if we can.
+ */
+void
+script_send(struct cmd *cmd, formatting_fun f_format) {
+
+	int i;
+	SHA1Context ctx;
+	struct script_call *sc = calloc(1, sizeof(struct script_call));
+
+	sc->cmd = cmd;
+	sc->f_format = f_format;
+
+	SHA1Reset(&ctx);
+	SHA1Input(&ctx, (const unsigned char *)cmd->argv[1], cmd->argv_len[1]);
+	SHA1Result(&ctx);
+	for(i = 0; i < 5; ++i) {
+		sprintf(sc->sha + 8*i, "%08x", ctx.Message_Digest[i]);
+	}
+
+	script_send_call(sc, script_known(sc->sha));
+}
@@ -0,0 +1,18 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "cmd.h"
+
+int
+script_is_eval(struct cmd *cmd);
+
+void
+script_send(struct cmd *cmd, formatting_fun f_format);
+
+void
+script_check_flush(struct cmd *cmd);
+
+void
+script_flush(void);
+
+#endif
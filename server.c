@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 /**
  * Sets up a non-blocking socket
@@ -185,6 +186,43 @@ server_install_signal_handlers(struct server *s) {
 	signal(SIGINT,  server_handle_signal);
 }
 
+/**
+ * Ready when every worker has enough usable connections to Redis,
+ * and to each shard. Used by /_ready.
+ */
+int
+server_is_ready(struct server *s) {
+
+	int i;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		if(!worker_is_ready(s->w[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* let the workers connect to Redis before accepting clients */
+static void
+server_wait_ready(struct server *s) {
+
+	struct timeval start, now;
+	long elapsed = 0;
+
+	gettimeofday(&start, NULL);
+	while(!server_is_ready(s)) {
+		if(elapsed >= s->cfg->ready_timeout_ms) {
+			slog(s, WEBDIS_WARNING, "Redis connections not ready, starting anyway", 0);
+			return;
+		}
+		usleep(10*1000);
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+	}
+}
+
 int
 server_start(struct server *s) {
 
@@ -216,6 +254,7 @@ server_start(struct server *s) {
 	for(i = 0; i < s->cfg->http_threads; ++i) {
 		worker_start(s->w[i]);
 	}
+	server_wait_ready(s);
 
 	/* create socket */
 	s->fd = socket_setup(s, s->cfg->http_host, s->cfg->http_port);
@@ -33,5 +33,8 @@ server_new(const char *cfg_file);
 int
 server_start(struct server *s);
 
+int
+server_is_ready(struct server *s);
+
 #endif
 
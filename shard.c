@@ -0,0 +1,511 @@
+#include "shard.h"
+#include "cmd.h"
+#include "pool.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "formats/common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * Sharding across independent Redis servers: keys are assigned to a shard
+ * with a jump consistent hash of their {hash tag}, so that adding a shard
+ * only moves 1/n of the keys. Multi-key commands are split when their
+ * replies can be merged, and rejected if their keys live on different
+ * shards otherwise.
+ */
+
+typedef enum {
+	SHARD_SINGLE,		/* all the keys must be on the same shard */
+	SHARD_MERGE_ARRAY,	/* one element per key, e.g. MGET */
+	SHARD_MERGE_SUM,	/* number of keys, e.g. DEL */
+	SHARD_MERGE_STATUS	/* OK, e.g. MSET */
+} shard_merge_t;
+
+struct shard_keys {
+	const char *name;
+	int first;
+	int last; /* negative values count from the end */
+	int step;
+	shard_merge_t merge;
+};
+
+static const struct shard_keys multikey_commands[] = {
+	{"MGET", 1, -1, 1, SHARD_MERGE_ARRAY},
+	{"DEL", 1, -1, 1, SHARD_MERGE_SUM},
+	{"UNLINK", 1, -1, 1, SHARD_MERGE_SUM},
+	{"EXISTS", 1, -1, 1, SHARD_MERGE_SUM},
+	{"TOUCH", 1, -1, 1, SHARD_MERGE_SUM},
+	{"MSET", 1, -1, 2, SHARD_MERGE_STATUS},
+	{"MSETNX", 1, -1, 2, SHARD_SINGLE},
+
+	{"SINTER", 1, -1, 1, SHARD_SINGLE}, {"SUNION", 1, -1, 1, SHARD_SINGLE},
+	{"SDIFF", 1, -1, 1, SHARD_SINGLE}, {"SINTERSTORE", 1, -1, 1, SHARD_SINGLE},
+	{"SUNIONSTORE", 1, -1, 1, SHARD_SINGLE}, {"SDIFFSTORE", 1, -1, 1, SHARD_SINGLE},
+	{"PFCOUNT", 1, -1, 1, SHARD_SINGLE}, {"PFMERGE", 1, -1, 1, SHARD_SINGLE},
+	{"WATCH", 1, -1, 1, SHARD_SINGLE}, {"BITOP", 2, -1, 1, SHARD_SINGLE},
+	{"RENAME", 1, 2, 1, SHARD_SINGLE}, {"RENAMENX", 1, 2, 1, SHARD_SINGLE},
+	{"RPOPLPUSH", 1, 2, 1, SHARD_SINGLE}, {"BRPOPLPUSH", 1, 2, 1, SHARD_SINGLE},
+	{"LMOVE", 1, 2, 1, SHARD_SINGLE}, {"BLMOVE", 1, 2, 1, SHARD_SINGLE},
+	{"SMOVE", 1, 2, 1, SHARD_SINGLE}, {"COPY", 1, 2, 1, SHARD_SINGLE},
+	{"ZRANGESTORE", 1, 2, 1, SHARD_SINGLE}, {"GEOSEARCHSTORE", 1, 2, 1, SHARD_SINGLE},
+	{"BLPOP", 1, -2, 1, SHARD_SINGLE}, {"BRPOP", 1, -2, 1, SHARD_SINGLE},
+	{"BZPOPMIN", 1, -2, 1, SHARD_SINGLE}, {"BZPOPMAX", 1, -2, 1, SHARD_SINGLE}
+};
+
+/* commands without a key that any server can answer. */
+static const char *keyless_commands[] = {
+	"PING", "ECHO", "TIME", "INFO", "PUBLISH"
+};
+
+struct shard_part {
+	struct shard_scatter *sc;
+	struct cmd *cmd; /* sent to the shard, or queued on its pool */
+
+	int *pos; /* position of each key in the original command */
+	int keys;
+
+	redisReply *reply;
+};
+
+struct shard_scatter {
+	struct shards *sh;
+	struct cmd *cmd;
+	formatting_fun f_format;
+	shard_merge_t merge;
+
+	int keys;
+	struct shard_part *parts; /* one per shard */
+	int pending;
+	int failed;
+};
+
+struct shards *
+shards_new(struct worker *w) {
+
+	struct conf *cfg = w->s->cfg;
+	struct shards *sh = calloc(1, sizeof(struct shards));
+	int i;
+
+	sh->w = w;
+	sh->count = cfg->shard_count;
+	sh->pools = calloc(sh->count, sizeof(struct pool *));
+	for(i = 0; i < sh->count; ++i) {
+		sh->pools[i] = pool_new(w, cfg->shards[i].host, cfg->shards[i].port,
+				cfg->pool_size_per_thread);
+	}
+
+	return sh;
+}
+
+void
+shards_start(struct shards *sh) {
+
+	int i, j;
+
+	for(i = 0; i < sh->count; ++i) {
+		for(j = 0; j < sh->pools[i]->count; ++j) {
+			pool_connect(sh->pools[i], sh->w->s->cfg->database, 1);
+		}
+	}
+}
+
+/* Lamping & Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm" */
+static int
+shard_jump_hash(unsigned long long key, int buckets) {
+
+	long long b = -1, j = 0;
+
+	while(j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (long long)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+	return (int)b;
+}
+
+static int
+shard_for_key(struct shards *sh, const char *key, size_t sz) {
+
+	/* FNV-1a, 64 bits */
+	unsigned long long h = 14695981039346656037ULL;
+	size_t i;
+
+	key = cmd_key_tag(key, &sz);
+	for(i = 0; i < sz; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return shard_jump_hash(h, sh->count);
+}
+
+struct pool *
+shards_pool_for_key(struct shards *sh, const char *key, size_t sz) {
+
+	return sh->pools[shard_for_key(sh, key, sz)];
+}
+
+static int
+shard_name_is(struct cmd *cmd, const char *name) {
+
+	return strlen(name) == cmd->argv_len[0]
+		&& strncasecmp(name, cmd->argv[0], cmd->argv_len[0]) == 0;
+}
+
+static int
+shard_numkeys(struct cmd *cmd, int i) {
+
+	char buf[12];
+	size_t sz;
+
+	if(i >= cmd->count) {
+		return 0;
+	}
+	sz = cmd->argv_len[i] < sizeof(buf) - 1 ? cmd->argv_len[i] : sizeof(buf) - 1;
+	memcpy(buf, cmd->argv[i], sz);
+	buf[sz] = 0;
+	return atoi(buf);
+}
+
+/* adds count keys starting at argv[first], for numkeys-style commands. */
+static int
+shard_add_range(struct cmd *cmd, int *keys, int n, int first, int count) {
+
+	int i;
+	for(i = first; i < first + count && i < cmd->count; ++i) {
+		keys[n++] = i;
+	}
+	return n;
+}
+
+/**
+ * Fills keys with the position of all the keys in argv, and returns how many
+ * were found.
+ */
+static int
+shard_key_list(struct cmd *cmd, int *keys, shard_merge_t *merge) {
+
+	unsigned int i;
+	int n = 0, pos;
+
+	*merge = SHARD_SINGLE;
+
+	for(i = 0; i < sizeof(multikey_commands)/sizeof(multikey_commands[0]); ++i) {
+		const struct shard_keys *k = &multikey_commands[i];
+		if(shard_name_is(cmd, k->name)) {
+			int last = k->last < 0 ? cmd->count + k->last : k->last;
+			for(pos = k->first; pos <= last && pos < cmd->count; pos += k->step) {
+				keys[n++] = pos;
+			}
+			*merge = k->merge;
+			return n;
+		}
+	}
+
+	if(shard_name_is(cmd, "EVAL") || shard_name_is(cmd, "EVALSHA")
+			|| shard_name_is(cmd, "EVAL_RO") || shard_name_is(cmd, "EVALSHA_RO")) {
+		return shard_add_range(cmd, keys, 0, 3, shard_numkeys(cmd, 2));
+	} else if(shard_name_is(cmd, "ZUNIONSTORE") || shard_name_is(cmd, "ZINTERSTORE")
+			|| shard_name_is(cmd, "ZDIFFSTORE")) {
+		keys[n++] = 1;
+		return shard_add_range(cmd, keys, n, 3, shard_numkeys(cmd, 2));
+	} else if(shard_name_is(cmd, "ZUNION") || shard_name_is(cmd, "ZINTER")
+			|| shard_name_is(cmd, "ZDIFF") || shard_name_is(cmd, "SINTERCARD")
+			|| shard_name_is(cmd, "ZINTERCARD") || shard_name_is(cmd, "LMPOP")
+			|| shard_name_is(cmd, "ZMPOP")) {
+		return shard_add_range(cmd, keys, 0, 2, shard_numkeys(cmd, 1));
+	} else if(shard_name_is(cmd, "BLMPOP") || shard_name_is(cmd, "BZMPOP")) {
+		return shard_add_range(cmd, keys, 0, 3, shard_numkeys(cmd, 2));
+	} else if(shard_name_is(cmd, "XREAD") || shard_name_is(cmd, "XREADGROUP")) {
+		pos = cmd_key_index(cmd); /* first key after STREAMS, then as many IDs */
+		return pos ? shard_add_range(cmd, keys, 0, pos, (cmd->count - pos) / 2) : 0;
+	}
+
+	if((pos = cmd_key_index(cmd))) {
+		keys[n++] = pos;
+	}
+	return n;
+}
+
+static redisReply *
+shard_reply_dup(const redisReply *r) {
+
+	redisReply *d = calloc(1, sizeof(redisReply));
+	size_t i;
+
+	d->type = r->type;
+	d->integer = r->integer;
+	if(r->str) {
+		d->str = malloc(r->len + 1);
+		memcpy(d->str, r->str, r->len);
+		d->str[r->len] = 0;
+		d->len = r->len;
+	}
+	if(r->type == REDIS_REPLY_ARRAY && r->elements) {
+		d->elements = r->elements;
+		d->element = calloc(r->elements, sizeof(redisReply *));
+		for(i = 0; i < r->elements; ++i) {
+			d->element[i] = shard_reply_dup(r->element[i]);
+		}
+	}
+	return d;
+}
+
+static void
+shard_scatter_free(struct shard_scatter *sc) {
+
+	int i;
+	for(i = 0; i < sc->sh->count; ++i) {
+		struct shard_part *part = &sc->parts[i];
+		if(part->reply) {
+			freeReplyObject(part->reply);
+		}
+		free(part->pos);
+	}
+	free(sc->parts);
+	free(sc);
+}
+
+/* all the parts have replied, send a single reply. */
+static void
+shard_gather(struct shard_scatter *sc, redisAsyncContext *ac) {
+
+	redisReply *merged, *err = NULL;
+	int i, j;
+
+	for(i = 0; i < sc->sh->count && !sc->failed; ++i) {
+		struct shard_part *part = &sc->parts[i];
+		redisReply *r = part->reply;
+
+		if(!part->keys) {
+			continue;
+		}
+		if(!r) {
+			sc->failed = 1;
+		} else if(!err && (r->type == REDIS_REPLY_ERROR
+				|| (sc->merge == SHARD_MERGE_ARRAY
+					&& (r->type != REDIS_REPLY_ARRAY || (int)r->elements != part->keys))
+				|| (sc->merge == SHARD_MERGE_SUM && r->type != REDIS_REPLY_INTEGER))) {
+			err = r; /* returned as-is */
+		}
+	}
+
+	if(sc->cmd->abandoned) { /* timed out, or the client is gone */
+		cmd_free(sc->cmd);
+	} else if(sc->failed) {
+		sc->f_format(ac, NULL, sc->cmd);
+	} else if(err) {
+		sc->f_format(ac, err, sc->cmd);
+	} else {
+		merged = calloc(1, sizeof(redisReply));
+		switch(sc->merge) {
+			case SHARD_MERGE_ARRAY:
+				merged->type = REDIS_REPLY_ARRAY;
+				merged->elements = sc->keys;
+				merged->element = calloc(sc->keys, sizeof(redisReply *));
+				for(i = 0; i < sc->sh->count; ++i) {
+					struct shard_part *part = &sc->parts[i];
+					for(j = 0; j < part->keys; ++j) { /* moved to the merged reply */
+						merged->element[part->pos[j]] = part->reply->element[j];
+						part->reply->element[j] = NULL;
+					}
+				}
+				break;
+
+			case SHARD_MERGE_SUM:
+				merged->type = REDIS_REPLY_INTEGER;
+				for(i = 0; i < sc->sh->count; ++i) {
+					if(sc->parts[i].keys) {
+						merged->integer += sc->parts[i].reply->integer;
+					}
+				}
+				break;
+
+			default:
+				merged->type = REDIS_REPLY_STATUS;
+				merged->str = strdup("OK");
+				merged->len = 2;
+				break;
+		}
+		sc->f_format(ac, merged, sc->cmd);
+		freeReplyObject(merged);
+	}
+
+	shard_scatter_free(sc);
+}
+
+/* the reply of a part, or NULL if it couldn't be sent */
+static void
+shard_on_part(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *cmd = privdata;
+	struct shard_part *part = cmd->shard_part;
+	struct shard_scatter *sc = part->sc;
+
+	/* the reply is freed once we return */
+	if(r) {
+		part->reply = shard_reply_dup(r);
+	} else {
+		sc->failed = 1;
+	}
+	part->cmd = NULL;
+	cmd_free(cmd);
+
+	if(--sc->pending == 0) {
+		shard_gather(sc, ac);
+	}
+}
+
+/* one shard's share of the command, with its own copy of the arguments */
+static struct cmd *
+shard_part_cmd(struct cmd *cmd, int argc) {
+
+	struct cmd *c = cmd_new(argc);
+
+	c->w = cmd->w;
+	c->fd = -1;
+	c->database = cmd->database;
+	c->primary = 1; /* its reply isn't formatted, it can't be shared */
+	c->count = 0;
+	return c;
+}
+
+static void
+shard_part_arg(struct cmd *c, const char *p, size_t sz) {
+
+	c->argv[c->count] = malloc(sz);
+	memcpy(c->argv[c->count], p, sz);
+	c->argv_len[c->count++] = sz;
+}
+
+/**
+ * Each part is sent to its shard like a command of its own: counted
+ * against its connection, or queued while they are all busy.
+ */
+static void
+shard_scatter(struct shards *sh, struct cmd *cmd, formatting_fun f_format,
+		shard_merge_t merge, int *keys, int *key_shard, int n) {
+
+	struct shard_scatter *sc = calloc(1, sizeof(struct shard_scatter));
+	const redisAsyncContext *ac;
+	int i, s, values = (merge == SHARD_MERGE_STATUS) ? 1 : 0; /* MSET */
+
+	sc->sh = sh;
+	sc->cmd = cmd;
+	sc->f_format = f_format;
+	sc->merge = merge;
+	sc->keys = n;
+	sc->parts = calloc(sh->count, sizeof(struct shard_part));
+
+	/* split the arguments */
+	for(i = 0; i < n; ++i) {
+		struct shard_part *part = &sc->parts[key_shard[i]];
+		if(!part->cmd) {
+			part->sc = sc;
+			part->cmd = shard_part_cmd(cmd, 1 + (1 + values) * n);
+			part->cmd->shard_part = part;
+			part->pos = calloc(n, sizeof(int));
+			shard_part_arg(part->cmd, cmd->argv[0], cmd->argv_len[0]);
+		}
+		shard_part_arg(part->cmd, cmd->argv[keys[i]], cmd->argv_len[keys[i]]);
+		if(values && keys[i] + 1 < cmd->count) {
+			shard_part_arg(part->cmd, cmd->argv[keys[i] + 1], cmd->argv_len[keys[i] + 1]);
+		}
+		part->pos[part->keys++] = i;
+	}
+
+	sh->scattered++;
+	sc->pending = 1; /* until they are all sent */
+	for(s = 0; s < sh->count; ++s) {
+		struct cmd *c = sc->parts[s].cmd;
+		if(!c) {
+			continue;
+		}
+		sc->pending++;
+		if((ac = pool_get_context(sh->pools[s]))) {
+			c->ac = (redisAsyncContext *)ac;
+			cmd_send(c, shard_on_part);
+		} else {
+			c->f_format = shard_on_part;
+			if(!pool_enqueue(sh->pools[s], c)) {
+				shard_on_part(NULL, NULL, c);
+			}
+		}
+	}
+	if(--sc->pending == 0) { /* none of them could be sent */
+		shard_gather(sc, NULL);
+	}
+}
+
+/**
+ * A connection from the pool of the server running the command, or from the
+ * one it was queued on. Returns 0 if it has to wait for one, or got a 503.
+ */
+static int
+shard_connect(struct pool *p, struct cmd *cmd, formatting_fun f_format) {
+
+	const redisAsyncContext *ac;
+
+	if(cmd->ac && cmd->ac->data == p) { /* dequeued */
+		return 1;
+	}
+	if((ac = pool_get_context(p))) {
+		cmd->ac = (redisAsyncContext *)ac;
+		return 1;
+	}
+
+	/* all the connections are busy, wait for one of them */
+	cmd->f_format = f_format;
+	if(!pool_enqueue(p, cmd)) {
+		format_send_error(cmd, 503, "Service Unavailable");
+	}
+	return 0;
+}
+
+/**
+ * Picks the shard for the command, before it is sent. Returns 0 if the
+ * command was split across shards, queued, or answered with an error.
+ */
+int
+shards_route(struct shards *sh, struct cmd *cmd, formatting_fun f_format) {
+
+	int *keys = calloc(cmd->count, sizeof(int));
+	int *key_shard = calloc(cmd->count, sizeof(int));
+	int i, n, same = 1, ret = 0;
+	unsigned int k;
+	shard_merge_t merge;
+
+	n = shard_key_list(cmd, keys, &merge);
+	for(i = 0; i < n; ++i) {
+		key_shard[i] = shard_for_key(sh, cmd->argv[keys[i]], cmd->argv_len[keys[i]]);
+		same = same && (key_shard[i] == key_shard[0]);
+	}
+
+	if(n == 0) { /* sent to the first shard if any server can run it */
+		for(k = 0; k < sizeof(keyless_commands)/sizeof(keyless_commands[0]); ++k) {
+			if(shard_name_is(cmd, keyless_commands[k])) {
+				ret = 1;
+			}
+		}
+		if(ret) {
+			ret = shard_connect(sh->pools[0], cmd, f_format);
+		} else {
+			sh->rejected++;
+			format_send_error(cmd, 403, "Forbidden");
+		}
+	} else if(same) {
+		ret = shard_connect(sh->pools[key_shard[0]], cmd, f_format);
+	} else if(merge == SHARD_SINGLE) { /* keys on different shards */
+		sh->rejected++;
+		format_send_error(cmd, 403, "Forbidden");
+	} else {
+		shard_scatter(sh, cmd, f_format, merge, keys, key_shard, n);
+	}
+
+	free(keys);
+	free(key_shard);
+	return ret;
+}
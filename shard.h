@@ -0,0 +1,33 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <hiredis/async.h>
+#include "cmd.h"
+
+struct worker;
+struct pool;
+
+struct shards {
+	struct worker *w;
+
+	struct pool **pools;
+	int count;
+
+	/* counters */
+	unsigned long scattered; /* multi-key commands split across shards */
+	unsigned long rejected;
+};
+
+struct shards *
+shards_new(struct worker *w);
+
+void
+shards_start(struct shards *sh);
+
+struct pool *
+shards_pool_for_key(struct shards *sh, const char *key, size_t sz);
+
+int
+shards_route(struct shards *sh, struct cmd *cmd, formatting_fun f_format);
+
+#endif
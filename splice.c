@@ -0,0 +1,672 @@
+#define _GNU_SOURCE /* splice, pipe2 */
+#include "splice.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "pool.h"
+#include "http.h"
+#include "client.h"
+#include "slog.h"
+#include "formats/custom-type.h"
+#include "formats/common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <event.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * GET of a value with a custom content-type (.bin, .png, .jpg…), on a
+ * connection of its own. The reply is read from the socket directly: a
+ * value of at least "splice_threshold" bytes is not read into memory, its
+ * headers are written to the client and the value itself is moved from
+ * one socket to the other through a pipe, in the kernel. Smaller values
+ * and errors are formatted as usual.
+ */
+
+#define SPLICE_IDLE_MAX 8 /* idle connections kept per worker */
+#define SPLICE_BUSY_MAX 32 /* connections in use per worker, past it GETs go to the pool */
+#define SPLICE_READ_SZ 16384
+#define SPLICE_PIPE_SZ (1024 * 1024)
+
+/* a connection to Redis outside of the pools, AUTH and SELECT done */
+struct splice_conn {
+	int fd;
+	int db;
+	int reused;
+	struct splice_conn *next;
+};
+
+/* one GET */
+struct splice_get {
+	struct splice *sp;
+	struct cmd *cmd;
+	struct splice_conn *conn;
+
+	struct event ev; /* on the Redis socket */
+	struct event ev_client;
+	int ev_set;
+	int ev_client_set;
+
+	/* the request to Redis, then the response headers to the client */
+	char *out;
+	size_t out_sz;
+	size_t out_sent;
+
+	/* read from Redis */
+	char *in;
+	size_t in_sz;
+	size_t in_alloc;
+	int skip; /* AUTH and SELECT replies before the value */
+
+	/* splicing the value */
+	size_t left; /* still in the Redis socket */
+	size_t piped; /* in the pipe */
+	size_t pipe_sz;
+	size_t crlf; /* bytes of the final \r\n still to read */
+	int pipe[2];
+	int started; /* the client has received part of the response */
+};
+
+struct splice *
+splice_new(struct worker *w) {
+
+	struct splice *sp = calloc(1, sizeof(struct splice));
+
+	sp->w = w;
+	sp->threshold = w->s->cfg->splice_threshold;
+	return sp;
+}
+
+static struct splice_conn *
+splice_open(struct splice *sp, int db) {
+
+	struct pool *p = sp->w->pool;
+	struct splice_conn *conn, **prev;
+	redisContext *c;
+
+	for(prev = &sp->idle; *prev; prev = &(*prev)->next) {
+		if((*prev)->db == db) {
+			conn = *prev;
+			*prev = conn->next;
+			sp->idle_count--;
+			sp->busy++;
+			conn->reused = 1;
+			return conn;
+		}
+	}
+
+	if(p->host[0] == '/') { /* unix socket */
+		c = redisConnectUnixNonBlock(p->host);
+	} else {
+		c = redisConnectNonBlock(p->host, p->port);
+	}
+	if(!c || c->err) {
+		if(c) {
+			slog(sp->w->s, WEBDIS_ERROR, c->errstr, 0);
+			redisFree(c);
+		}
+		return NULL;
+	}
+
+	/* only the socket is kept */
+	conn = calloc(1, sizeof(struct splice_conn));
+	conn->fd = c->fd;
+	conn->db = db;
+	c->fd = -1;
+	redisFree(c);
+
+	sp->busy++;
+	return conn;
+}
+
+static void
+splice_close(struct splice *sp, struct splice_conn *conn, int reuse) {
+
+	sp->busy--;
+	if(reuse && sp->idle_count < SPLICE_IDLE_MAX) {
+		conn->reused = 0;
+		conn->next = sp->idle;
+		sp->idle = conn;
+		sp->idle_count++;
+		return;
+	}
+	close(conn->fd);
+	free(conn);
+}
+
+static void
+splice_append(struct splice_get *g, char *p, int sz) {
+
+	g->out = realloc(g->out, g->out_sz + sz);
+	memcpy(g->out + g->out_sz, p, sz);
+	g->out_sz += sz;
+	free(p);
+}
+
+/* GET, after AUTH and SELECT on a new connection */
+static void
+splice_request(struct splice_get *g) {
+
+	struct conf *cfg = g->sp->w->s->cfg;
+	struct cmd *cmd = g->cmd;
+	char *p;
+	int sz;
+
+	g->skip = 0;
+	if(!g->conn->reused && cfg->redis_auth) {
+		sz = redisFormatCommand(&p, "AUTH %s", cfg->redis_auth);
+		splice_append(g, p, sz);
+		g->skip++;
+	}
+	if(!g->conn->reused && g->conn->db) {
+		sz = redisFormatCommand(&p, "SELECT %d", g->conn->db);
+		splice_append(g, p, sz);
+		g->skip++;
+	}
+	sz = redisFormatCommandArgv(&p, cmd->count, (const char **)cmd->argv, cmd->argv_len);
+	splice_append(g, p, sz);
+}
+
+static void
+splice_wait(struct splice_get *g, short what, void (*fun)(int, short, void *)) {
+
+	event_set(&g->ev, g->conn->fd, what, fun, g);
+	event_base_set(g->sp->w->base, &g->ev);
+	event_add(&g->ev, NULL);
+	g->ev_set = 1;
+}
+
+static void
+splice_wait_client(struct splice_get *g, void (*fun)(int, short, void *)) {
+
+	event_set(&g->ev_client, g->cmd->fd, EV_WRITE, fun, g);
+	event_base_set(g->sp->w->base, &g->ev_client);
+	event_add(&g->ev_client, NULL);
+	g->ev_client_set = 1;
+}
+
+static void
+splice_unwait(struct splice_get *g) {
+
+	if(g->ev_set) {
+		event_del(&g->ev);
+		g->ev_set = 0;
+	}
+	if(g->ev_client_set) {
+		event_del(&g->ev_client);
+		g->ev_client_set = 0;
+	}
+}
+
+static void
+splice_free(struct splice_get *g) {
+
+	splice_unwait(g);
+	if(g->pipe[0] >= 0) {
+		close(g->pipe[0]);
+		close(g->pipe[1]);
+	}
+	free(g->out);
+	free(g->in);
+	free(g);
+}
+
+/* the connection can't be trusted anymore */
+static void
+splice_fail(struct splice_get *g) {
+
+	struct cmd *cmd = g->cmd;
+
+	g->sp->failures++;
+	splice_close(g->sp, g->conn, 0);
+	if(cmd) {
+		cmd->splice = NULL;
+	}
+	if(cmd && g->started) {
+		/* the response is cut short, the client has to notice */
+		if(!cmd->abandoned && cmd->keep_alive) {
+			shutdown(cmd->fd, SHUT_RDWR);
+		} else if(!cmd->abandoned) {
+			close(cmd->fd);
+		}
+		cmd_free(cmd);
+	} else if(cmd) {
+		format_send_error(cmd, 503, "Service Unavailable");
+	}
+	splice_free(g);
+}
+
+static void
+splice_on_request(int fd, short event, void *ptr);
+
+/* an idle connection closed by Redis, try a new one */
+static int
+splice_reopen(struct splice_get *g) {
+
+	if(!g->conn->reused || g->in_sz) {
+		return 0;
+	}
+	splice_close(g->sp, g->conn, 0);
+	if(!(g->conn = splice_open(g->sp, g->cmd->database))) {
+		return 0;
+	}
+	free(g->out);
+	g->out = NULL;
+	g->out_sz = g->out_sent = 0;
+	splice_request(g);
+	splice_wait(g, EV_WRITE, splice_on_request);
+	return 1;
+}
+
+/* the value has been sent */
+static void
+splice_on_crlf(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+	char crlf[2];
+	ssize_t ret;
+
+	(void)event;
+
+	g->ev_set = 0;
+	while(g->crlf) {
+		ret = read(fd, crlf, g->crlf);
+		if(ret < 0 && errno == EAGAIN) {
+			splice_wait(g, EV_READ, splice_on_crlf);
+			return;
+		} else if(ret <= 0) {
+			splice_close(g->sp, g->conn, 0);
+			splice_free(g);
+			return;
+		}
+		g->crlf -= ret;
+	}
+	splice_close(g->sp, g->conn, 1);
+	splice_free(g);
+}
+
+static void
+splice_done(struct splice_get *g) {
+
+	struct cmd *cmd = g->cmd;
+
+	if(!cmd->keep_alive) { /* as http_response_write does */
+		close(cmd->fd);
+	}
+	cmd->splice = NULL;
+	cmd_free(cmd);
+	g->cmd = NULL;
+
+	splice_unwait(g);
+	splice_on_crlf(g->conn->fd, EV_READ, g);
+}
+
+static void
+splice_on_pump(int fd, short event, void *ptr);
+
+/* Redis socket → pipe → client socket, as long as both sides keep up */
+static void
+splice_pump(struct splice_get *g) {
+
+	struct cmd *cmd = g->cmd;
+	ssize_t ret;
+	int progress;
+
+	splice_unwait(g);
+	if(cmd->abandoned) { /* the client is gone, and so is the rest of the value */
+		splice_fail(g);
+		return;
+	}
+
+	do {
+		progress = 0;
+		if(g->left && g->piped < g->pipe_sz) {
+			ret = splice(g->conn->fd, NULL, g->pipe[1], NULL,
+				g->left < g->pipe_sz - g->piped ? g->left : g->pipe_sz - g->piped,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(ret > 0) {
+				g->left -= ret;
+				g->piped += ret;
+				progress = 1;
+			} else if(ret == 0 || errno != EAGAIN) {
+				splice_fail(g);
+				return;
+			}
+		}
+		if(g->piped) {
+			ret = splice(g->pipe[0], NULL, cmd->fd, NULL, g->piped,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(ret > 0) {
+				g->piped -= ret;
+				progress = 1;
+			} else if(ret == 0 || errno != EAGAIN) {
+				splice_fail(g);
+				return;
+			}
+		}
+	} while(progress && (g->left || g->piped));
+
+	if(!g->left && !g->piped) {
+		splice_done(g);
+		return;
+	}
+	if(g->piped) {
+		splice_wait_client(g, splice_on_pump);
+	}
+	if(g->left && g->piped < g->pipe_sz) {
+		splice_wait(g, EV_READ, splice_on_pump);
+	}
+}
+
+static void
+splice_on_pump(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+
+	(void)fd;
+	(void)event;
+
+	splice_pump(g);
+}
+
+/* the headers have been written with the frames queued before them */
+static void
+splice_on_drained(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+	struct http_client *c = g->cmd->client;
+
+	(void)fd;
+	(void)event;
+
+	g->ev_client_set = 0;
+	if(c && c->out_count) {
+		splice_wait_client(g, splice_on_drained);
+		return;
+	}
+	splice_pump(g);
+}
+
+/* headers and the start of the value to a client that is gone, as http_response_write does */
+static void
+splice_on_head(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+	ssize_t ret;
+
+	(void)event;
+
+	g->ev_client_set = 0;
+	if(g->cmd->abandoned) {
+		splice_fail(g);
+		return;
+	}
+
+	ret = write(fd, g->out + g->out_sent, g->out_sz - g->out_sent);
+	if(ret < 0 && errno == EAGAIN) {
+		splice_wait_client(g, splice_on_head);
+		return;
+	} else if(ret <= 0) {
+		splice_fail(g);
+		return;
+	}
+	g->out_sent += ret;
+	if(g->out_sent < g->out_sz) {
+		splice_wait_client(g, splice_on_head);
+		return;
+	}
+
+	free(g->out);
+	g->out = NULL;
+	splice_pump(g);
+}
+
+/* value of sz bytes starting at g->in + pos */
+static void
+splice_start(struct splice_get *g, size_t pos, size_t sz) {
+
+	struct cmd *cmd = g->cmd;
+	struct http_response *resp;
+	size_t head_sz, avail = g->in_sz - pos, body = avail < sz ? avail : sz;
+	int pipe_sz;
+
+	if(cmd->abandoned || pipe2(g->pipe, O_NONBLOCK) != 0) {
+		g->pipe[0] = g->pipe[1] = -1;
+		splice_fail(g);
+		return;
+	}
+	/* larger than the default 64KB if allowed, fewer wake-ups */
+	fcntl(g->pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SZ);
+	pipe_sz = fcntl(g->pipe[1], F_GETPIPE_SZ);
+	g->pipe_sz = pipe_sz > 0 ? (size_t)pipe_sz : 65536;
+
+	/* the response has started, no 504 from here on */
+	if(cmd->deadline_set) {
+		evtimer_del(&cmd->ev_deadline);
+		cmd->deadline_set = 0;
+	}
+
+	/* no ETag: it would take reading the whole value first */
+	resp = http_response_init(NULL, 200, "OK");
+	resp->http_version = cmd->http_version;
+	if(cmd->filename) {
+		http_response_set_header(resp, "Content-Disposition", cmd->filename);
+	}
+	http_response_set_header(resp, "Content-Type", cmd->mime);
+	http_response_set_keep_alive(resp, cmd->keep_alive);
+	g->out = http_response_head(resp, sz, &head_sz);
+
+	g->out = realloc(g->out, head_sz + body);
+	memcpy(g->out + head_sz, g->in + pos, body);
+	g->out_sz = head_sz + body;
+	g->out_sent = 0;
+
+	g->left = sz - body;
+	g->crlf = 2 - (avail - body);
+	g->started = 1;
+	free(g->in);
+	g->in = NULL;
+
+	g->sp->spliced++;
+	g->sp->bytes += sz;
+
+	/* in order with the other responses, the value follows once they are written */
+	if(cmd->client) {
+		struct http_frame *f = http_frame_new(g->out, g->out_sz);
+		g->out = NULL;
+		http_client_send(cmd->client, f);
+		http_frame_release(f);
+		splice_wait_client(g, splice_on_drained);
+	} else {
+		splice_wait_client(g, splice_on_head);
+	}
+}
+
+/* an error, nil, or a value below the threshold: formatted as usual */
+static void
+splice_reply(struct splice_get *g, int type, char *p, size_t sz, int reuse) {
+
+	redisReply r;
+	struct cmd *cmd = g->cmd;
+
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+	r.str = p;
+	r.len = (int)sz;
+
+	splice_close(g->sp, g->conn, reuse);
+	cmd->splice = NULL;
+	cmd->f_format(NULL, &r, cmd);
+	splice_free(g);
+}
+
+/* end of the line starting at pos, NULL if it hasn't arrived yet */
+static char *
+splice_line(struct splice_get *g, size_t pos) {
+
+	char *nl;
+
+	if(pos >= g->in_sz || !(nl = memchr(g->in + pos, '\n', g->in_sz - pos))) {
+		return NULL;
+	}
+	return nl + 1;
+}
+
+static void
+splice_on_reply(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+	size_t pos = 0, end;
+	long long sz;
+	char *nl;
+	ssize_t ret;
+
+	(void)event;
+
+	g->ev_set = 0;
+	if(g->in_alloc - g->in_sz < SPLICE_READ_SZ) {
+		g->in_alloc = g->in_sz + SPLICE_READ_SZ;
+		g->in = realloc(g->in, g->in_alloc);
+	}
+	ret = read(fd, g->in + g->in_sz, g->in_alloc - g->in_sz);
+	if(ret < 0 && errno == EAGAIN) {
+		splice_wait(g, EV_READ, splice_on_reply);
+		return;
+	} else if(ret <= 0) {
+		if(!splice_reopen(g)) {
+			splice_fail(g);
+		}
+		return;
+	}
+	g->in_sz += ret;
+
+	/* replies to AUTH and SELECT */
+	while(g->skip) {
+		if(!(nl = splice_line(g, pos))) {
+			splice_wait(g, EV_READ, splice_on_reply);
+			return;
+		}
+		if(g->in[pos] != '+') {
+			splice_fail(g);
+			return;
+		}
+		memmove(g->in, nl, g->in + g->in_sz - nl);
+		g->in_sz -= nl - g->in;
+		g->skip--;
+	}
+
+	if(!(nl = splice_line(g, 0))) {
+		splice_wait(g, EV_READ, splice_on_reply);
+		return;
+	}
+	end = nl - g->in;
+
+	if(g->in[0] == '-') { /* e.g. WRONGTYPE */
+		splice_reply(g, REDIS_REPLY_ERROR, g->in + 1, end - 3, end == g->in_sz);
+		return;
+	} else if(g->in[0] != '$') {
+		splice_fail(g);
+		return;
+	}
+
+	sz = strtoll(g->in + 1, NULL, 10);
+	if(sz < 0) {
+		splice_reply(g, REDIS_REPLY_NIL, NULL, 0, end == g->in_sz);
+	} else if((size_t)sz >= g->sp->threshold) {
+		splice_start(g, end, (size_t)sz);
+	} else if(g->in_sz >= end + sz + 2) {
+		splice_reply(g, REDIS_REPLY_STRING, g->in + end, sz, g->in_sz == end + sz + 2);
+	} else {
+		splice_wait(g, EV_READ, splice_on_reply);
+	}
+}
+
+static void
+splice_on_request(int fd, short event, void *ptr) {
+
+	struct splice_get *g = ptr;
+	ssize_t ret;
+
+	(void)event;
+
+	g->ev_set = 0;
+	ret = write(fd, g->out + g->out_sent, g->out_sz - g->out_sent);
+	if(ret < 0 && errno == EAGAIN) {
+		splice_wait(g, EV_WRITE, splice_on_request);
+		return;
+	} else if(ret <= 0) {
+		if(!splice_reopen(g)) {
+			splice_fail(g);
+		}
+		return;
+	}
+	g->out_sent += ret;
+	if(g->out_sent < g->out_sz) {
+		splice_wait(g, EV_WRITE, splice_on_request);
+		return;
+	}
+
+	free(g->out);
+	g->out = NULL;
+	splice_wait(g, EV_READ, splice_on_reply);
+}
+
+/* the client is gone: stop sending the value, if it was being sent */
+void
+splice_abandon(struct splice_get *g) {
+
+	if(g->started) {
+		splice_fail(g);
+	}
+}
+
+/**
+ * Takes the command if it is a GET with a custom content-type, returns 0
+ * otherwise or if no connection could be made.
+ */
+int
+splice_run(struct splice *sp, struct cmd *cmd, formatting_fun f_format) {
+
+	struct splice_get *g;
+	struct splice_conn *conn;
+
+	if(f_format != custom_type_reply || !cmd->mime || cmd->is_websocket
+			|| cmd->count != 2 || cmd->argv_len[0] != 3
+			|| strncasecmp(cmd->argv[0], "GET", 3) != 0) {
+		return 0;
+	}
+
+	/* as any other command: queued, or refused while Redis is down */
+	if(sp->busy >= SPLICE_BUSY_MAX || sp->w->pool->breaker == POOL_OPEN) {
+		sp->fallbacks++;
+		return 0;
+	}
+	if(!(conn = splice_open(sp, cmd->database))) {
+		sp->failures++;
+		return 0;
+	}
+
+	g = calloc(1, sizeof(struct splice_get));
+	g->sp = sp;
+	g->cmd = cmd;
+	g->conn = conn;
+	g->pipe[0] = g->pipe[1] = -1;
+	cmd->f_format = f_format;
+	cmd->splice = g;
+
+	/* this connection isn't tracked: a copy in the cache would never be invalidated */
+	free(cmd->cache_key);
+	cmd->cache_key = NULL;
+
+	splice_request(g);
+	splice_wait(g, EV_WRITE, splice_on_request);
+	sp->gets++;
+
+	return 1;
+}
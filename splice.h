@@ -0,0 +1,37 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include "cmd.h"
+
+struct worker;
+struct splice_conn;
+struct splice_get;
+
+/* large values sent from the Redis socket to the client's with splice(2) */
+struct splice {
+	struct worker *w;
+	size_t threshold;
+
+	/* connections set up for a database and not in use */
+	struct splice_conn *idle;
+	int idle_count;
+	int busy; /* connections in use */
+
+	/* counters */
+	unsigned long gets; /* GETs sent on these connections */
+	unsigned long spliced; /* values at or above the threshold */
+	unsigned long bytes; /* spliced */
+	unsigned long failures;
+	unsigned long fallbacks; /* GETs left to the pool */
+};
+
+struct splice *
+splice_new(struct worker *w);
+
+int
+splice_run(struct splice *sp, struct cmd *cmd, formatting_fun f_format);
+
+void
+splice_abandon(struct splice_get *g);
+
+#endif
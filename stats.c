@@ -0,0 +1,415 @@
+#include "stats.h"
+#include "server.h"
+#include "worker.h"
+#include "client.h"
+#include "http.h"
+#include "conf.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "replica.h"
+#include "cluster.h"
+#include "shard.h"
+#include "hub.h"
+#include "changes.h"
+#include "splice.h"
+#include "chunked.h"
+#include "pool.h"
+
+#include <string.h>
+#include <jansson.h>
+
+/**
+ * GET /_stats: counters, summed over all the worker threads.
+ * They are read without locking and might be slightly out of date.
+ */
+
+/* main pool: circuit breakers, depth and smoothed RTT of every connection */
+static json_t *
+stats_pool(struct server *s) {
+
+	int i, n, queued = 0, open = 0, half_open = 0;
+	unsigned long shed = 0, trips = 0;
+	json_t *jret = json_object(), *jlist = json_array();
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct pool *p = s->w[i]->pool;
+
+		queued += p->queued;
+		shed += p->shed;
+		trips += p->trips;
+		open += (p->breaker == POOL_OPEN);
+		half_open += (p->breaker == POOL_HALF_OPEN);
+		for(n = 0; n < p->count; ++n) {
+			json_t *jc = json_object();
+			json_object_set_new(jc, "worker", json_integer(i));
+			json_object_set_new(jc, "connected", p->ac[n] ? json_true() : json_false());
+			json_object_set_new(jc, "pending", json_integer(p->pending[n]));
+			json_object_set_new(jc, "rtt_us", json_integer(p->rtt[n]));
+			json_object_set_new(jc, "commands", json_integer(p->sent[n]));
+			json_array_append_new(jlist, jc);
+		}
+	}
+
+	json_object_set_new(jret, "queued", json_integer(queued));
+	json_object_set_new(jret, "shed", json_integer(shed));
+	json_object_set_new(jret, "breaker_open", json_integer(open));
+	json_object_set_new(jret, "breaker_half_open", json_integer(half_open));
+	json_object_set_new(jret, "breaker_trips", json_integer(trips));
+	json_object_set_new(jret, "connections", jlist);
+	return jret;
+}
+
+/* connections reserved to blocking commands */
+static json_t *
+stats_blocking(struct server *s) {
+
+	int i, n, busy = 0, connected = 0, queued = 0;
+	unsigned long shed = 0, shared = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct worker *w = s->w[i];
+		if(!w->blocking) continue;
+
+		for(n = 0; n < w->blocking->count; ++n) {
+			connected += (w->blocking->ac[n] != NULL);
+			busy += (w->blocking->pending[n] != 0);
+		}
+		queued += w->blocking->queued;
+		shed += w->blocking->shed;
+		shared += w->pollers->hits;
+	}
+
+	j = json_object();
+	json_object_set_new(j, "connected", json_integer(connected));
+	json_object_set_new(j, "busy", json_integer(busy));
+	json_object_set_new(j, "queued", json_integer(queued));
+	json_object_set_new(j, "shed", json_integer(shed));
+	json_object_set_new(j, "shared", json_integer(shared));
+	return j;
+}
+
+/* subscriptions shared between clients */
+static json_t *
+stats_pubsub(struct server *s) {
+
+	int i;
+	unsigned long channels = 0, subscriptions = 0, messages = 0, deliveries = 0, formatted = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct hub *h = s->w[i]->hub;
+		if(!h) continue;
+
+		channels += h->channels;
+		subscriptions += h->members;
+		messages += h->messages;
+		deliveries += h->deliveries;
+		formatted += h->formatted;
+	}
+
+	j = json_object();
+	json_object_set_new(j, "channels", json_integer(channels));
+	json_object_set_new(j, "subscriptions", json_integer(subscriptions));
+	json_object_set_new(j, "messages", json_integer(messages));
+	json_object_set_new(j, "deliveries", json_integer(deliveries));
+	json_object_set_new(j, "formatted", json_integer(formatted));
+	return j;
+}
+
+static json_t *
+stats_changes(struct server *s) {
+
+	int i;
+	unsigned long feeds = 0, watchers = 0, events = 0, notifications = 0, fetches = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct changes *c = s->w[i]->changes;
+		if(!c) continue;
+
+		feeds += c->feed_count;
+		watchers += c->watcher_count;
+		events += c->events;
+		notifications += c->notifications;
+		fetches += c->fetches;
+	}
+
+	j = json_object();
+	json_object_set_new(j, "feeds", json_integer(feeds));
+	json_object_set_new(j, "watchers", json_integer(watchers));
+	json_object_set_new(j, "events", json_integer(events));
+	json_object_set_new(j, "notifications", json_integer(notifications));
+	json_object_set_new(j, "fetches", json_integer(fetches));
+	return j;
+}
+
+static json_t *
+stats_coalesce(struct server *s) {
+
+	int i;
+	unsigned long hits = 0, merges = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct coalesce *co = s->w[i]->coalesce;
+		if(co) {
+			hits += co->hits;
+			merges += co->merges;
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "enabled", s->cfg->coalesce_reads ? json_true() : json_false());
+	json_object_set_new(j, "hits", json_integer(hits));
+	json_object_set_new(j, "merges", json_integer(merges));
+	return j;
+}
+
+static json_t *
+stats_cache(struct server *s) {
+
+	int i, ready = 0;
+	unsigned long hits = 0, misses = 0, inserts = 0, evictions = 0,
+		invalidations = 0, entries = 0;
+	size_t bytes = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct cache *c = s->w[i]->cache;
+		if(c) {
+			ready += c->ready;
+			hits += c->hits;
+			misses += c->misses;
+			inserts += c->inserts;
+			evictions += c->evictions;
+			invalidations += c->invalidations;
+			entries += c->entries;
+			bytes += c->bytes;
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "enabled", s->cfg->cache_size ? json_true() : json_false());
+	json_object_set_new(j, "ready", json_integer(ready));
+	json_object_set_new(j, "entries", json_integer(entries));
+	json_object_set_new(j, "bytes", json_integer(bytes));
+	json_object_set_new(j, "hits", json_integer(hits));
+	json_object_set_new(j, "misses", json_integer(misses));
+	json_object_set_new(j, "inserts", json_integer(inserts));
+	json_object_set_new(j, "evictions", json_integer(evictions));
+	json_object_set_new(j, "invalidations", json_integer(invalidations));
+	return j;
+}
+
+static json_t *
+stats_replicas(struct server *s) {
+
+	int i, n;
+	unsigned long fallbacks = 0;
+	json_t *jret = json_object(), *jlist = json_array();
+
+	for(n = 0; n < s->cfg->replica_count; ++n) {
+		int healthy = 0;
+		long lag = -1;
+		long long behind = -1;
+		unsigned long outstanding = 0, reads = 0;
+		json_t *jr = json_object();
+
+		for(i = 0; i < s->cfg->http_threads; ++i) {
+			struct replica *r;
+			if(!s->w[i]->replicas) continue; /* not with cluster or shards */
+
+			r = &s->w[i]->replicas->r[n];
+			healthy += r->healthy;
+			outstanding += r->outstanding;
+			reads += r->reads;
+			if(r->lag > lag) lag = r->lag;
+			if(r->behind > behind) behind = r->behind;
+		}
+		json_object_set_new(jr, "host", json_string(s->cfg->replicas[n].host));
+		json_object_set_new(jr, "port", json_integer(s->cfg->replicas[n].port));
+		json_object_set_new(jr, "healthy", json_integer(healthy));
+		json_object_set_new(jr, "lag", json_integer(lag));
+		json_object_set_new(jr, "behind", json_integer(behind));
+		json_object_set_new(jr, "outstanding", json_integer(outstanding));
+		json_object_set_new(jr, "reads", json_integer(reads));
+		json_array_append_new(jlist, jr);
+	}
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		if(s->w[i]->replicas) {
+			fallbacks += s->w[i]->replicas->fallbacks;
+		}
+	}
+
+	json_object_set_new(jret, "fallbacks", json_integer(fallbacks));
+	json_object_set_new(jret, "nodes", jlist);
+	return jret;
+}
+
+static json_t *
+stats_cluster(struct server *s) {
+
+	int i, slot, covered = 0;
+	unsigned long moved = 0, asked = 0, refreshes = 0, nodes = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct cluster *cl = s->w[i]->cluster;
+		if(!cl) continue;
+
+		moved += cl->moved;
+		asked += cl->asked;
+		refreshes += cl->refreshes;
+		if(i == 0) { /* same topology in all the workers */
+			nodes = cl->node_count;
+			for(slot = 0; slot < CLUSTER_SLOTS; ++slot) covered += (cl->slots[slot] != NULL);
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "enabled", s->cfg->cluster ? json_true() : json_false());
+	json_object_set_new(j, "nodes", json_integer(nodes));
+	json_object_set_new(j, "slots", json_integer(covered));
+	json_object_set_new(j, "moved", json_integer(moved));
+	json_object_set_new(j, "ask", json_integer(asked));
+	json_object_set_new(j, "refreshes", json_integer(refreshes));
+	return j;
+}
+
+static json_t *
+stats_shards(struct server *s) {
+
+	int i;
+	unsigned long scattered = 0, rejected = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct shards *sh = s->w[i]->shards;
+		if(sh) {
+			scattered += sh->scattered;
+			rejected += sh->rejected;
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "count", json_integer(s->cfg->cluster ? 0 : s->cfg->shard_count));
+	json_object_set_new(j, "scattered", json_integer(scattered));
+	json_object_set_new(j, "rejected", json_integer(rejected));
+	return j;
+}
+
+static json_t *
+stats_splice(struct server *s) {
+
+	int i;
+	unsigned long gets = 0, spliced = 0, bytes = 0, failures = 0, fallbacks = 0;
+	int idle = 0, busy = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct splice *sp = s->w[i]->splice;
+		if(sp) {
+			gets += sp->gets;
+			spliced += sp->spliced;
+			bytes += sp->bytes;
+			failures += sp->failures;
+			fallbacks += sp->fallbacks;
+			idle += sp->idle_count;
+			busy += sp->busy;
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "threshold", json_integer(s->cfg->splice_threshold));
+	json_object_set_new(j, "gets", json_integer(gets));
+	json_object_set_new(j, "spliced", json_integer(spliced));
+	json_object_set_new(j, "bytes", json_integer(bytes));
+	json_object_set_new(j, "failures", json_integer(failures));
+	json_object_set_new(j, "fallbacks", json_integer(fallbacks));
+	json_object_set_new(j, "idle", json_integer(idle));
+	json_object_set_new(j, "busy", json_integer(busy));
+	return j;
+}
+
+static json_t *
+stats_chunked(struct server *s) {
+
+	int i;
+	unsigned long replies = 0, elements = 0, bytes = 0, truncated = 0;
+	json_t *j;
+
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		struct chunked *ch = s->w[i]->chunked;
+		if(ch) {
+			replies += ch->replies;
+			elements += ch->elements;
+			bytes += ch->bytes;
+			truncated += ch->truncated;
+		}
+	}
+
+	j = json_object();
+	json_object_set_new(j, "threshold", json_integer(s->cfg->chunked_threshold));
+	json_object_set_new(j, "max_reply_size", json_integer(s->cfg->max_reply_size));
+	json_object_set_new(j, "replies", json_integer(replies));
+	json_object_set_new(j, "elements", json_integer(elements));
+	json_object_set_new(j, "bytes", json_integer(bytes));
+	json_object_set_new(j, "truncated", json_integer(truncated));
+	return j;
+}
+
+/**
+ * GET /_ready: 200 once the connections to Redis are up, 503 otherwise.
+ * Meant for load-balancer health checks.
+ */
+void
+stats_send_ready(struct http_client *c) {
+
+	struct http_response *resp;
+	int ready = server_is_ready(c->s);
+	const char *out = ready ? "{\"ready\":true}" : "{\"ready\":false}";
+
+	resp = http_response_init(NULL, ready ? 200 : 503, ready ? "OK" : "Service Unavailable");
+	resp->http_version = c->http_version;
+	http_response_set_keep_alive(resp, c->keep_alive);
+	http_response_set_header(resp, "Content-Type", "application/json");
+	http_response_set_header(resp, "Cache-Control", "no-cache");
+	http_response_set_body(resp, out, strlen(out));
+
+	http_response_write(resp, c->fd);
+	http_client_reset(c);
+}
+
+void
+stats_send(struct http_client *c) {
+
+	struct http_response *resp;
+	json_t *j = json_object();
+	char *out;
+
+	json_object_set_new(j, "pool", stats_pool(c->s));
+	json_object_set_new(j, "blocking", stats_blocking(c->s));
+	json_object_set_new(j, "pubsub", stats_pubsub(c->s));
+	json_object_set_new(j, "changes", stats_changes(c->s));
+	json_object_set_new(j, "coalesce", stats_coalesce(c->s));
+	json_object_set_new(j, "cache", stats_cache(c->s));
+	json_object_set_new(j, "replicas", stats_replicas(c->s));
+	json_object_set_new(j, "cluster", stats_cluster(c->s));
+	json_object_set_new(j, "shards", stats_shards(c->s));
+	json_object_set_new(j, "splice", stats_splice(c->s));
+	json_object_set_new(j, "chunked", stats_chunked(c->s));
+	out = json_dumps(j, JSON_COMPACT);
+	json_decref(j);
+
+	resp = http_response_init(NULL, 200, "OK");
+	resp->http_version = c->http_version;
+	http_response_set_keep_alive(resp, c->keep_alive);
+	http_response_set_header(resp, "Content-Type", "application/json");
+	http_response_set_header(resp, "Cache-Control", "no-cache");
+	http_response_set_body(resp, out, strlen(out));
+
+	http_response_write(resp, c->fd);
+	http_client_reset(c);
+	free(out);
+}
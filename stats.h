@@ -0,0 +1,12 @@
+#ifndef STATS_H
+#define STATS_H
+
+struct http_client;
+
+void
+stats_send(struct http_client *c);
+
+void
+stats_send_ready(struct http_client *c);
+
+#endif
@@ -0,0 +1,372 @@
+#include "stream.h"
+#include "cmd.h"
+#include "client.h"
+#include "pool.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "acl.h"
+#include "cluster.h"
+#include "shard.h"
+#include "formats/common.h"
+#include "formats/sse.h"
+#include "http.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+
+/**
+ * GET /_stream/key[/id] tails a Redis Stream with XREAD BLOCK, starting
+ * after the given ID (or Last-Event-ID), or with new entries by default.
+ * GET /_stream/key/group/consumer reads with XREADGROUP, starting with
+ * the entries left unacknowledged by this consumer; entries are acknowledged
+ * once queued for the client.
+ *
+ * Each batch of entries is sent as one chunk, event or WebSocket frame.
+ */
+
+#define STREAM_PREFIX "/_stream/"
+#define STREAM_MAX_ARGS 11
+
+static void
+stream_connect(struct stream_reader *r);
+
+int
+stream_endpoint(const char *path, size_t path_sz) {
+
+	size_t sz = sizeof(STREAM_PREFIX) - 1;
+	return path_sz > sz && memcmp(path, STREAM_PREFIX, sz) == 0;
+}
+
+static void
+stream_arg(struct cmd *cmd, int i, const char *p, size_t sz) {
+
+	free(cmd->argv[i]);
+	cmd->argv[i] = malloc(sz);
+	memcpy(cmd->argv[i], p, sz);
+	cmd->argv_len[i] = sz;
+}
+
+static void
+stream_arg_int(struct cmd *cmd, int i, int n) {
+
+	char buf[16];
+	stream_arg(cmd, i, buf, sprintf(buf, "%d", n));
+}
+
+static int
+stream_is_group(const struct cmd *cmd) {
+
+	return cmd->count == STREAM_MAX_ARGS;
+}
+
+/* the node or shard holding the key */
+static struct pool *
+stream_pool(struct worker *w, const char *key, size_t sz) {
+
+	if(w->cluster) {
+		struct cluster_node *n = w->cluster->slots[cluster_key_slot(key, sz)];
+		if(n) {
+			return n->pool;
+		}
+	} else if(w->shards) {
+		return shards_pool_for_key(w->shards, key, sz);
+	}
+	return w->pool;
+}
+
+static void
+stream_can_retry(int fd, short event, void *ptr) {
+
+	struct stream_reader *r = ptr;
+
+	(void)fd;
+	(void)event;
+
+	r->retry_set = 0;
+	stream_connect(r);
+}
+
+/* lost the connection, start again from the last ID we've sent */
+static void
+stream_retry(struct stream_reader *r) {
+
+	struct timeval tv = {1, 0};
+
+	r->ac = NULL;
+	evtimer_set(&r->ev_retry, stream_can_retry, r);
+	event_base_set(r->w->base, &r->ev_retry);
+	evtimer_add(&r->ev_retry, &tv);
+	r->retry_set = 1;
+}
+
+static void
+stream_on_read(redisAsyncContext *ac, void *reply, void *privdata);
+
+static void
+stream_read(struct stream_reader *r) {
+
+	struct cmd *cmd = r->cmd;
+
+	r->reading = 1;
+	redisAsyncCommandArgv(r->ac, stream_on_read, r, cmd->count,
+			(const char **)cmd->argv, cmd->argv_len);
+}
+
+static void
+stream_ack(struct stream_reader *r, const redisReply *entries) {
+
+	struct cmd *cmd = r->cmd;
+	const char **argv = malloc((3 + entries->elements) * sizeof(char *));
+	size_t *argv_len = malloc((3 + entries->elements) * sizeof(size_t));
+	size_t i;
+	int argc = 3;
+
+	argv[0] = "XACK";
+	argv_len[0] = 4;
+	argv[1] = cmd->argv[9]; /* key */
+	argv_len[1] = cmd->argv_len[9];
+	argv[2] = cmd->argv[2]; /* group */
+	argv_len[2] = cmd->argv_len[2];
+
+	for(i = 0; i < entries->elements; ++i) {
+		const redisReply *e = entries->element[i];
+		if(e->type == REDIS_REPLY_ARRAY && e->elements >= 1
+				&& e->element[0]->type == REDIS_REPLY_STRING) {
+			argv[argc] = e->element[0]->str;
+			argv_len[argc++] = e->element[0]->len;
+		}
+	}
+	if(argc > 3) {
+		redisAsyncCommandArgv(r->ac, NULL, NULL, argc, argv, argv_len);
+	}
+
+	free(argv);
+	free(argv_len);
+}
+
+/* the response has started, and won't get more entries */
+static void
+stream_end(struct cmd *cmd, formatting_fun f_format) {
+
+	struct http_client *c = cmd->client;
+	struct http_frame *f;
+	char *end;
+
+	/* the connection to Redis is closed after this callback */
+	stream_stop(cmd->reader);
+	cmd->reader = NULL;
+
+	if(c) {
+		c->pub_sub = NULL;
+		if(cmd->is_websocket) {
+			; /* the error frame was the last one, the socket stays open */
+		} else if(f_format == sse_reply || !c->keep_alive) { /* no end but the connection's */
+			http_client_close(c);
+		} else { /* last chunk, the client can send more requests */
+			end = malloc(5);
+			memcpy(end, "0\r\n\r\n", 5);
+			f = http_frame_new(end, 5);
+			http_client_send(c, f);
+			http_frame_release(f);
+		}
+	}
+	cmd_free(cmd);
+}
+
+static void
+stream_on_read(redisAsyncContext *ac, void *reply, void *privdata) {
+
+	struct stream_reader *r = privdata;
+	redisReply *rep = reply, *entries = NULL;
+	struct cmd *cmd = r->cmd;
+
+	r->reading = 0;
+	if(!cmd) { /* the client is gone */
+		free(r);
+		return;
+	}
+	if(ac != r->ac) {
+		return;
+	}
+	if(!rep) {
+		stream_retry(r);
+		return;
+	}
+	if(rep->type == REDIS_REPLY_ERROR) {
+		/* e.g. NOGROUP or WRONGTYPE: sent to the client, and we stop there */
+		formatting_fun f_format = r->f_format;
+		if(!cmd->started_responding) { /* as a single reply */
+			stream_stop(r);
+			cmd->reader = NULL;
+			if(cmd->client) {
+				cmd->client->pub_sub = NULL;
+			}
+			f_format(ac, rep, cmd);
+		} else { /* after the entries sent so far */
+			f_format(ac, rep, cmd);
+			stream_end(cmd, f_format);
+		}
+		return;
+	}
+
+	/* [[key, [entry, …]]], or nil if nothing came in before the timeout */
+	if(rep->type == REDIS_REPLY_ARRAY && rep->elements == 1
+			&& rep->element[0]->type == REDIS_REPLY_ARRAY
+			&& rep->element[0]->elements == 2
+			&& rep->element[0]->element[1]->type == REDIS_REPLY_ARRAY) {
+		entries = rep->element[0]->element[1];
+	}
+
+	if(entries && entries->elements) {
+		redisReply *last = entries->element[entries->elements - 1];
+
+		r->f_format(ac, rep, cmd);
+		if(stream_is_group(cmd)) {
+			stream_ack(r, entries);
+		} else if(last->type == REDIS_REPLY_ARRAY && last->elements >= 1
+				&& last->element[0]->type == REDIS_REPLY_STRING) {
+			/* continue after the last entry */
+			stream_arg(cmd, cmd->count - 1, last->element[0]->str, last->element[0]->len);
+		}
+	} else if(entries && r->pending) {
+		/* no unacknowledged entries left, wait for new ones */
+		r->pending = 0;
+		stream_arg(cmd, cmd->count - 1, ">", 1);
+	}
+
+	stream_read(r);
+}
+
+static void
+stream_connect(struct stream_reader *r) {
+
+	struct cmd *cmd = r->cmd;
+	struct pool *p = stream_pool(r->w, cmd->argv[cmd->count - 2], cmd->argv_len[cmd->count - 2]);
+
+	r->ac = (redisAsyncContext *)pool_connect(p, cmd->database, 0);
+	if(!r->ac) {
+		stream_retry(r);
+		return;
+	}
+	stream_read(r);
+}
+
+/* called when the command is freed */
+void
+stream_stop(struct stream_reader *r) {
+
+	int reading = r->reading;
+	redisAsyncContext *ac = r->ac;
+
+	r->cmd = NULL;
+	r->ac = NULL;
+	if(r->retry_set) {
+		evtimer_del(&r->ev_retry);
+	}
+
+	/* the pending read gets a NULL reply, and frees the reader */
+	if(ac) {
+		redisAsyncFree(ac);
+	}
+	if(!reading) {
+		free(r);
+	}
+}
+
+cmd_response_t
+stream_run(struct worker *w, struct http_client *client) {
+
+	struct conf *cfg = w->s->cfg;
+	const char *uri = client->path + sizeof(STREAM_PREFIX) - 1;
+	size_t uri_len = client->path_sz - (sizeof(STREAM_PREFIX) - 1);
+	const char *parts[3], *p, *last_id;
+	size_t parts_sz[3];
+	char *qmark = memchr(uri, '?', uri_len);
+	int i, n = 0;
+	formatting_fun f_format;
+	struct stream_reader *r;
+	struct cmd *cmd;
+
+	if(qmark) {
+		uri_len = qmark - uri;
+	}
+
+	cmd = cmd_new(STREAM_MAX_ARGS);
+	cmd->fd = client->fd;
+	cmd->database = cfg->database;
+	cmd->is_websocket = client->is_websocket;
+	uri_len = cmd_select_format(client, cmd, uri, uri_len, &f_format);
+
+	/* key, key/id, or key/group/consumer */
+	for(p = uri; n < 3 && p < uri + uri_len; n++) {
+		const char *next = memchr(p, '/', uri + uri_len - p);
+		parts[n] = p;
+		parts_sz[n] = (next ? next : uri + uri_len) - p;
+		p = next ? next + 1 : uri + uri_len;
+	}
+	if(n == 0 || p < uri + uri_len) {
+		cmd_free(cmd);
+		return CMD_PARAM_ERROR;
+	}
+	for(i = 0; i < n; ++i) {
+		if(parts_sz[i] == 0) {
+			cmd_free(cmd);
+			return CMD_PARAM_ERROR;
+		}
+	}
+
+	i = 0;
+	if(n == 3) {
+		cmd->count = STREAM_MAX_ARGS;
+		stream_arg(cmd, i++, "XREADGROUP", 10);
+		stream_arg(cmd, i++, "GROUP", 5);
+		cmd->argv[i] = decode_uri(parts[1], parts_sz[1], &cmd->argv_len[i], 1); i++;
+		cmd->argv[i] = decode_uri(parts[2], parts_sz[2], &cmd->argv_len[i], 1); i++;
+	} else {
+		cmd->count = STREAM_MAX_ARGS - 3;
+		stream_arg(cmd, i++, "XREAD", 5);
+	}
+	stream_arg(cmd, i++, "COUNT", 5);
+	stream_arg_int(cmd, i++, cfg->stream_count);
+	stream_arg(cmd, i++, "BLOCK", 5);
+	stream_arg_int(cmd, i++, cfg->stream_block_ms);
+	stream_arg(cmd, i++, "STREAMS", 7);
+	cmd->argv[i] = decode_uri(parts[0], parts_sz[0], &cmd->argv_len[i], 1); i++;
+
+	/* where to start */
+	last_id = client_get_header(client, "Last-Event-ID");
+	if(n == 3) {
+		stream_arg(cmd, i, "0", 1); /* our unacknowledged entries first */
+	} else if(last_id && *last_id) {
+		stream_arg(cmd, i, last_id, strlen(last_id));
+	} else if(n == 2) {
+		cmd->argv[i] = decode_uri(parts[1], parts_sz[1], &cmd->argv_len[i], 1);
+	} else {
+		stream_arg(cmd, i, "$", 1);
+	}
+
+	if(!acl_allow_command(cmd, cfg, client)) {
+		cmd_free(cmd);
+		return CMD_ACL_FAIL;
+	}
+	cmd_setup(cmd, client);
+
+	r = calloc(1, sizeof(struct stream_reader));
+	r->w = w;
+	r->cmd = cmd;
+	r->f_format = f_format;
+	r->pending = (n == 3);
+	cmd->reader = r;
+	client->pub_sub = cmd; /* kept open */
+
+	/* open the event stream right away */
+	if(f_format == sse_reply && !cmd->is_websocket) {
+		format_send_event(cmd, ": stream\n\n", 10);
+	}
+
+	stream_connect(r);
+	return CMD_SENT;
+}
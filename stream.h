@@ -0,0 +1,33 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <event.h>
+#include <hiredis/async.h>
+#include "cmd.h"
+
+struct worker;
+struct http_client;
+
+/* tails a Redis Stream for one client, on its own connection */
+struct stream_reader {
+	struct worker *w;
+	struct cmd *cmd; /* the XREAD or XREADGROUP command, and the client's output */
+	formatting_fun f_format;
+
+	redisAsyncContext *ac;
+	int reading; /* a read is in flight */
+	int pending; /* consumer group: reading our unacknowledged entries first */
+	struct event ev_retry;
+	int retry_set;
+};
+
+int
+stream_endpoint(const char *path, size_t path_sz);
+
+cmd_response_t
+stream_run(struct worker *w, struct http_client *client);
+
+void
+stream_stop(struct stream_reader *r);
+
+#endif
@@ -1,14 +1,16 @@
 #!/usr/bin/python
-import urllib2, unittest, json, hashlib
+import urllib2, unittest, json, re, random, socket, time, struct, os, threading
 from functools import wraps
 try:
 	import msgpack
 except:
 	msgpack = None
 
-import os
 host = os.getenv('WEBDIS_HOST', '127.0.0.1')
 port = int(os.getenv('WEBDIS_PORT', 7379))
+auth = os.getenv('WEBDIS_AUTH', 'user:password') # enables STATS in webdis.json
+redis_host = os.getenv('REDIS_HOST', '127.0.0.1')
+redis_port = int(os.getenv('REDIS_PORT', 6379))
 
 class TestWebdis(unittest.TestCase):
 
@@ -19,6 +21,15 @@ class TestWebdis(unittest.TestCase):
 		r = urllib2.Request(self.wrap(url), data, headers)
 		return urllib2.urlopen(r)
 
+	def stats(self):
+		h = {'Authorization': 'Basic ' + auth.encode('base64').strip()}
+		try:
+			return json.loads(self.query('_stats', headers = h).read())
+		except urllib2.HTTPError as e:
+			if e.code != 403:
+				raise
+			self.skipTest('no access to /_stats')
+
 class TestBasics(TestWebdis):
 
 	def test_crossdomain(self):
@@ -43,7 +54,7 @@ class TestJSON(TestWebdis):
 		self.query('DEL/hello')
 		f = self.query('SET/hello/world')
 		self.assertTrue(f.headers.getheader('Content-Type') == 'application/json')
-		self.assertTrue(f.headers.getheader('ETag') == '"0db1124cf79ffeb80aff6d199d5822f8"')
+		self.assertTrue(f.headers.getheader('ETag') == '"84e4c1a335f4582a"')
 		self.assertTrue(f.read() == '{"SET":[true,"OK"]}')
 
 	def test_get(self):
@@ -51,7 +62,7 @@ class TestJSON(TestWebdis):
 		self.query('SET/hello/world')
 		f = self.query('GET/hello')
 		self.assertTrue(f.headers.getheader('Content-Type') == 'application/json')
-		self.assertTrue(f.headers.getheader('ETag') == '"8cf38afc245b7a6a88696566483d1390"')
+		self.assertTrue(f.headers.getheader('ETag') == '"bfbeb1756f97acae"')
 		self.assertTrue(f.read() == '{"GET":"world"}')
 
 	def test_incr(self):
@@ -59,7 +70,7 @@ class TestJSON(TestWebdis):
 		self.query('DEL/hello')
 		f = self.query('INCR/hello')
 		self.assertTrue(f.headers.getheader('Content-Type') == 'application/json')
-		self.assertTrue(f.headers.getheader('ETag') == '"500e9bcdcbb1e98f25c1fbb880a96c99"')
+		self.assertTrue(f.headers.getheader('ETag') == '"456c96d87ca133e6"')
 		self.assertTrue(f.read() == '{"INCR":1}')
 
 	def test_list(self):
@@ -69,9 +80,20 @@ class TestJSON(TestWebdis):
 		self.query('RPUSH/hello/def')
 		f = self.query('LRANGE/hello/0/-1')
 		self.assertTrue(f.headers.getheader('Content-Type') == 'application/json')
-		self.assertTrue(f.headers.getheader('ETag') == '"622e51f547a480bef7cf5452fb7782db"')
+		self.assertTrue(f.headers.getheader('ETag') == '"09b903134f778931"')
 		self.assertTrue(f.read() == '{"LRANGE":["abc","def"]}')
 
+	def test_escape(self):
+		"escaped strings, nested arrays"
+		self.query('DEL/hello')
+		self.query('RPUSH/hello/a%22b%5Cc%0Ad%01')
+		f = self.query('LRANGE/hello/0/-1')
+		self.assertTrue(f.read() == '{"LRANGE":["a\\"b\\\\c\\nd\\u0001"]}')
+		self.query('DEL/hello')
+		self.query('XADD/hello/1-0/f/a')
+		f = self.query('XRANGE/hello/-/+')
+		self.assertTrue(f.read() == '{"XRANGE":[["1-0",["f","a"]]]}')
+
 	def test_error(self):
 		"error return type"
 		f = self.query('UNKNOWN/COMMAND')
@@ -134,15 +156,26 @@ class TestRaw(TestWebdis):
 		f = self.query('LRANGE/hello/0/-1.raw')
 		self.assertTrue(f.read() == "*2\r\n$3\r\nabc\r\n$3\r\ndef\r\n")
 
+	def test_mget(self):
+		"multi-bulk reply with a nil element, as sent by Redis"
+		self.query('SET/hello/world')
+		self.query('DEL/nokey')
+		f = self.query('MGET/hello/nokey.raw')
+		self.assertTrue(f.read() == "*2\r\n$5\r\nworld\r\n$-1\r\n")
+
 	def test_error(self):
 		"error return type"
 		f = self.query('UNKNOWN/COMMAND.raw')
 		self.assertTrue(f.read().startswith("-ERR "))
 
 def need_msgpack(fn):
+	@wraps(fn)
 	def wrapper(self):
-		if msgpack:
-			fn(self)
+		if not msgpack:
+			self.skipTest('no msgpack module')
+		if self.query('PING.msg').headers.getheader('Content-Type') != 'application/x-msgpack':
+			self.skipTest('webdis built without msgpack')
+		fn(self)
 	return wrapper
 
 class TestMsgPack(TestWebdis):
@@ -182,6 +215,25 @@ class TestMsgPack(TestWebdis):
 		obj = msgpack.loads(f.read())
 		self.assertTrue(obj == {'LRANGE': ('abc', 'def')})
 
+	@need_msgpack
+	def test_large_list(self):
+		"list larger than the first estimate of the output size"
+		self.query('DEL/hello')
+		values = ['%05d' % i + 'x' * (i % 100) for i in range(2000)]
+		for i in range(0, len(values), 200):
+			self.query('RPUSH/hello/' + '/'.join(values[i:i + 200]))
+		f = self.query('LRANGE/hello/0/-1.msg')
+		obj = msgpack.loads(f.read())
+		self.assertTrue(obj == {'LRANGE': tuple(values)})
+
+	@need_msgpack
+	def test_info(self):
+		"INFO is a map of its fields, without the section titles"
+		obj = msgpack.loads(self.query('INFO.msg').read())
+		self.assertTrue(isinstance(obj['INFO'], dict))
+		self.assertTrue('redis_version' in obj['INFO'])
+		self.assertFalse([k for k in obj['INFO'] if k.startswith('#')])
+
 	@need_msgpack
 	def test_error(self):
 		"error return type"
@@ -193,13 +245,252 @@ class TestMsgPack(TestWebdis):
 		self.assertTrue(obj['UNKNOWN'][0] == False)
 		self.assertTrue(isinstance(obj['UNKNOWN'][1], str))
 
+class TestSSE(TestWebdis):
+
+	def test_get(self):
+		"single event with the JSON output"
+		self.query('SET/hello/world')
+		f = self.query('GET/hello.sse')
+		self.assertTrue(f.headers.getheader('Content-Type') == 'text/event-stream')
+		self.assertTrue(f.read() == 'data: {"GET":"world"}\n\n')
+
+	def test_stream_resume(self):
+		"stream entries carry their ID, Last-Event-ID reads after it"
+		self.query('DEL/hello')
+		self.query('XADD/hello/1-0/f/a')
+		self.query('XADD/hello/2-0/f/b')
+		f = self.query('XREAD/STREAMS/hello/0.sse')
+		self.assertTrue(f.read() == 'id: 1-0\ndata: {"f":"a"}\n\nid: 2-0\ndata: {"f":"b"}\n\n')
+		f = self.query('XREAD/STREAMS/hello/0.sse', None, {'Last-Event-ID': '1-0'})
+		self.assertTrue(f.read() == 'id: 2-0\ndata: {"f":"b"}\n\n')
+
+class TestStream(TestWebdis):
+
+	def test_json(self):
+		"entries are sent as they come, after the given ID"
+		self.query('DEL/hello')
+		self.query('XADD/hello/1-0/f/a')
+		self.query('XADD/hello/2-0/f/b')
+		f = self.query('_stream/hello/1-0')
+		expected = '{"XREAD":[["hello",[["2-0",["f","b"]]]]]}'
+		self.assertTrue(f.read(len(expected)) == expected)
+
+	def test_error(self):
+		"an error after the first entries ends the response"
+		self.query('DEL/hello')
+		self.query('XGROUP/CREATE/hello/g/$/MKSTREAM')
+		s = socket.create_connection((host, port), 5)
+		s.sendall('GET /_stream/hello/g/c HTTP/1.1\r\nHost: %s\r\n\r\n' % host)
+		time.sleep(0.1)
+		self.query('XADD/hello/1-0/f/a')
+		data = ''
+		while '"a"' not in data:
+			data += s.recv(4096)
+		self.query('XGROUP/DESTROY/hello/g')
+		while not data.endswith('\r\n0\r\n\r\n'):
+			chunk = s.recv(4096)
+			self.assertTrue(chunk)
+			data += chunk
+		self.assertTrue('NOGROUP' in data)
+
+		# the connection is still usable
+		s.sendall('GET /PING HTTP/1.1\r\nHost: %s\r\n\r\n' % host)
+		data = ''
+		while not data.endswith('{"PING":[true,"PONG"]}'):
+			chunk = s.recv(4096)
+			self.assertTrue(chunk)
+			data += chunk
+		s.close()
+
+class TestHub(TestWebdis):
+
+	def subscribe(self, channel):
+		s = socket.create_connection((host, port), 5)
+		s.sendall('GET /SUBSCRIBE/%s HTTP/1.1\r\nHost: %s\r\n\r\n' % (channel, host))
+		self.read_until(s, '', '["subscribe","%s",1]' % channel)
+		return s
+
+	def read_until(self, s, data, end):
+		while end not in data:
+			chunk = s.recv(4096)
+			if not chunk:
+				break
+			data += chunk
+		return data
+
+	def test_fan_out(self):
+		"subscribers of the same channel get each message once"
+		channel = 'hub-%d' % random.randint(0, 1 << 30)
+		subs = [self.subscribe(channel) for i in range(2)]
+		for i in range(3):
+			self.query('PUBLISH/%s/msg-%d' % (channel, i))
+		self.query('PUBLISH/%s/end' % channel)
+		for s in subs:
+			data = self.read_until(s, '', '"end"]')
+			s.close()
+			for i in range(3):
+				self.assertTrue(data.count('"msg-%d"' % i) == 1)
+
+	def test_disconnect(self):
+		"a subscriber leaving doesn't stop the messages to the others"
+		channel = 'hub-%d' % random.randint(0, 1 << 30)
+		a, b = self.subscribe(channel), self.subscribe(channel)
+		self.query('PUBLISH/%s/first' % channel)
+		self.read_until(a, '', '"first"]')
+		a.close()
+		time.sleep(0.1)
+		self.query('PUBLISH/%s/second' % channel)
+		data = self.read_until(b, '', '"second"]')
+		b.close()
+		self.assertTrue(data.count('"first"') == 1 and data.count('"second"') == 1)
+
+		# the channel is subscribed to again
+		c = self.subscribe(channel)
+		self.query('PUBLISH/%s/third' % channel)
+		self.assertTrue('"third"]' in self.read_until(c, '', '"third"]'))
+		c.close()
+
+class TestChanges(TestWebdis):
+
+	def test_value(self):
+		"a change to a string comes with the new value"
+		key = 'changes-%d' % random.randint(0, 1 << 30)
+		s = socket.create_connection((host, port), 5)
+		s.sendall('GET /_changes/%s?value=1 HTTP/1.1\r\nHost: %s\r\n\r\n' % (key, host))
+		time.sleep(0.2)
+		self.query('SET/%s/hello' % key)
+		data = ''
+		while '}\n' not in data:
+			chunk = s.recv(4096)
+			self.assertTrue(chunk)
+			data += chunk
+		s.close()
+		self.assertTrue('{"key":"%s","event":"set","value":"hello"}\n' % key in data)
+
+class TestSplice(TestWebdis):
+	"needs splice_threshold in the config"
+
+	def setUp(self):
+		if not self.stats()['splice']['threshold']:
+			self.skipTest('no splice_threshold')
+
+	def put(self, key, value):
+		r = urllib2.Request(self.wrap('SET/%s' % key), value)
+		r.get_method = lambda: 'PUT'
+		urllib2.urlopen(r).read()
+
+	def read_response(self, s, data):
+		while '\r\n\r\n' not in data:
+			data += s.recv(65536)
+		head, data = data.split('\r\n\r\n', 1)
+		sz = int(re.search('Content-Length: (\\d+)', head).group(1))
+		while len(data) < sz:
+			data += s.recv(65536)
+		return head, data[:sz], data[sz:]
+
+	def test_large(self):
+		"a large value, then another response on the same connection"
+		key = 'splice-%d' % random.randint(0, 1 << 30)
+		value = ''.join(random.choice('abcdefghijklmnopqrstuvwxyz') for i in range(3 * self.stats()['splice']['threshold']))
+		self.put(key, value)
+		self.put(key + '-small', 'small')
+		n = self.stats()['splice']['spliced']
+
+		s = socket.create_connection((host, port), 5)
+		s.sendall('GET /GET/%s.bin HTTP/1.1\r\nHost: %s\r\n\r\n' % (key, host))
+		head, body, rest = self.read_response(s, '')
+		self.assertTrue('binary/octet-stream' in head)
+		self.assertTrue(body == value)
+		s.sendall('GET /GET/%s-small.txt HTTP/1.1\r\nHost: %s\r\n\r\n' % (key, host))
+		head, body, rest = self.read_response(s, rest)
+		s.close()
+		self.assertTrue(body == 'small')
+		self.assertTrue(self.stats()['splice']['spliced'] > n)
+
+	def test_not_cached(self):
+		"values read on a splice connection aren't kept in the local cache"
+		if not self.stats()['cache']['enabled']:
+			self.skipTest('no local cache')
+		key = 'splice-%d' % random.randint(0, 1 << 30)
+		self.put(key, 'small')
+		n = self.stats()['cache']['inserts']
+		self.assertTrue(self.query('GET/%s.txt' % key).read() == 'small')
+		self.assertTrue(self.stats()['cache']['inserts'] == n)
+
+	def test_missing(self):
+		try:
+			self.query('GET/splice-missing-%d.bin' % random.randint(0, 1 << 30))
+			self.fail('no 404')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 404)
+
+	def test_wrong_type(self):
+		"errors are formatted as usual"
+		key = 'splice-%d' % random.randint(0, 1 << 30)
+		self.query('RPUSH/%s/a' % key)
+		f = self.query('GET/%s.bin' % key)
+		self.assertTrue(f.read().startswith('-WRONGTYPE'))
+
+class TestChunked(TestWebdis):
+	"needs chunked_threshold in the config"
+
+	def setUp(self):
+		if not self.stats()['chunked']['threshold']:
+			self.skipTest('no chunked_threshold')
+
+	def read_head(self, s, data):
+		while '\r\n\r\n' not in data:
+			chunk = s.recv(65536)
+			self.assertTrue(chunk)
+			data += chunk
+		return data.split('\r\n\r\n', 1)
+
+	def read_chunks(self, s, data):
+		body = ''
+		while True:
+			while '\r\n' not in data:
+				data += s.recv(65536)
+			sz, data = data.split('\r\n', 1)
+			sz = int(sz, 16)
+			while len(data) < sz + 2:
+				data += s.recv(65536)
+			body, data = body + data[:sz], data[sz + 2:]
+			if not sz:
+				return body, data
+
+	def test_pipelined(self):
+		"a large LRANGE, then a request sent while its chunks are on their way"
+		key = 'chunked-%d' % random.randint(0, 1 << 30)
+		n = max(20000, 2 * self.stats()['chunked']['threshold'])
+		values = ['%06d' % i + 'x' * 400 for i in range(n)]
+		for i in range(0, n, 100):
+			self.query('RPUSH/%s/%s' % (key, '/'.join(values[i:i + 100])))
+		self.query('SET/%s-small/small' % key)
+
+		s = socket.create_connection((host, port), 5)
+		s.sendall('GET /LRANGE/%s/0/-1 HTTP/1.1\r\nHost: %s\r\n\r\n' % (key, host))
+		head, rest = self.read_head(s, '')
+		self.assertTrue('Transfer-Encoding: chunked' in head)
+		s.sendall('GET /GET/%s-small HTTP/1.1\r\nHost: %s\r\n\r\n' % (key, host))
+		time.sleep(0.3) # the socket buffers fill up, chunks are left queued
+		body, rest = self.read_chunks(s, rest)
+		self.assertTrue(json.loads(body) == {'LRANGE': values})
+
+		head, rest = self.read_head(s, rest)
+		sz = int(re.search('Content-Length: (\\d+)', head).group(1))
+		while len(rest) < sz:
+			rest += s.recv(65536)
+		s.close()
+		self.assertTrue(json.loads(rest) == {'GET': 'small'})
+		self.query('DEL/%s/%s-small' % (key, key))
+
 class TestETag(TestWebdis):
 
 	def test_etag_match(self):
 		self.query('SET/hello/world')
-		h = hashlib.md5("world").hexdigest()	# match Etag
+		h = self.query('GET/hello.txt').headers.getheader('ETag')	# match Etag
 		try:
-			f = self.query('GET/hello.txt', None, {'If-None-Match': '"'+ h +'"'})
+			f = self.query('GET/hello.txt', None, {'If-None-Match': h})
 		except urllib2.HTTPError as e:
 			self.assertTrue(e.code == 304)
 			return
@@ -207,10 +498,404 @@ class TestETag(TestWebdis):
 
 	def test_etag_fail(self):
 		self.query('SET/hello/world')
-		h = hashlib.md5("nonsense").hexdigest()	# non-matching Etag
-		f = self.query('GET/hello.txt', None, {'If-None-Match': '"'+ h +'"'})
+		h = '"0123456789abcdef"'	# non-matching Etag
+		f = self.query('GET/hello.txt', None, {'If-None-Match': h})
 		self.assertTrue(f.read() == 'world')
 
+class TestBatch(TestWebdis):
+
+	def test_json(self):
+		"several commands in one request"
+		self.query('DEL/hello')
+		f = self.query('_batch', '[["SET","hello","world"],["GET","hello"],["INCR","hello"]]')
+		self.assertTrue(f.headers.getheader('Content-Type') == 'application/json')
+		obj = json.loads(f.read())
+		self.assertTrue(len(obj) == 3)
+		self.assertTrue(obj[0] == {'SET': [True, 'OK']})
+		self.assertTrue(obj[1] == {'GET': 'world'})
+		self.assertTrue(obj[2]['INCR'][0] == False)
+
+	def test_raw(self):
+		"raw output is a multi-bulk reply"
+		self.query('SET/hello/world')
+		f = self.query('_batch.raw', '[["GET","hello"],["DEL","hello"]]')
+		self.assertTrue(f.read() == '*2\r\n$5\r\nworld\r\n:1\r\n')
+
+	def test_forbidden(self):
+		"commands rejected by the ACLs are reported inline"
+		f = self.query('_batch', '[["MULTI"],["PING"]]')
+		obj = json.loads(f.read())
+		self.assertTrue(obj[0] == {'MULTI': [False, 'Forbidden']})
+		self.assertTrue(obj[1] == {'PING': [True, 'PONG']})
+
+	def test_blocking(self):
+		"a batch with a blocking command holds a connection of the blocking pool"
+		key = 'batch-%d' % random.randint(0, 1 << 30)
+		body = json.dumps([['BLPOP', key, 1]])
+		s = socket.create_connection((host, port), 5)
+		s.sendall('POST /_batch HTTP/1.1\r\nHost: %s\r\nContent-Length: %d\r\n\r\n%s'
+			% (host, len(body), body))
+		time.sleep(0.3)
+		busy = self.stats()['blocking']['busy']
+		reply = s.recv(4096)
+		s.close()
+		self.assertTrue(busy >= 1)
+		self.assertTrue(reply.endswith('[{"BLPOP":null}]'))
+
+	def test_timeout(self):
+		"X-Timeout-Ms applies to the whole batch"
+		key = 'batch-%d' % random.randint(0, 1 << 30)
+		start = time.time()
+		try:
+			self.query('_batch', json.dumps([['BLPOP', key, 5]]), {'X-Timeout-Ms': '200'})
+			self.fail('no timeout')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 504)
+		self.assertTrue(time.time() - start < 2)
+
+class TestDeadline(TestWebdis):
+
+	def blpop(self, timeout, p = None):
+		"BLPOP for 1s, and whether it got a 504"
+		url = 'http://%s:%d/BLPOP/deadline-%d/1' % (host, p or port, random.randint(0, 1 << 30))
+		try:
+			urllib2.urlopen(urllib2.Request(url, None, {'X-Timeout-Ms': timeout})).read()
+			return False
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 504)
+			return True
+
+	def test_header(self):
+		self.assertTrue(self.blpop('200'))
+
+	def test_invalid(self):
+		"only positive numbers are used"
+		for timeout in ('abc', '0', '-200', '200ms'):
+			self.assertFalse(self.blpop(timeout))
+
+	def test_longer(self):
+		"$WEBDIS_TIMEOUT_PORT: a webdis with request_timeout_ms under 1s"
+		p = os.getenv('WEBDIS_TIMEOUT_PORT')
+		if not p:
+			self.skipTest('$WEBDIS_TIMEOUT_PORT not set')
+		for timeout in ('10000', '0', '-1', str(1 << 62)):
+			start = time.time()
+			self.assertTrue(self.blpop(timeout, int(p)))
+			self.assertTrue(time.time() - start < 0.9)
+
+class TestTransaction(TestWebdis):
+
+	def test_multi(self):
+		"commands are run in MULTI/EXEC"
+		self.query('DEL/hello')
+		f = self.query('_multi', '[["SET","hello","41"],["INCR","hello"],["GET","hello"]]')
+		obj = json.loads(f.read())
+		self.assertTrue(obj == [{'SET': [True, 'OK']}, {'INCR': 42}, {'GET': '42'}])
+
+	def test_forbidden(self):
+		"a forbidden command rejects the whole transaction"
+		self.query('SET/hello/world')
+		try:
+			self.query('_multi', '[["DEL","hello"],["WATCH","hello"]]')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 403)
+			f = self.query('GET/hello')
+			self.assertTrue(f.read() == '{"GET":"world"}')
+			return
+		self.assertTrue(False) # we should have received a 403.
+
+class TestScript(TestWebdis):
+
+	def calls(self, name):
+		"number of calls to a Redis command, from INFO commandstats"
+		info = self.query('INFO/commandstats.txt').read()
+		m = re.search('cmdstat_%s:calls=([0-9]+)' % name, info)
+		return int(m.group(1)) if m else 0
+
+	def script(self):
+		"a script Redis hasn't seen yet"
+		return urllib2.quote("return 'webdis' -- %d" % random.randint(0, 1 << 30))
+
+	def test_evalsha(self):
+		"a script that was loaded is sent as EVALSHA"
+		s = self.script()
+		first = self.query('EVAL/%s/0' % s).read()
+		n = self.calls('evalsha')
+		self.assertTrue(self.query('EVAL/%s/0' % s).read() == first)
+		self.assertTrue(self.calls('evalsha') == n + 1)
+
+	def test_noscript(self):
+		"a script flushed behind our back is sent again with EVAL"
+		s = self.script()
+		first = self.query('EVAL/%s/0' % s).read()
+		self.query('_batch', '[["SCRIPT","FLUSH"]]')	# not seen by the script cache
+		n, e = self.calls('evalsha'), self.calls('eval')
+		self.assertTrue(self.query('EVAL/%s/0' % s).read() == first)
+		self.assertTrue(self.calls('evalsha') == n + 1)	# NOSCRIPT
+		self.assertTrue(self.calls('eval') == e + 1)
+
+	def test_flush(self):
+		"after SCRIPT FLUSH, scripts are loaded again with EVAL"
+		s = self.script()
+		first = self.query('EVAL/%s/0' % s).read()
+		self.query('SCRIPT/FLUSH')
+		n, e = self.calls('evalsha'), self.calls('eval')
+		self.assertTrue(self.query('EVAL/%s/0' % s).read() == first)
+		self.assertTrue(self.calls('evalsha') == n)
+		self.assertTrue(self.calls('eval') == e + 1)
+		self.assertTrue(self.query('EVAL/%s/0' % s).read() == first)
+		self.assertTrue(self.calls('evalsha') == n + 1)
+
+class TestCache(TestWebdis):
+	"needs cache_size in the config"
+
+	def setUp(self):
+		if not self.stats()['cache']['ready']:
+			self.skipTest('no local cache')
+		self.key = 'cache-%d' % random.randint(0, 1 << 30)
+
+	def redis(self, *args):
+		"a command sent to Redis directly, not through webdis"
+		s = socket.create_connection((redis_host, redis_port))
+		s.sendall('*%d\r\n' % len(args) + ''.join('$%d\r\n%s\r\n' % (len(a), a) for a in args))
+		reply = s.recv(1024)
+		s.close()
+		return reply
+
+	def hits(self):
+		return self.stats()['cache']['hits']
+
+	def test_hit(self):
+		self.query('SET/%s/a' % self.key)
+		self.query('GET/%s' % self.key)
+		hits = self.hits()
+		self.assertTrue(self.query('GET/%s' % self.key).read() == '{"GET":"a"}')
+		self.assertTrue(self.hits() == hits + 1)
+
+	def test_invalidation(self):
+		"written by another client of Redis"
+		self.query('SET/%s/a' % self.key)
+		self.query('GET/%s' % self.key)
+		self.redis('SET', self.key, 'b')
+		for i in range(20):
+			if self.query('GET/%s' % self.key).read() == '{"GET":"b"}':
+				return
+			time.sleep(0.05)
+		self.fail('not invalidated')
+
+	def test_read_your_writes(self):
+		self.query('SET/%s/a' % self.key)
+		self.query('GET/%s' % self.key)
+		self.query('SET/%s/b' % self.key)
+		self.assertTrue(self.query('GET/%s' % self.key).read() == '{"GET":"b"}')
+		self.query('_batch', json.dumps([['SET', self.key, 'c']]))
+		self.assertTrue(self.query('GET/%s' % self.key).read() == '{"GET":"c"}')
+
+class TestCluster(TestWebdis):
+	"needs cluster mode"
+
+	def setUp(self):
+		if not self.stats()['cluster']['enabled']:
+			self.skipTest('not in cluster mode')
+
+	def test_slots(self):
+		"keys on all the nodes"
+		for i in range(100):
+			self.query('SET/cluster-%d/%d' % (i, i))
+			self.assertTrue(self.query('GET/cluster-%d' % i).read() == '{"GET":"%d"}' % i)
+
+	def redirected(self, var, counter):
+		key = os.getenv(var)
+		if not key:
+			self.skipTest('$%s not set' % var)
+		n = self.stats()['cluster'][counter]
+		self.query('SET/%s/x' % key)
+		self.assertTrue(self.query('GET/%s' % key).read() == '{"GET":"x"}')
+		self.assertTrue(self.stats()['cluster'][counter] > n)
+
+	def test_moved(self):
+		self.redirected('WEBDIS_MOVED_KEY', 'moved')
+
+	def test_ask(self):
+		self.redirected('WEBDIS_ASK_KEY', 'ask')
+
+	def test_changes(self):
+		"keyspace notifications only cover the keys of one node"
+		try:
+			self.query('_changes/cluster-*')
+			self.fail('/_changes in cluster mode')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 403)
+
+class TestShards(TestWebdis):
+	"needs shards, and nothing at redis_host"
+
+	def setUp(self):
+		if not self.stats()['shards']['count']:
+			self.skipTest('no shards')
+
+	def test_ready(self):
+		"readiness only depends on the shards"
+		self.assertTrue(json.loads(self.query('_ready').read()) == {'ready': True})
+
+	def test_keyless(self):
+		"commands without a key go to the first shard"
+		self.assertTrue(self.query('PING').read() == '{"PING":[true,"PONG"]}')
+		self.assertTrue(self.query('PUBLISH/shards-channel/hello').read() == '{"PUBLISH":0}')
+
+	def test_scatter(self):
+		"multi-key commands are split across shards, and their replies merged"
+		keys = ['shards-%d' % i for i in range(20)]
+		self.query('MSET/' + '/'.join('%s/%d' % (k, i) for i, k in enumerate(keys)))
+		f = self.query('MGET/' + '/'.join(keys))
+		self.assertTrue(json.loads(f.read()) == {'MGET': [str(i) for i in range(20)]})
+		self.assertTrue(json.loads(self.query('DEL/' + '/'.join(keys)).read()) == {'DEL': 20})
+
+	def test_scatter_busy(self):
+		"needs pool_size 1 and pool_max_pending 1: split commands wait for busy shards"
+		keys = '/'.join('shards-%d' % i for i in range(20))
+		blpop = threading.Thread(target = lambda: self.query('BLPOP/shards-%d/1' % random.randint(0, 1 << 30)).read())
+		blpop.start()
+		time.sleep(0.2) # its shard has no free connection until it returns
+		f = self.query('MGET/' + keys)
+		blpop.join()
+		self.assertTrue(f.getcode() == 200)
+		self.assertTrue(all(c['pending'] == 0 for c in self.stats()['pool']['connections']))
+
+class TestWebSocket(TestWebdis):
+	"needs websockets in the config"
+
+	def ws_connect(self, path = '/.json', p = None, headers = ''):
+		s = socket.create_connection((host, p or port), 5)
+		s.sendall('GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+			'Origin: http://%s\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n'
+			'Sec-WebSocket-Version: 13\r\n%s\r\n' % (path, host, host, headers))
+		head = ''
+		while '\r\n\r\n' not in head:
+			data = s.recv(1)
+			if not data:
+				break
+			head += data
+		if not head.startswith('HTTP/1.1 101'):
+			s.close()
+			self.skipTest('no WebSockets')
+		return s
+
+	def ws_send(self, s, msg, op = 0x81):
+		mask = os.urandom(4)
+		if len(msg) < 126:
+			head = struct.pack('!BB', op, 0x80 | len(msg))
+		else:
+			head = struct.pack('!BBH', op, 0x80 | 126, len(msg))
+		s.sendall(head + mask + ''.join(chr(ord(c) ^ ord(mask[i % 4])) for i, c in enumerate(msg)))
+
+	def ws_read(self, s, n):
+		data = ''
+		while len(data) < n:
+			chunk = s.recv(n - len(data))
+			if not chunk:
+				raise socket.error('closed')
+			data += chunk
+		return data
+
+	def ws_recv(self, s):
+		op, sz = struct.unpack('!BB', self.ws_read(s, 2))
+		if sz == 126:
+			sz = struct.unpack('!H', self.ws_read(s, 2))[0]
+		elif sz == 127:
+			sz = struct.unpack('!Q', self.ws_read(s, 8))[0]
+		return self.ws_read(s, sz)
+
+	def test_commands(self):
+		s = self.ws_connect()
+		self.ws_send(s, json.dumps(['SET', 'ws-key', 'hello']))
+		self.assertTrue(json.loads(self.ws_recv(s)) == {'SET': [True, 'OK']})
+		self.ws_send(s, json.dumps(['GET', 'ws-key']))
+		self.assertTrue(json.loads(self.ws_recv(s)) == {'GET': 'hello'})
+		s.close()
+
+	def test_pipelined(self):
+		"commands sent without waiting for their replies"
+		key = 'ws-%d' % random.randint(0, 1 << 30)
+		s = self.ws_connect()
+		for i in range(50):
+			self.ws_send(s, json.dumps(['INCR', key]))
+		replies = [json.loads(self.ws_recv(s)) for i in range(50)]
+		s.close()
+		self.assertTrue(sorted(r['INCR'] for r in replies) == range(1, 51))
+
+	@need_msgpack
+	def test_msgpack(self):
+		"msgpack arrays in binary frames, on /.msg and on /"
+		for path in ('/.msg', '/'):
+			s = self.ws_connect(path)
+			self.ws_send(s, msgpack.dumps(['SET', 'ws-key', 'hello']), 0x82)
+			self.assertTrue(msgpack.loads(self.ws_recv(s)) == {'SET': (True, 'OK')})
+			self.ws_send(s, msgpack.dumps(['GET', 'ws-key']), 0x82)
+			self.assertTrue(msgpack.loads(self.ws_recv(s)) == {'GET': 'hello'})
+			s.close()
+
+	def test_blocking(self):
+		"blocking commands use the blocking pool"
+		s = self.ws_connect()
+		self.ws_send(s, json.dumps(['BLPOP', 'ws-%d' % random.randint(0, 1 << 30), 1]))
+		time.sleep(0.3)
+		busy = self.stats()['blocking']['busy']
+		self.assertTrue(json.loads(self.ws_recv(s)) == {'BLPOP': None})
+		s.close()
+		self.assertTrue(busy >= 1)
+
+	def test_timeout(self):
+		"X-Timeout-Ms on the upgrade request applies to each command"
+		s = self.ws_connect(headers = 'X-Timeout-Ms: 200\r\n')
+		start = time.time()
+		self.ws_send(s, json.dumps(['BLPOP', 'ws-%d' % random.randint(0, 1 << 30), 5]))
+		self.assertTrue(json.loads(self.ws_recv(s)) == {'BLPOP': [False, 'Gateway Timeout']})
+		self.assertTrue(time.time() - start < 2)
+		self.ws_send(s, json.dumps(['PING']))
+		self.assertTrue(json.loads(self.ws_recv(s)) == {'PING': [True, 'PONG']})
+		s.close()
+
+	def test_redis_down(self):
+		"$WEBDIS_DOWN_PORT: a webdis whose Redis is stopped"
+		down = os.getenv('WEBDIS_DOWN_PORT')
+		if not down:
+			self.skipTest('$WEBDIS_DOWN_PORT not set')
+		s = self.ws_connect(p = int(down))
+		for i in range(3):
+			self.ws_send(s, json.dumps(['GET', 'ws-key']))
+			self.assertTrue(json.loads(self.ws_recv(s)) == {'GET': [False, 'Service Unavailable']})
+		s.close()
+
+class TestStats(TestWebdis):
+
+	def test_forbidden(self):
+		"/_stats needs an ACL enabling STATS"
+		try:
+			self.query('_stats')
+			self.fail('/_stats without authorization')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 403)
+
+	def test_allowed(self):
+		self.assertTrue('pool' in self.stats())
+
+	def test_ready(self):
+		f = self.query('_ready')
+		self.assertTrue(f.read() == '{"ready":true}')
+
+	def test_not_ready(self):
+		"$WEBDIS_DOWN_PORT: a webdis whose Redis is stopped"
+		down = os.getenv('WEBDIS_DOWN_PORT')
+		if not down:
+			self.skipTest('$WEBDIS_DOWN_PORT not set')
+		try:
+			urllib2.urlopen('http://%s:%s/_ready' % (host, down))
+			self.fail('ready without Redis')
+		except urllib2.HTTPError as e:
+			self.assertTrue(e.code == 503)
+			self.assertTrue(e.read() == '{"ready":false}')
+
 class TestDbSwitch(TestWebdis):
 	def test_db(self):
 		"Test database change"
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "formats/escape.h"
+
+/*
+ * Throughput of the JSON string escaping, vectorized and byte by byte,
+ * on a large value with an escape every so many bytes.
+ */
+
+typedef char *(*escape_fun)(char *, const char *, size_t);
+
+static double
+run(escape_fun f, char *out, const char *s, size_t len, int n) {
+
+	struct timespec t0, t1;
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < n; ++i) {
+		f(out, s, len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return (double)len * n / secs / (1024 * 1024);
+}
+
+int
+main(int argc, char *argv[]) {
+
+	int opt, n = 1000;
+	size_t i, len = 64 * 1024, every = 1000;
+	char *s, *out;
+	double simd, scalar;
+
+	while ((opt = getopt(argc, argv, "l:e:n:")) != -1) {
+		switch (opt) {
+			case 'l':
+				len = (size_t)atol(optarg);
+				break;
+
+			case 'e':
+				every = (size_t)atol(optarg);
+				break;
+
+			case 'n':
+				n = atoi(optarg);
+				break;
+
+			default:
+				printf("Usage: %s [options]\n"
+					"Options are:\n"
+					"\t-l length\t(value size in bytes, default = 65536)\n"
+					"\t-e every\t(one quote every N bytes, 0 for none, default = 1000)\n"
+					"\t-n count\t(iterations, default = 1000)\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	s = malloc(len);
+	out = malloc(6 * len + 2);
+	for(i = 0; i < len; ++i) {
+		s[i] = (every && i % every == every - 1) ? '"' : 'a' + i % 26;
+	}
+
+	scalar = run(escape_json_write_scalar, out, s, len, n);
+	simd = run(escape_json_write, out, s, len, n);
+	printf("%zu bytes: byte by byte %.0f MB/s, vectorized %.0f MB/s (x%.1f)\n",
+			len, scalar, simd, simd / scalar);
+
+	free(s);
+	free(out);
+	return EXIT_SUCCESS;
+}
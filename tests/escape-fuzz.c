@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "formats/escape.h"
+
+/*
+ * Compares the vectorized JSON string escaping with the byte by byte
+ * version on random strings, at every alignment.
+ */
+
+static const char *pieces[] = {
+	"\"", "\\", "\n", "\t", "\x01", "\x1f", "\x7f", " ", "/",
+	"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",	/* valid UTF-8 */
+	"\xc3", "\xe2\x82", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xff"	/* invalid */
+};
+
+static size_t
+fill(char *s, size_t max) {
+
+	size_t sz = 0, n, i;
+
+	while(sz < max) {
+		switch(rand() % 4) {
+			case 0: /* long clean run */
+				n = rand() % 100;
+				for(i = 0; i < n && sz < max; ++i) {
+					s[sz++] = 'a' + rand() % 26;
+				}
+				break;
+
+			case 1: /* any byte */
+				s[sz++] = (char)(rand() % 256);
+				break;
+
+			default: /* something to escape or to validate */
+				n = rand() % (sizeof(pieces) / sizeof(pieces[0]));
+				if(rand() % 8 == 0) { /* mostly valid */
+					n = rand() % 12;
+				}
+				for(i = 0; pieces[n][i] && sz < max; ++i) {
+					s[sz++] = pieces[n][i];
+				}
+				break;
+		}
+	}
+	return sz;
+}
+
+static int
+check(const char *s, size_t len) {
+
+	size_t sz = escape_json_size(s, len), sz_ref = escape_json_size_scalar(s, len);
+	char *out, *out_ref, *end, *end_ref;
+	int ret = 0;
+
+	if(sz != sz_ref) {
+		fprintf(stderr, "size mismatch on %zu bytes: %zu, expected %zu\n", len, sz, sz_ref);
+		return 1;
+	}
+
+	out = malloc(6 * len + 4);
+	out_ref = malloc(6 * len + 4);
+	end = escape_json_write(out, s, len);
+	end_ref = escape_json_write_scalar(out_ref, s, len);
+
+	if(end - out != end_ref - out_ref || memcmp(out, out_ref, end - out) != 0) {
+		fprintf(stderr, "output mismatch on %zu bytes\n", len);
+		ret = 1;
+	} else if((size_t)(end - out) != (sz ? sz : 4)) {
+		fprintf(stderr, "wrote %zu bytes on %zu, expected %zu\n",
+				(size_t)(end - out), len, sz ? sz : 4);
+		ret = 1;
+	}
+	free(out);
+	free(out_ref);
+	return ret;
+}
+
+int
+main(int argc, char *argv[]) {
+
+	int opt, i, n = 100000;
+	unsigned int seed = 1;
+	char src[4096], buf[4096 + 32];
+	size_t len, off;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = atoi(optarg);
+				break;
+
+			case 's':
+				seed = (unsigned int)atol(optarg);
+				break;
+
+			default:
+				printf("Usage: %s [-n iterations] [-s seed]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	srand(seed);
+
+	for(i = 0; i < n; ++i) {
+		len = fill(src, (size_t)(rand() % 2 ? rand() % 80 : rand() % (int)sizeof(src)));
+		for(off = 0; off < 32; ++off) {
+			memcpy(buf + off, src, len);
+			if(check(buf + off, len)) {
+				fprintf(stderr, "seed %u, iteration %d, offset %zu\n", seed, i, off);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	printf("%d strings OK\n", n);
+
+	return EXIT_SUCCESS;
+}
@@ -5,11 +5,18 @@
 #include "cmd.h"
 #include "worker.h"
 #include "pool.h"
+#include "hub.h"
 #include "http.h"
+#include "server.h"
+#include "conf.h"
 
 /* message parsers */
+#include "formats/common.h"
 #include "formats/json.h"
 #include "formats/raw.h"
+#ifdef MSGPACK
+#include "formats/msgpack.h"
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -168,11 +175,21 @@ ws_handshake_reply(struct http_client *c) {
 
 
 static int
-ws_execute(struct http_client *c, const char *frame, size_t frame_len) {
+ws_execute(struct http_client *c, const char *frame, size_t frame_len, int binary) {
 
 	struct cmd*(*fun_extract)(struct http_client *, const char *, size_t) = NULL;
 	formatting_fun fun_reply = NULL;
 
+#ifdef MSGPACK
+	/* binary frames on the default endpoint are MessagePack */
+	if(strncmp(c->path, "/.msg", 5) == 0 ||
+	   (binary && c->path_sz == 1 && strncmp(c->path, "/", 1) == 0)) {
+		fun_extract = msgpack_ws_extract;
+		fun_reply = msgpack_reply;
+	} else
+#else
+	(void)binary;
+#endif
 	if((c->path_sz == 1 && strncmp(c->path, "/", 1) == 0) ||
 	   strncmp(c->path, "/.json", 6) == 0) {
 		fun_extract = json_ws_extract;
@@ -192,7 +209,14 @@ ws_execute(struct http_client *c, const char *frame, size_t frame_len) {
 			cmd_setup(cmd, c);
 			cmd->is_websocket = 1;
 
-			if (c->pub_sub != NULL) {
+			if (c->w->hub && cmd_is_subscribe(cmd) && cmd->count > 1) {
+				/* shared subscription, replies come from the hub */
+				hub_subscribe(c->w->hub, cmd, fun_reply);
+				return 0;
+			} else if (c->w->hub && cmd_is_unsubscribe(cmd)) {
+				hub_unsubscribe(c->w->hub, cmd);
+				return 0;
+			} else if (c->pub_sub != NULL) {
 				/* This client already has its own connection
 				 * to Redis due to a subscription; use it from
 				 * now on. */
@@ -201,11 +225,22 @@ ws_execute(struct http_client *c, const char *frame, size_t frame_len) {
 				/* New subscribe command; make new Redis context
 				 * for this client */
 				cmd->ac = pool_connect(c->w->pool, cmd->database, 0);
+				if(!cmd->ac) {
+					cmd->f_format = fun_reply;
+					format_send_error(cmd, 503, "Service Unavailable");
+					return 0;
+				}
 				c->pub_sub = cmd;
 				cmd->pub_sub_client = c;
 			} else {
-				/* get Redis connection from pool */
-				cmd->ac = (redisAsyncContext*)pool_get_context(c->w->pool);
+				/* same connections as HTTP requests, or the same queue */
+				cmd->database = c->w->s->cfg->database;
+				cmd->f_format = fun_reply;
+				cmd_set_deadline(cmd);
+				if(cmd_execute(cmd, fun_reply) != CMD_SENT) {
+					format_send_error(cmd, 503, "Service Unavailable");
+				}
+				return 0;
 			}
 
 			/* send it off */
@@ -287,8 +322,10 @@ ws_parse_data(const char *frame, size_t sz, struct ws_msg **msg) {
 		return WS_READING;
 	}
 
-	if(!*msg)
+	if(!*msg) {
 		*msg = ws_msg_new();
+		(*msg)->opcode = frame[0] & 0x0F; /* the following fragments have none */
+	}
 	ws_msg_add(*msg, p, len, has_mask ? mask : NULL);
 	(*msg)->total_sz += len + (p - frame);
 
@@ -308,33 +345,36 @@ ws_add_data(struct http_client *c) {
 
 	enum ws_state state;
 
-	state = ws_parse_data(c->buffer, c->sz, &c->frame);
+	/* the client might not wait for a reply before sending the next message */
+	do {
+		state = ws_parse_data(c->buffer, c->sz, &c->frame);
 
-	if(state == WS_MSG_COMPLETE) {
-		int ret = ws_execute(c, c->frame->payload, c->frame->payload_sz);
+		if(state == WS_MSG_COMPLETE) {
+			int ret = ws_execute(c, c->frame->payload, c->frame->payload_sz,
+					c->frame->opcode == WS_BINARY_FRAME);
 
-		/* remove frame from client buffer */
-		http_client_remove_data(c, c->frame->total_sz);
+			/* remove frame from client buffer */
+			http_client_remove_data(c, c->frame->total_sz);
 
-		/* free frame and set back to NULL */
-		ws_msg_free(&c->frame);
+			/* free frame and set back to NULL */
+			ws_msg_free(&c->frame);
 
-		if(ret != 0) {
-			/* can't process frame. */
-			return WS_ERROR;
+			if(ret != 0) {
+				/* can't process frame. */
+				return WS_ERROR;
+			}
 		}
-	}
+	} while(state == WS_MSG_COMPLETE && c->sz);
 	return state;
 }
 
-int
-ws_reply(struct cmd *cmd, const char *p, size_t sz) {
+static struct http_frame *
+ws_frame_opcode(const char *p, size_t sz, unsigned char opcode) {
 
-	char *frame = malloc(sz + 8); /* create frame by prepending header */
+	char *frame = malloc(sz + 10); /* create frame by prepending header */
 	size_t frame_sz = 0;
-	struct http_response *r;
 	if (frame == NULL)
-		return -1;
+		return NULL;
 
 	/*
       The length of the "Payload data", in bytes: if 0-125, that is the
@@ -343,18 +383,18 @@ ws_reply(struct cmd *cmd, const char *p, size_t sz) {
       following 8 bytes interpreted as a 64-bit unsigned integer (the
       most significant bit MUST be 0) are the payload length.
 	  */
-	frame[0] = '\x81';
+	frame[0] = 0x80 | opcode; /* FIN */
 	if(sz <= 125) {
 		frame[1] = sz;
 		memcpy(frame + 2, p, sz);
 		frame_sz = sz + 2;
-	} else if (sz > 125 && sz <= 65536) {
+	} else if (sz > 125 && sz <= 65535) {
 		uint16_t sz16 = htons(sz);
 		frame[1] = 126;
 		memcpy(frame + 2, &sz16, 2);
 		memcpy(frame + 4, p, sz);
 		frame_sz = sz + 4;
-	} else if (sz > 65536) {
+	} else {
 		char sz64[8] = webdis_htonl64(sz);
 		frame[1] = 127;
 		memcpy(frame + 2, sz64, 8);
@@ -362,19 +402,19 @@ ws_reply(struct cmd *cmd, const char *p, size_t sz) {
 		frame_sz = sz + 10;
 	}
 
-	/* send WS frame */
-	r = http_response_init(cmd->w, 0, NULL);
-	if (cmd_is_subscribe(cmd)) {
-		r->keep_alive = 1;
-	}
-	
-	if (r == NULL)
-		return -1;
+	return http_frame_new(frame, frame_sz);
+}
 
-	r->out = frame;
-	r->out_sz = frame_sz;
-	r->sent = 0;
-	http_schedule_write(cmd->fd, r);
+/* text frame, queued on the client like HTTP chunks */
+struct http_frame *
+ws_frame(const char *p, size_t sz) {
 
-	return 0;
+	return ws_frame_opcode(p, sz, WS_TEXT_FRAME);
+}
+
+/* binary frame, for output that isn't UTF-8 text */
+struct http_frame *
+ws_binary_frame(const char *p, size_t sz) {
+
+	return ws_frame_opcode(p, sz, WS_BINARY_FRAME);
 }
@@ -6,13 +6,18 @@
 
 struct http_client;
 struct cmd;
+struct http_frame;
 
 enum ws_state {
 	WS_ERROR,
 	WS_READING,
 	WS_MSG_COMPLETE};
 
+#define WS_TEXT_FRAME	0x1
+#define WS_BINARY_FRAME	0x2
+
 struct ws_msg {
+	int opcode; /* of the first fragment */
 	char *payload;
 	size_t payload_sz;
 	size_t total_sz;
@@ -24,7 +29,10 @@ ws_handshake_reply(struct http_client *c);
 enum ws_state
 ws_add_data(struct http_client *c);
 
-int
-ws_reply(struct cmd *cmd, const char *p, size_t sz);
+struct http_frame *
+ws_frame(const char *p, size_t sz);
+
+struct http_frame *
+ws_binary_frame(const char *p, size_t sz);
 
 #endif
@@ -2,10 +2,23 @@
 #include "client.h"
 #include "http.h"
 #include "cmd.h"
+#include "batch.h"
 #include "pool.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "replica.h"
+#include "cluster.h"
+#include "shard.h"
+#include "hub.h"
+#include "stream.h"
+#include "changes.h"
+#include "splice.h"
+#include "chunked.h"
+#include "stats.h"
 #include "slog.h"
 #include "websocket.h"
 #include "conf.h"
+#include "acl.h"
 #include "server.h"
 
 #include <stdlib.h>
@@ -26,13 +39,67 @@ worker_new(struct server *s) {
 	ret = pipe(w->link);
 	(void)ret;
 
-	/* Redis connection pool */
-	w->pool = pool_new(w, s->cfg->pool_size_per_thread);
+	/* Redis connection pool, the first shard's if there are shards */
+	if(s->cfg->shard_count && !s->cfg->cluster) {
+		w->shards = shards_new(w);
+		w->pool = w->shards->pools[0];
+	} else {
+		w->pool = pool_new(w, s->cfg->redis_host, s->cfg->redis_port,
+				s->cfg->pool_size_per_thread);
+	}
+
+	if(s->cfg->coalesce_reads) {
+		w->coalesce = coalesce_new(256);
+	}
+	if(s->cfg->blocking_pool_size > 0 && !s->cfg->cluster && !s->cfg->shard_count) {
+		/* a blocking command holds its connection until it returns */
+		w->blocking = pool_new(w, s->cfg->redis_host, s->cfg->redis_port,
+				s->cfg->blocking_pool_size);
+		w->blocking->max_pending = 1;
+		w->pollers = coalesce_new(256);
+	}
+	if(s->cfg->pubsub_hub) {
+		w->hub = hub_new(w);
+		w->changes = changes_new(w);
+	}
+	if(s->cfg->cluster) {
+		/* the cache and replicas only work with a single server */
+		w->cluster = cluster_new(w);
+	} else if(!w->shards) {
+		if(s->cfg->replica_count) {
+			w->replicas = replicas_new(w);
+		}
+		if(s->cfg->cache_size) {
+			w->cache = cache_new(w);
+		}
+		if(s->cfg->splice_threshold) {
+			w->splice = splice_new(w);
+		}
+		if(s->cfg->chunked_threshold) {
+			w->chunked = chunked_new(w);
+		}
+	}
 
 	return w;
 
 }
 
+/* WebSockets opened on /_stream or /_changes only receive */
+static void
+worker_ws_feed(struct http_client *c) {
+
+	cmd_response_t ret = CMD_SENT;
+
+	if(stream_endpoint(c->path, c->path_sz)) {
+		ret = stream_run(c->w, c);
+	} else if(changes_endpoint(c->path, c->path_sz)) {
+		ret = changes_run(c->w, c);
+	}
+	if(ret != CMD_SENT) {
+		c->broken = 1;
+	}
+}
+
 void
 worker_can_read(int fd, short event, void *p) {
 
@@ -67,7 +134,9 @@ worker_can_read(int fd, short event, void *p) {
 			/* we need to use the remaining (unparsed) data as the body. */
 			if(nparsed < ret) {
 				http_client_add_to_body(c, c->buffer + nparsed + 1, c->sz - nparsed - 1);
-				ws_handshake_reply(c);
+				if(ws_handshake_reply(c) == 0) {
+					worker_ws_feed(c);
+				}
 			} else {
 				c->broken = 1;
 			}
@@ -102,6 +171,29 @@ worker_monitor_input(struct http_client *c) {
 	event_add(&c->ev, NULL);
 }
 
+/**
+ * Ready when enough connections to Redis can be used, and to each shard.
+ * Called by this worker's thread when one of its pools changes: the other
+ * threads only read the flag, never the pools themselves.
+ */
+void
+worker_update_ready(struct worker *w) {
+
+	int n, ready = pool_is_ready(w->pool);
+
+	for(n = 0; ready && w->shards && n < w->shards->count; ++n) {
+		ready = pool_is_ready(w->shards->pools[n]);
+	}
+	__atomic_store_n(&w->ready, ready, __ATOMIC_RELEASE);
+}
+
+/* from any thread */
+int
+worker_is_ready(struct worker *w) {
+
+	return __atomic_load_n(&w->ready, __ATOMIC_ACQUIRE);
+}
+
 /**
  * Called when a client is sent to this worker.
  */
@@ -125,12 +217,12 @@ worker_on_new_client(int pipefd, short event, void *ptr) {
 }
 
 static void
-worker_pool_connect(struct worker *w) {
+worker_pool_connect(struct worker *w, struct pool *p) {
 
 	int i;
 	/* create connections */
-	for(i = 0; i < w->pool->count; ++i) {
-		pool_connect(w->pool, w->s->cfg->database, 1);
+	for(i = 0; i < p->count; ++i) {
+		pool_connect(p, w->s->cfg->database, 1);
 	}
 
 }
@@ -150,11 +242,36 @@ worker_main(void *p) {
 	event_add(&ev, NULL);
 
 	/* connect to Redis */
-	worker_pool_connect(w);
+	if(!w->shards) { /* connected with the shards */
+		worker_pool_connect(w, w->pool);
+	}
+	if(w->blocking) {
+		worker_pool_connect(w, w->blocking);
+	}
+	if(w->cluster) {
+		cluster_start(w->cluster);
+	}
+	if(w->shards) {
+		shards_start(w->shards);
+	}
+	if(w->replicas) {
+		replicas_start(w->replicas);
+	}
+	if(w->cache) {
+		cache_start(w->cache);
+	}
+	if(w->hub) {
+		hub_start(w->hub);
+	}
 
 	/* loop */
 	event_base_dispatch(w->base);
 
+	if(w->cluster) {
+		cluster_free(w->cluster);
+		w->cluster = NULL;
+	}
+
 	return NULL;
 }
 
@@ -185,19 +302,44 @@ worker_process_client(struct http_client *c) {
 	/* check that the command can be executed */
 	struct worker *w = c->w;
 	cmd_response_t ret = CMD_PARAM_ERROR;
+	batch_type_t batch;
 	switch(c->parser.method) {
 		case HTTP_GET:
 			if(c->path_sz == 16 && memcmp(c->path, "/crossdomain.xml", 16) == 0) {
 				http_crossdomain(c);
 				return;
 			}
+			if(c->path_sz == 7 && memcmp(c->path, "/_stats", 7) == 0) {
+				if(acl_allow_stats(w->s->cfg, c)) {
+					stats_send(c);
+				} else {
+					slog(w->s, WEBDIS_DEBUG, "403", 3);
+					http_send_error(c, 403, "Forbidden");
+				}
+				return;
+			}
+			if(c->path_sz == 7 && memcmp(c->path, "/_ready", 7) == 0) {
+				stats_send_ready(c);
+				return;
+			}
 			slog(w->s, WEBDIS_DEBUG, c->path, c->path_sz);
-			ret = cmd_run(c->w, c, 1+c->path, c->path_sz-1, NULL, 0);
+			if(stream_endpoint(c->path, c->path_sz)) {
+				ret = stream_run(c->w, c);
+			} else if(changes_endpoint(c->path, c->path_sz)) {
+				ret = changes_run(c->w, c);
+			} else {
+				ret = cmd_run(c->w, c, 1+c->path, c->path_sz-1, NULL, 0);
+			}
 			break;
 
 		case HTTP_POST:
 			slog(w->s, WEBDIS_DEBUG, c->path, c->path_sz);
-			ret = cmd_run(c->w, c, c->body, c->body_sz, NULL, 0);
+			if((batch = batch_endpoint(c->path, c->path_sz)) != BATCH_NONE) {
+				ret = batch_run(c->w, c, batch, 1+c->path, c->path_sz-1,
+						c->body, c->body_sz);
+			} else {
+				ret = cmd_run(c->w, c, c->body, c->body_sz, NULL, 0);
+			}
 			break;
 
 		case HTTP_PUT:
@@ -5,6 +5,15 @@
 
 struct http_client;
 struct pool;
+struct coalesce;
+struct cache;
+struct replicas;
+struct cluster;
+struct shards;
+struct hub;
+struct changes;
+struct splice;
+struct chunked;
 
 struct worker {
 
@@ -18,6 +27,38 @@ struct worker {
 
 	/* Redis connection pool */
 	struct pool *pool;
+
+	/* blocking commands, one per connection; identical XREAD BLOCK share one */
+	struct pool *blocking;
+	struct coalesce *pollers;
+
+	/* slot map and per-node pools, in cluster mode */
+	struct cluster *cluster;
+
+	/* one pool per shard, in sharding mode */
+	struct shards *shards;
+
+	/* pools for read-only commands, if any */
+	struct replicas *replicas;
+
+	/* identical read commands in flight, if enabled */
+	struct coalesce *coalesce;
+
+	/* local cache of read replies, if enabled */
+	struct cache *cache;
+
+	/* pub/sub subscriptions shared between clients, on by default */
+	struct hub *hub;
+	struct changes *changes;
+
+	/* large values spliced from Redis to the client, if enabled */
+	struct splice *splice;
+
+	/* large arrays sent in HTTP chunks as they are read, if enabled */
+	struct chunked *chunked;
+
+	/* set by this thread only, read by the others: see worker_update_ready */
+	int ready;
 };
 
 struct worker *
@@ -32,6 +73,12 @@ worker_add_client(struct worker *w, struct http_client *c);
 void
 worker_monitor_input(struct http_client *c);
 
+void
+worker_update_ready(struct worker *w);
+
+int
+worker_is_ready(struct worker *w);
+
 void
 worker_can_read(int fd, short event, void *p);
 
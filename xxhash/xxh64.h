@@ -0,0 +1,11 @@
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* XXH64, a fast non-cryptographic 64-bit hash (https://xxhash.com) */
+uint64_t
+xxh64(const void *p, size_t len, uint64_t seed);
+
+#endif